@@ -1,12 +1,33 @@
+#define _GNU_SOURCE
 #include <dirent.h>
 #include <errno.h>
 #include <limits.h>
+#include <setjmp.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+#ifdef KAISHAKU_LIBGIT2
+#include <git2.h>
+#endif
 
 // Platform-specific includes and definitions
 #ifdef _WIN32
@@ -40,24 +61,68 @@
 #define ACTIVE_FILE safe_path_join(kaishaku_dir, "/.active")
 #define SESSION_TIME_FILE(session) (safe_path_join(SESSION_DIR(session), "time"))
 #define SESSION_DESC_FILE(session) (safe_path_join(SESSION_DIR(session), "desc"))
+#define SESSION_WIP_INDEX_FILE(session) (safe_path_join(SESSION_DIR(session), "wip-index"))
+#define SESSION_SPARSE_FILE(session) (safe_path_join(SESSION_DIR(session), "sparse"))
+#define SPARSE_PREV_FILE (safe_path_join(kaishaku_dir, ".sparse-prev"))
+#define SESSION_NEXT_INDEX_FILE(session) (safe_path_join(SESSION_DIR(session), "index.next"))
+#define SESSION_PRESTAGE_FILE(session) (safe_path_join(SESSION_DIR(session), "prestage"))
+#define SESSION_INDEX_FILE(session) (safe_path_join(SESSION_DIR(session), "index"))
+#define SESSION_INDEX_HEAD_FILE(session) (safe_path_join(SESSION_DIR(session), "index.head"))
+#define MRU_FILE (safe_path_join(kaishaku_dir, ".mru"))
+#define MRU_MAX 16
+#define WIP_REF_PREFIX "refs/kaishaku/wip/"
+#define STORE_INTENT_FILE (safe_path_join(kaishaku_dir, ".intent"))
+#define STORE_STAGE_SUFFIX ".kaishaku-new"
 
 // Global error state
 char error_message[DEFAULT_BUFFER_SIZE];
 
+// Batch mode: commands bail out through longjmp instead of terminating the process,
+// so one failing command does not take the rest of the batch down with it. Only the
+// thread running the batch can jump; a parallel_for worker that gives up still exits.
+int batch_mode = 0;
+jmp_buf batch_env;
+pthread_t batch_thread;
+
+// Deferred writes: metadata changes stay in the store until store_flush(). Batches set it
+// for their whole run; other commands set it to commit several changes together.
+int store_defer = 0;
+
+__attribute__((noreturn)) void kaishaku_exit(int status) {
+    if (batch_mode && pthread_equal(pthread_self(), batch_thread)) {
+        longjmp(batch_env, status + 1);  // setjmp() must never see 0 here
+    }
+    exit(status);
+}
+
+#define exit(status) kaishaku_exit(status)
+
 char *root="";
 #define COMMAND_LIST(X, ...)      \
-    X(checkout, argv2, argv3)     \
+    X(checkout, argc - 2, argv + 2) \
     X(switch, argv2)              \
     X(branch, argv2)              \
-    X(save, argv2)                \
+    X(save, argv2, argv3)         \
     X(exit, argv2)                \
     X(status)                     \
-    X(list)                       \
+    X(list, argc - 2, argv + 2)   \
     X(clean, argv2)               \
     X(config, argc - 2, argv + 2) \
-    X(recover, argv2)             \
+    X(recover, argv2, argv3)      \
     X(rename, argv2, argv3)       \
-    X(abort, argv2)
+    X(abort, argv2)               \
+    X(batch, argc - 2, argv + 2)  \
+    X(watch, argc - 2, argv + 2)  \
+    X(undo, argc - 2, argv + 2)  \
+    X(sparse, argc - 2, argv + 2) \
+    X(prestage, argc - 2, argv + 2) \
+    X(tune, argc - 2, argv + 2) \
+    X(gc, argc - 2, argv + 2) \
+    X(grep, argc - 2, argv + 2) \
+    X(compare, argc - 2, argv + 2) \
+    X(restack, argc - 2, argv + 2) \
+    X(run_all, argc - 2, argv + 2) \
+    X(bench, argc - 2, argv + 2)
 
 #define CMD_NAME(c, ...) " " #c
 
@@ -74,6 +139,13 @@ static const char COMMAND_STRING[] = COMMAND_STRING_LITERAL;
 
 #define CMD(c) ((int)(strstr(COMMAND_STRING, " " c " ") - COMMAND_STRING))
 
+// Commands that never modify session state and so run without the writer lock
+static const char READONLY_COMMANDS[] = " status list config grep compare run-all ";
+
+// Long-running commands that take the writer lock themselves, only around their writes, or
+// leave it to the kaishaku processes they run
+static const char SELF_LOCKING_COMMANDS[] = " watch prestage bench ";
+
 char *kaishaku_dir=NULL;
 
 // All command enums with zero value
@@ -83,6 +155,11 @@ enum { COMMAND_LIST(CMD_ENUM) };
 int get_command_offset(const char* cmd) {
     char search[32];
     snprintf(search, sizeof(search), " %s ", cmd);
+
+    // Commands are C identifiers, so "run-all" is run_all
+    for (char* p = search; *p; p++) {
+        *p = *p == '-' ? '_' : *p;
+    }
     char* found = strstr(COMMAND_STRING, search);
     return found ? (int)(found - COMMAND_STRING) : -1;
 }
@@ -94,30 +171,101 @@ char* safe_path_join(const char* dir, const char* file);
 void ensure_directory_exists(const char* dir);
 int write_to_file(const char* path, const char* content);
 char* read_from_file(const char* path);
+char* read_all_from_file(const char* path);
+int remove_file(const char* path);
+int remove_dir(const char* path);
+int rename_dir(const char* old_path, const char* new_path);
+void remove_session(const char* session);
+void remove_session_refs(const char* session);
+int store_flush(void);
+void ref_queue(const char* op, const char* ref, const char* new_oid, const char* old_oid);
+int ref_commit(const char* message);
+int ref_flush(void);
+void store_recover(void);
+void store_begin_command(void);
+void store_rollback_command(void);
+void acquire_store_lock(void);
+int try_store_lock(void);
+void release_store_lock(void);
 int execute_git_command(const char* cmd, char* output, size_t output_size);
-void cmd_checkout(const char* session, const char* commit);
+char* capture_git_output(const char* cmd);
+int run_git_filter(const char* cmd, const char* input, size_t input_len, char** output);
+void parallel_for(size_t count, int max_workers, void (*fn)(size_t index, void* ctx), void* ctx);
+void json_print_string(FILE* fp, const char* s);
+int run_command(int argc, char* argv[]);
+void cmd_checkout(int argc, char* argv[]);
 void cmd_switch(const char* session);
 void cmd_branch(const char* branch_name);
-void cmd_save(const char* branch_name);
+void cmd_save(const char* branch_name, const char* which);
+void save_dry_run(const char* which);
 void cmd_exit(const char* option);
 void cmd_status(void);
-void cmd_list(void);
+void cmd_list(int argc, char* argv[]);
 void cmd_clean(const char* session);
 void cmd_config(int argc, char* argv[]);
 void load_config(void);
-void cmd_recover(const char* session);
+void cmd_recover(const char* session, const char* commit);
 void cmd_rename(const char* old_name, const char* new_name);
 void cmd_abort(const char* session);
+void cmd_batch(int argc, char* argv[]);
+void cmd_watch(int argc, char* argv[]);
+void cmd_undo(int argc, char* argv[]);
+void cmd_sparse(int argc, char* argv[]);
+void cmd_prestage(int argc, char* argv[]);
+void cmd_tune(int argc, char* argv[]);
+void cmd_gc(int argc, char* argv[]);
+void cmd_grep(int argc, char* argv[]);
+void cmd_compare(int argc, char* argv[]);
+void cmd_restack(int argc, char* argv[]);
+void cmd_run_all(int argc, char* argv[]);
+void cmd_bench(int argc, char* argv[]);
 void update_timestamp(const char* session);
+void record_session_tip(const char* session);
+void leave_active_session(const char* next_session);
 char* get_session_time(const char* session);
+char* read_file_contents(const char* path);
 
 // Configuration options with defaults
 struct {
     int confirm_exit;
     int auto_stash;
     int auto_save;  // Add auto_save configuration
+    char promisor_remote[256];  // Remote missing objects come from in a partial clone
+    int sparse_checkout;        // core.sparseCheckout
+    int prestage;               // kaishaku.prestage: prestage likely next sessions after a switch
+    int checkout_workers;       // kaishaku.checkout.workers, as calibrated by `kaishaku tune`
+    int checkout_threshold;     // kaishaku.checkout.threshold
+    int index_threads;          // kaishaku.index.threads
+    int own_checkout_tuning;    // The repository sets checkout.workers or index.threads itself
+    int gc_expire;              // kaishaku.gc.expire: days after which gc removes any session
 } config = {.confirm_exit = 1, .auto_stash = 0, .auto_save = 0};
 
+// One session as seen by list and the commands that work on many sessions at once
+struct session_info {
+    const char* repo;  // Repository the session belongs to
+    char name[256];
+    char branch[DEFAULT_BUFFER_SIZE];  // Original branch, "" if unknown
+    char head[DEFAULT_BUFFER_SIZE];    // Session HEAD as recorded, "" if unknown
+    char branch_oid[72];               // Resolved object ids, "" if missing
+    char head_oid[72];
+    char subject[256];                 // Of the session HEAD commit, "" if unknown
+    char parent[72];                   // Its first parent
+    long author_time;
+    long time;       // Last modified, 0 if unknown
+    int corrupted;   // session or head file missing
+    int active;
+};
+
+struct session_list {
+    struct session_info* items;
+    size_t count, cap;
+};
+
+int load_session_list(const char* repo, const char* sessions_dir, int use_store,
+                      struct session_list* list);
+int verify_session_list(const char* repo, struct session_list* list);
+void format_session_time(long t, char* buf, size_t size);
+
 // Safe path joining function
 __attribute__((optimize("O2")))  // Avoid -O3 false positive: snprintf() input may alias static buffer (safe).
 char* safe_path1_join(const char* dir, const char* file) {
@@ -164,18 +312,45 @@ void usage(void) {
     printf("%sUsage:%s\n", COLOR_CYAN, COLOR_RESET);
     printf("  %skaishaku checkout%s <session> [<commit>]  Start a new session from commit\n",
            COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku checkout%s <session> [<commit>] --sparse <dir>...\n"
+           "                                         Start a session with only these directories\n",
+           COLOR_YELLOW, COLOR_RESET);
     printf("  %skaishaku switch%s <session>              Switch to an existing session\n",
            COLOR_YELLOW, COLOR_RESET);
     printf("  %skaishaku branch%s <name>                 Create a branch from current session\n",
            COLOR_YELLOW, COLOR_RESET);
     printf("  %skaishaku save%s <name>                   Save session changes to original branch\n",
            COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku save%s --dry-run [--all | <session>]  Predict conflicts without merging\n",
+           COLOR_YELLOW, COLOR_RESET);
     printf("  %skaishaku status%s                        Show current session status\n",
            COLOR_YELLOW, COLOR_RESET);
-    printf("  %skaishaku list%s                          List all sessions\n", COLOR_YELLOW,
+    printf("  %skaishaku list%s [--stats] [--json]       List all sessions\n", COLOR_YELLOW,
            COLOR_RESET);
+    printf("  %skaishaku list%s --touching <path>        List sessions whose commits change path\n",
+           COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku list%s --repos <path>... | --root <dir> [--json] [--jobs <n>]\n"
+           "                                         List sessions across many repositories\n",
+           COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku grep%s [-i] [-E|-F] [-l] <pattern> [<session>...]\n"
+           "                                         Search the files of every session\n",
+           COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku compare%s [--json] [<session>...]  Compare sessions with their branch and "
+           "each other\n",
+           COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku restack%s [--all | <session>...]  Rebase sessions onto their branch\n",
+           COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku run-all%s [--jobs <n>] [--mem <MiB>] [--json] [<session>...] "
+           "-- <command>\n"
+           "                                         Run a command in every session's worktree\n",
+           COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku run-all%s --clean               Remove the pooled worktrees\n",
+           COLOR_YELLOW, COLOR_RESET);
     printf("  %skaishaku clean%s [<session>]             Remove session(s)\n", COLOR_YELLOW,
            COLOR_RESET);
+    printf("  %skaishaku gc%s [--dry-run] [--older-than <days>]  Remove merged and stale "
+           "sessions\n",
+           COLOR_YELLOW, COLOR_RESET);
     printf(
         "  %skaishaku exit%s [--force | --keep | --save | --no-save]  Exit session and return to "
         "original branch\n",
@@ -184,10 +359,31 @@ void usage(void) {
            COLOR_YELLOW, COLOR_RESET);
     printf("  %skaishaku recover%s <session>             Recover a corrupted session\n",
            COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku recover%s [--deep]              Find lost commits of every session\n",
+           COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku recover%s <session> <commit>    Point a session at a recovered commit\n",
+           COLOR_YELLOW, COLOR_RESET);
     printf("  %skaishaku rename%s <old> <new>            Rename a session\n", COLOR_YELLOW,
            COLOR_RESET);
     printf("  %skaishaku abort%s [<session>]             Abort and clean up a session\n",
            COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku batch%s [-z]                    Run commands read from stdin\n",
+           COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku watch%s [--debounce <ms>]       Snapshot work in progress as you edit\n",
+           COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku undo%s [<n>] | --list [<n>]     Undo the last n session operations\n",
+           COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku sparse%s [set|add <dir>... | disable]  Show or change the session's "
+           "cone\n",
+           COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku prestage%s [<n>]                Prepare the n most recent sessions for "
+           "a fast switch\n",
+           COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku tune%s [--reset]                Measure the best parallel checkout "
+           "settings\n",
+           COLOR_YELLOW, COLOR_RESET);
+    printf("  %skaishaku bench%s [-n <iterations>]       Time commands with each git backend\n",
+           COLOR_YELLOW, COLOR_RESET);
     printf("  %skaishaku help%s                          Show this help message\n", COLOR_YELLOW,
            COLOR_RESET);
 
@@ -196,15 +392,314 @@ void usage(void) {
            COLOR_RESET);
     printf("  %sauto.stash%s      Whether to auto-stash changes on exit (0/1)\n", COLOR_YELLOW,
            COLOR_RESET);
-    printf("  %sauto.save%s       Whether to auto-save changes on exit (0/1)\n\n", COLOR_YELLOW,
+    printf("  %sauto.save%s       Whether to auto-save changes on exit (0/1)\n", COLOR_YELLOW,
            COLOR_RESET);
+    printf("  %sprestage%s        Prestage likely next sessions in the background (0/1)\n",
+           COLOR_YELLOW, COLOR_RESET);
+    printf("  %sgc.expire%s       Days after which gc removes unused sessions (0 = never)\n\n",
+           COLOR_YELLOW, COLOR_RESET);
     exit(0);
 }
 
+// In-memory view of the session metadata files. Every file is read from disk at most
+// once per process, and the strings handed out stay valid until exit, so callers can
+// hold several of them at the same time. While store_defer is set, writes and removals
+// are kept here as well and committed together by store_flush().
+#define STORE_BUCKETS 1024
+
+struct store_entry {
+    char* path;
+    char* content;  // NULL when the file (or directory) does not exist
+    int is_dir;
+    int dirty;      // Pending change not yet applied to disk
+    struct store_entry* next;
+};
+
+struct store_entry* store[STORE_BUCKETS];
+
+static unsigned store_hash(const char* path) {
+    unsigned h = 2166136261u;
+    while (*path) {
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    }
+    return h % STORE_BUCKETS;
+}
+
+static struct store_entry* store_lookup(const char* path) {
+    for (struct store_entry* e = store[store_hash(path)]; e; e = e->next) {
+        if (strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static struct store_entry* store_insert(const char* path, int is_dir) {
+    struct store_entry* e = store_lookup(path);
+    if (e) {
+        return e;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (!e || !(e->path = strdup(path))) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    e->is_dir = is_dir;
+
+    unsigned h = store_hash(path);
+    e->next = store[h];
+    store[h] = e;
+    return e;
+}
+
+static void store_set(struct store_entry* e, const char* content) {
+    // Old content is intentionally not freed: earlier callers may still hold it.
+    e->content = content ? strdup(content) : NULL;
+    if (content && !e->content) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// What each entry looked like before the running batch command first changed it, so
+// the changes of a command that fails can be taken back (store_rollback_command).
+struct store_undo {
+    char* path;
+    char* content;
+    int is_dir;
+    int dirty;
+};
+
+static struct store_undo* store_undo;
+static size_t store_undo_len, store_undo_cap;
+
+static void store_remember(const struct store_entry* e) {
+    if (!batch_mode) {
+        return;
+    }
+    for (size_t i = 0; i < store_undo_len; i++) {
+        if (strcmp(store_undo[i].path, e->path) == 0) {
+            return;
+        }
+    }
+
+    if (store_undo_len == store_undo_cap) {
+        store_undo_cap = store_undo_cap ? store_undo_cap * 2 : 64;
+        store_undo = realloc(store_undo, store_undo_cap * sizeof(*store_undo));
+        if (!store_undo) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct store_undo* u = &store_undo[store_undo_len];
+    if (!(u->path = strdup(e->path))) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    u->content = e->content;
+    u->is_dir = e->is_dir;
+    u->dirty = e->dirty;
+    store_undo_len++;
+}
+
+// Write a file through a temporary sibling and rename(), so it is replaced in one step and
+// concurrent readers see either the old or the new record, never a truncated one.
+static int write_file_replace(const char* path, const char* content) {
+    char tmp_path[MAX_PATH_LENGTH];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%ld", path, (long)getpid()) >=
+        (int)sizeof(tmp_path)) {
+        fprintf(stderr, "Error: Path too long: %s\n", path);
+        return 0;
+    }
+
+    FILE* fp = fopen(tmp_path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: Failed to write to %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    fprintf(fp, "%s\n", content);
+    if (ferror(fp) || fclose(fp) != 0) {
+        fprintf(stderr, "Error: Failed to write to %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        return 0;
+    }
+
+    if (rename(tmp_path, path) == -1) {
+        fprintf(stderr, "Error: Failed to write to %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Serialize writers on .git/kaishaku/.lock. Readers never take it: every record is
+// replaced by rename(), so they always see a complete file. The lock is released
+// when the process exits, or earlier by release_store_lock().
+static int store_lock_fd = -1;
+
+void acquire_store_lock(void) {
+#ifndef _WIN32
+    if (store_lock_fd != -1) {
+        return;
+    }
+
+    char* lock_path = safe_path_join(kaishaku_dir, ".lock");
+    int fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Error: Failed to open %s: %s\n", lock_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        if (errno != EWOULDBLOCK) {
+            fprintf(stderr, "Error: Failed to lock %s: %s\n", lock_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        fprintf(stderr, "%sWaiting for another kaishaku process...%s\n", COLOR_YELLOW,
+                COLOR_RESET);
+        while (flock(fd, LOCK_EX) == -1) {
+            if (errno != EINTR) {
+                fprintf(stderr, "Error: Failed to lock %s: %s\n", lock_path, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    store_lock_fd = fd;
+    free(lock_path);
+#endif
+    store_recover();
+}
+
+// Take the writer lock only if it is free right now. Returns 0 when another process holds
+// it, for background work that would rather skip a round than hold up a user's command.
+int try_store_lock(void) {
+#ifndef _WIN32
+    if (store_lock_fd != -1) {
+        return 1;
+    }
+
+    char* lock_path = safe_path_join(kaishaku_dir, ".lock");
+    int fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    free(lock_path);
+    if (fd == -1) {
+        return 0;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        close(fd);
+        return 0;
+    }
+    store_lock_fd = fd;
+#endif
+    store_recover();
+    return 1;
+}
+
+void release_store_lock(void) {
+    if (store_lock_fd != -1) {
+        close(store_lock_fd);
+        store_lock_fd = -1;
+    }
+}
+
 int file_exists(const char* filename) {
+    struct store_entry* e = store_lookup(filename);
+    if (e) {
+        return e->content != NULL;
+    }
     return access(filename, F_OK) != -1;
 }
 
+int remove_file(const char* path) {
+    if (!file_exists(path)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (!store_defer && unlink(path) == -1) {
+        return -1;
+    }
+
+    struct store_entry* e = store_insert(path, 0);
+    store_remember(e);
+    store_set(e, NULL);
+    e->dirty = store_defer;
+    return 0;
+}
+
+int remove_dir(const char* path) {
+    if (!file_exists(path)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (!store_defer && rmdir(path) == -1) {
+        return -1;
+    }
+
+    struct store_entry* e = store_insert(path, 1);
+    store_remember(e);
+    store_set(e, NULL);
+    e->dirty = store_defer;
+    return 0;
+}
+
+// Rename a directory on disk and move any cached entries below it along with it.
+int rename_dir(const char* old_path, const char* new_path) {
+    if (rename(old_path, new_path) == -1) {
+        return -1;
+    }
+
+    size_t old_len = strlen(old_path);
+    for (int i = 0; i < STORE_BUCKETS; i++) {
+        struct store_entry** link = &store[i];
+        while (*link) {
+            struct store_entry* e = *link;
+            if (strncmp(e->path, old_path, old_len) != 0 ||
+                (e->path[old_len] != '/' && e->path[old_len] != '\0')) {
+                link = &e->next;
+                continue;
+            }
+
+            *link = e->next;
+
+            char moved[MAX_PATH_LENGTH];
+            snprintf(moved, sizeof(moved), "%s%s", new_path, e->path + old_len);
+            struct store_entry* target = store_insert(moved, e->is_dir);
+            target->content = e->content;
+            target->dirty = e->dirty;
+            free(e->path);
+            free(e);
+        }
+    }
+
+    return 0;
+}
+
+// Queue deletion of the refs kept for a session. Refs that do not exist are fine.
+void remove_session_refs(const char* session) {
+    char ref[DEFAULT_BUFFER_SIZE];
+    snprintf(ref, sizeof(ref), WIP_REF_PREFIX "%s", session);
+    ref_queue("delete", ref, NULL, NULL);
+}
+
+void remove_session(const char* session) {
+    remove_file(SESSION_FILE(session));
+    remove_file(HEAD_FILE(session));
+    remove_file(SESSION_TIME_FILE(session));
+    remove_file(SESSION_DESC_FILE(session));
+    remove_file(SESSION_WIP_INDEX_FILE(session));
+    remove_file(SESSION_SPARSE_FILE(session));
+    remove_file(SESSION_NEXT_INDEX_FILE(session));
+    remove_file(SESSION_PRESTAGE_FILE(session));
+    remove_file(SESSION_INDEX_FILE(session));
+    remove_file(SESSION_INDEX_HEAD_FILE(session));
+}
+
 char *get_git_root(void) {
     FILE *fp = popen("git rev-parse --show-toplevel", "r");
     if (!fp) {
@@ -245,32 +740,47 @@ void ensure_directory_exists(const char* dir) {
         fprintf(stderr, "Error: %s exists but is not a directory\n", dir);
         exit(EXIT_FAILURE);
     }
+
+    // Recreating a directory cancels a removal still pending in the store
+    struct store_entry* e = store_lookup(dir);
+    if (e && !e->content) {
+        store_remember(e);
+        store_set(e, "");
+        e->dirty = 0;
+    }
 }
 
 int write_to_file(const char* path, const char* content) {
-    FILE* fp = fopen(path, "w");
-    if (!fp) {
-        fprintf(stderr, "Error: Failed to write to %s: %s\n", path, strerror(errno));
-        return 0;
+    struct store_entry* e = store_insert(path, 0);
+
+    if (store_defer) {
+        store_remember(e);
+        store_set(e, content);
+        e->dirty = 1;
+        return 1;
     }
 
-    fprintf(fp, "%s\n", content);
-    if (ferror(fp)) {
-        fprintf(stderr, "Error: Failed to write to %s: %s\n", path, strerror(errno));
-        fclose(fp);
+    if (!write_file_replace(path, content)) {
         return 0;
     }
 
-    fclose(fp);
+    store_set(e, content);
     return 1;
 }
 
 char* read_from_file(const char* path) {
-    static char buffer[DEFAULT_BUFFER_SIZE];
+    struct store_entry* e = store_lookup(path);
+    if (e) {
+        return e->content;
+    }
+
+    char buffer[DEFAULT_BUFFER_SIZE];
 
     FILE* fp = fopen(path, "r");
-    if (!fp)
+    if (!fp) {
+        store_insert(path, 0);  // Remember that it is missing
         return NULL;
+    }
 
     if (!fgets(buffer, sizeof(buffer), fp)) {
         fclose(fp);
@@ -285,7 +795,29 @@ char* read_from_file(const char* path) {
         buffer[len - 1] = '\0';
     }
 
-    return buffer;
+    e = store_insert(path, 0);
+    store_set(e, buffer);
+    return e->content;
+}
+
+// Like read_from_file, but for files holding a list: the whole content, one item per line.
+char* read_all_from_file(const char* path) {
+    struct store_entry* e = store_lookup(path);
+    if (e) {
+        return e->content;
+    }
+
+    char* data = read_file_contents(path);
+    e = store_insert(path, 0);
+    if (data) {
+        size_t len = strlen(data);
+        if (len > 0 && data[len - 1] == '\n') {
+            data[len - 1] = '\0';
+        }
+        store_set(e, data);
+        free(data);
+    }
+    return e->content;
 }
 
 int execute_git_command(const char* cmd, char* output, size_t output_size) {
@@ -309,6 +841,11 @@ int execute_git_command(const char* cmd, char* output, size_t output_size) {
         }
     }
 
+    // Drain the rest so the command never dies of SIGPIPE when pclose closes the pipe
+    char discard[DEFAULT_BUFFER_SIZE];
+    while (fread(discard, 1, sizeof(discard), fp) > 0) {
+    }
+
     int status = pclose(fp);
     if (status == -1 || WEXITSTATUS(status) != 0) {
         snprintf(error_message, sizeof(error_message), "Command failed with status %d: %s",
@@ -319,790 +856,8978 @@ int execute_git_command(const char* cmd, char* output, size_t output_size) {
     return 1;
 }
 
-void cmd_checkout(const char* session, const char* commit) {
-    if (!session)
-        usage();
-    ensure_directory_exists(kaishaku_dir);
-
-    char* session_dir = SESSION_DIR(session);
-    ensure_directory_exists(session_dir);
-
-    char current_branch[DEFAULT_BUFFER_SIZE];
-    if (!execute_git_command("git rev-parse --abbrev-ref HEAD", current_branch,
-                             sizeof(current_branch))) {
-        fprintf(stderr, "Error: %s\n", error_message);
-        exit(EXIT_FAILURE);
+// Run a command and return its whole standard output in a malloc'd buffer.
+char* capture_git_output(const char* cmd) {
+    FILE* fp = popen(cmd, "r");
+    if (!fp) {
+        snprintf(error_message, sizeof(error_message), "Failed to execute command: %s", cmd);
+        return NULL;
     }
 
-    if (!write_to_file(SESSION_FILE(session), current_branch)) {
+    size_t len = 0, cap = 4096;
+    char* output = malloc(cap);
+    if (!output) {
+        perror("malloc");
         exit(EXIT_FAILURE);
     }
 
-    char head_hash[DEFAULT_BUFFER_SIZE];
-    if (!commit) {
-        if (!execute_git_command("git rev-parse HEAD", head_hash, sizeof(head_hash))) {
-            fprintf(stderr, "Error: %s\n", error_message);
-            exit(EXIT_FAILURE);
+    size_t n;
+    while ((n = fread(output + len, 1, cap - len - 1, fp)) > 0) {
+        len += n;
+        if (cap - len - 1 == 0) {
+            cap *= 2;
+            output = realloc(output, cap);
+            if (!output) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
         }
-        commit = head_hash;
-    }
-
-    if (!write_to_file(HEAD_FILE(session), commit)) {
-        exit(EXIT_FAILURE);
     }
+    output[len] = '\0';
 
-    if (!write_to_file(ACTIVE_FILE, session)) {
-        exit(EXIT_FAILURE);
+    int status = pclose(fp);
+    if (status == -1 || WEXITSTATUS(status) != 0) {
+        snprintf(error_message, sizeof(error_message), "Command failed with status %d: %s",
+                 WEXITSTATUS(status), cmd);
+        free(output);
+        return NULL;
     }
 
-    update_timestamp(session);  // Update timestamp when creating session
-
-    char git_cmd[DEFAULT_BUFFER_SIZE + 27];
-    snprintf(git_cmd, sizeof(git_cmd), "git checkout %s --detach", commit);
+    return output;
+}
 
-    if (!execute_git_command(git_cmd, NULL, 0)) {
-        fprintf(stderr, "Error: %s\n", error_message);
-        exit(EXIT_FAILURE);
+// Print s as a JSON string literal, dropping the terminal color sequences.
+void json_print_string(FILE* fp, const char* s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '\033' && s[1] == '[') {
+            s += 2;
+            while (*s && *s != 'm') {
+                s++;
+            }
+            if (!*s) {
+                break;
+            }
+        } else if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c == '\n') {
+            fputs("\\n", fp);
+        } else if (c == '\t') {
+            fputs("\\t", fp);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
     }
-
-    printf("%sSession '%s' started at %s%s\n", COLOR_GREEN, session, commit, COLOR_RESET);
+    fputc('"', fp);
 }
 
-void cmd_switch(const char* session) {
-    if (!session)
-        usage();
-
-    ensure_directory_exists(kaishaku_dir);
+// Run a shell command, feed it input on stdin and collect all of its stdout into a
+// malloc'd buffer. Unlike popen() this can both write and read without deadlocking, and
+// it is safe to call from worker threads. Returns the exit status, or -1 if the command
+// could not be run.
+int run_git_filter(const char* cmd, const char* input, size_t input_len, char** output) {
+    int in_pipe[2], out_pipe[2];
+    *output = NULL;
 
-    const char* target_head = read_from_file(HEAD_FILE(session));
-    if (!target_head) {
-        fprintf(stderr, "Error: Session '%s' not found.\n", session);
-        exit(EXIT_FAILURE);
+    if (pipe2(in_pipe, O_CLOEXEC) == -1) {
+        snprintf(error_message, sizeof(error_message), "Failed to execute command: %s", cmd);
+        return -1;
     }
-
-    if (!write_to_file(ACTIVE_FILE, session)) {
-        exit(EXIT_FAILURE);
+    if (pipe2(out_pipe, O_CLOEXEC) == -1) {
+        close(in_pipe[0]);
+        close(in_pipe[1]);
+        snprintf(error_message, sizeof(error_message), "Failed to execute command: %s", cmd);
+        return -1;
     }
 
-    update_timestamp(session);  // Update timestamp when switching to session
-
-    char git_cmd[DEFAULT_BUFFER_SIZE];
-    snprintf(git_cmd, sizeof(git_cmd), "git checkout %s --detach", target_head);
+    // A child that stops reading early must not kill us with SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
 
-    if (!execute_git_command(git_cmd, NULL, 0)) {
-        fprintf(stderr, "Error: %s\n", error_message);
-        exit(EXIT_FAILURE);
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        dup2(in_pipe[0], STDIN_FILENO);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+        _exit(127);
     }
 
-    printf("%sSwitched to session '%s'%s\n", COLOR_GREEN, session, COLOR_RESET);
-}
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+    if (pid == -1) {
+        close(in_pipe[1]);
+        close(out_pipe[0]);
+        snprintf(error_message, sizeof(error_message), "Failed to execute command: %s", cmd);
+        return -1;
+    }
 
-void cmd_branch(const char* branch_name) {
-    if (!branch_name)
-        usage();
+    fcntl(in_pipe[1], F_SETFL, O_NONBLOCK);
 
-    if (!file_exists(ACTIVE_FILE)) {
-        fprintf(stderr, "Error: No active kaishaku session.\n");
+    size_t len = 0, cap = 4096, written = 0;
+    char* buf = malloc(cap);
+    if (!buf) {
+        perror("malloc");
         exit(EXIT_FAILURE);
     }
 
-    char git_cmd[DEFAULT_BUFFER_SIZE];
-    snprintf(git_cmd, sizeof(git_cmd), "git checkout -b %s", branch_name);
+    int in_fd = in_pipe[1];
+    if (input_len == 0) {
+        close(in_fd);
+        in_fd = -1;
+    }
 
-    if (!execute_git_command(git_cmd, NULL, 0)) {
+    for (;;) {
+        struct pollfd fds[2] = {{out_pipe[0], POLLIN, 0}, {in_fd, POLLOUT, 0}};
+        if (poll(fds, in_fd != -1 ? 2 : 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (in_fd != -1 && (fds[1].revents & (POLLOUT | POLLERR | POLLHUP))) {
+            ssize_t n = write(in_fd, input + written, input_len - written);
+            if (n > 0) {
+                written += (size_t)n;
+            }
+            if ((n == -1 && errno != EAGAIN) || written == input_len) {
+                close(in_fd);
+                in_fd = -1;
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (cap - len < 4096) {
+                cap *= 2;
+                buf = realloc(buf, cap);
+                if (!buf) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            ssize_t n = read(out_pipe[0], buf + len, cap - len - 1);
+            if (n > 0) {
+                len += (size_t)n;
+            } else if (n == 0 || errno != EINTR) {
+                break;
+            }
+        }
+    }
+
+    if (in_fd != -1) {
+        close(in_fd);
+    }
+    close(out_pipe[0]);
+    buf[len] = '\0';
+    *output = buf;
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        snprintf(error_message, sizeof(error_message), "Command failed with status %d: %s",
+                 WIFEXITED(status) ? WEXITSTATUS(status) : -1, cmd);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+    return 0;
+}
+
+// Minimal work-sharing pool: fn is called once for every index in [0, count) from at
+// most max_workers threads (0 means one per online CPU).
+struct parallel_job {
+    size_t next, count;
+    void (*fn)(size_t index, void* ctx);
+    void* ctx;
+    pthread_mutex_t lock;
+};
+
+static void* parallel_worker(void* arg) {
+    struct parallel_job* job = arg;
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        size_t index = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if (index >= job->count) {
+            return NULL;
+        }
+        job->fn(index, job->ctx);
+    }
+}
+
+static long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int online_cpus(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+void parallel_for(size_t count, int max_workers, void (*fn)(size_t index, void* ctx), void* ctx) {
+    struct parallel_job job = {.next = 0, .count = count, .fn = fn, .ctx = ctx};
+    pthread_mutex_init(&job.lock, NULL);
+
+    if (max_workers <= 0) {
+        max_workers = online_cpus();
+    }
+    if ((size_t)max_workers > count) {
+        max_workers = (int)count;
+    }
+
+    pthread_t threads[64];
+    int started = 0;
+    while (started < max_workers && started < 64 &&
+           pthread_create(&threads[started], NULL, parallel_worker, &job) == 0) {
+        started++;
+    }
+
+    // Without any thread the caller does the work itself
+    if (started == 0) {
+        parallel_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+}
+
+// Quote a string for use as one word in a /bin/sh command line.
+char* shell_quote(const char* s) {
+    size_t len = 2;
+    for (const char* p = s; *p; p++) {
+        len += *p == '\'' ? 4 : 1;
+    }
+
+    char* quoted = malloc(len + 1);
+    if (!quoted) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    char* out = quoted;
+    *out++ = '\'';
+    for (const char* p = s; *p; p++) {
+        if (*p == '\'') {
+            memcpy(out, "'\\''", 4);
+            out += 4;
+        } else {
+            *out++ = *p;
+        }
+    }
+    *out++ = '\'';
+    *out = '\0';
+    return quoted;
+}
+
+static void append_line(char** buf, size_t* len, size_t* cap, const char* text) {
+    size_t n = strlen(text);
+    while (*len + n + 2 > *cap) {
+        *cap = *cap ? *cap * 2 : 4096;
+        *buf = realloc(*buf, *cap);
+        if (!*buf) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(*buf + *len, text, n);
+    (*buf)[*len + n] = '\n';
+    *len += n + 1;
+    (*buf)[*len] = '\0';
+}
+
+// Git backends. Ref lookups and updates and the status checks on the switch path go
+// through one of these instead of a hand-written git command line. The exec backend runs
+// git for each call; the libgit2 one, built with -DKAISHAKU_LIBGIT2 -lgit2, answers them
+// in process. Setting KAISHAKU_BACKEND=exec picks the exec backend in such a build.
+// Every operation returns 1 on success and 0, with error_message set, on failure.
+struct git_backend {
+    const char* name;
+    // Object id rev names, as `rev-parse --verify` gives it
+    int (*resolve)(const char* rev, char* oid, size_t size);
+    // Short name of the checked out branch, "HEAD" when detached
+    int (*head_branch)(char* branch, size_t size);
+    // Whether the index matches HEAD, and the working tree the index
+    int (*index_clean)(void);
+    int (*worktree_clean)(void);
+    // Whether anything at all would show in `git status`, untracked files included
+    int (*has_changes)(void);
+    // Point ref at new_oid without following symbolic refs, or delete it when new_oid is
+    // NULL; fails if old_oid is given and the ref is not there
+    int (*update_ref)(const char* ref, const char* new_oid, const char* old_oid,
+                      const char* message);
+};
+
+static int exec_resolve(const char* rev, char* oid, size_t size) {
+    char cmd[DEFAULT_BUFFER_SIZE * 2];
+    char* quoted = shell_quote(rev);
+    snprintf(cmd, sizeof(cmd), "git rev-parse -q --verify %s", quoted);
+    free(quoted);
+    return execute_git_command(cmd, oid, size);
+}
+
+static int exec_head_branch(char* branch, size_t size) {
+    return execute_git_command("git rev-parse --abbrev-ref HEAD", branch, size);
+}
+
+static int exec_index_clean(void) {
+    return execute_git_command("git diff-index --cached --quiet HEAD", NULL, 0);
+}
+
+static int exec_worktree_clean(void) {
+    return execute_git_command("git diff-files --quiet", NULL, 0);
+}
+
+static int exec_has_changes(void) {
+    char line[DEFAULT_BUFFER_SIZE] = "";
+    return execute_git_command("git status --porcelain", line, sizeof(line)) && line[0];
+}
+
+static int exec_update_ref(const char* ref, const char* new_oid, const char* old_oid,
+                           const char* message) {
+    char cmd[DEFAULT_BUFFER_SIZE * 4];
+    char* quoted = shell_quote(message);
+    char* quoted_ref = shell_quote(ref);
+    snprintf(cmd, sizeof(cmd), "git update-ref -m %s --no-deref %s %s %s %s", quoted,
+             new_oid ? "" : "-d", quoted_ref, new_oid ? new_oid : "", old_oid ? old_oid : "");
+    free(quoted);
+    free(quoted_ref);
+    return execute_git_command(cmd, NULL, 0);
+}
+
+static const struct git_backend exec_backend = {
+    "exec",          exec_resolve,        exec_head_branch, exec_index_clean,
+    exec_worktree_clean, exec_has_changes, exec_update_ref,
+};
+
+#ifdef KAISHAKU_LIBGIT2
+static git_repository* lg2_repository;
+
+static int lg2_fail(const char* what) {
+    const git_error* e = git_error_last();
+    snprintf(error_message, sizeof(error_message), "%s: %s", what,
+             e && e->message ? e->message : "unknown error");
+    return 0;
+}
+
+// Opened on first use, at the top of the working tree like every git command we run
+static git_repository* lg2_repo(void) {
+    if (!lg2_repository) {
+        git_libgit2_init();
+        if (git_repository_open_ext(&lg2_repository, root[0] ? root : ".", 0, NULL) != 0) {
+            lg2_fail("Failed to open repository");
+            fprintf(stderr, "Error: %s\n", error_message);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return lg2_repository;
+}
+
+// The index as it is on disk now, since git commands may have replaced it meanwhile
+static git_index* lg2_index(void) {
+    git_index* index;
+    if (git_repository_index(&index, lg2_repo()) != 0) {
+        lg2_fail("Failed to read the index");
+        return NULL;
+    }
+    if (git_index_read(index, 0) != 0) {
+        lg2_fail("Failed to read the index");
+        git_index_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+static int lg2_oid(const char* rev, git_oid* oid) {
+    git_object* obj;
+    if (git_revparse_single(&obj, lg2_repo(), rev) != 0) {
+        return lg2_fail(rev);
+    }
+    git_oid_cpy(oid, git_object_id(obj));
+    git_object_free(obj);
+    return 1;
+}
+
+static int lg2_resolve(const char* rev, char* oid, size_t size) {
+    git_oid id;
+    if (!lg2_oid(rev, &id)) {
+        return 0;
+    }
+    git_oid_tostr(oid, size, &id);
+    return 1;
+}
+
+static int lg2_head_branch(char* branch, size_t size) {
+    git_reference* head;
+    if (git_repository_head(&head, lg2_repo()) != 0) {
+        return lg2_fail("HEAD");
+    }
+    snprintf(branch, size, "%s",
+             git_reference_is_branch(head) ? git_reference_shorthand(head) : "HEAD");
+    git_reference_free(head);
+    return 1;
+}
+
+static int lg2_index_clean(void) {
+    git_object* tree;
+    git_index* index = lg2_index();
+    git_diff* diff = NULL;
+    int clean = 0;
+    if (!index) {
+        return 0;
+    }
+    if (git_revparse_single(&tree, lg2_repo(), "HEAD^{tree}") != 0) {
+        git_index_free(index);
+        return lg2_fail("HEAD");
+    }
+    if (git_diff_tree_to_index(&diff, lg2_repo(), (git_tree*)tree, index, NULL) == 0) {
+        clean = git_diff_num_deltas(diff) == 0;
+    } else {
+        lg2_fail("Failed to compare the index with HEAD");
+    }
+    git_diff_free(diff);
+    git_object_free(tree);
+    git_index_free(index);
+    return clean;
+}
+
+static int lg2_worktree_clean(void) {
+    git_index* index = lg2_index();
+    git_diff* diff = NULL;
+    int clean = 0;
+    if (!index) {
+        return 0;
+    }
+    if (git_diff_index_to_workdir(&diff, lg2_repo(), index, NULL) == 0) {
+        clean = git_diff_num_deltas(diff) == 0;
+    } else {
+        lg2_fail("Failed to compare the working tree with the index");
+    }
+    git_diff_free(diff);
+    git_index_free(index);
+    return clean;
+}
+
+static int lg2_has_changes(void) {
+    git_status_options opts;
+    git_status_list* status;
+    git_status_options_init(&opts, GIT_STATUS_OPTIONS_VERSION);
+    opts.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED;
+    if (git_status_list_new(&status, lg2_repo(), &opts) != 0) {
+        return lg2_fail("Failed to read status");
+    }
+    int changed = git_status_list_entrycount(status) > 0;
+    git_status_list_free(status);
+    return changed;
+}
+
+static int lg2_update_ref(const char* ref, const char* new_oid, const char* old_oid,
+                          const char* message) {
+    git_oid id, old_id;
+    git_reference* out;
+    if (old_oid && !lg2_oid(old_oid, &old_id)) {
+        return 0;
+    }
+
+    if (!new_oid) {
+        if (git_reference_lookup(&out, lg2_repo(), ref) != 0) {
+            return lg2_fail(ref);
+        }
+        int ok = (!old_oid || (git_reference_target(out) &&
+                               git_oid_equal(git_reference_target(out), &old_id))) &&
+                 git_reference_delete(out) == 0;
+        git_reference_free(out);
+        return ok || lg2_fail(ref);
+    }
+
+    if (!lg2_oid(new_oid, &id) || git_reference_create_matching(&out, lg2_repo(), ref, &id, 1,
+                                                                old_oid ? &old_id : NULL,
+                                                                message) != 0) {
+        return lg2_fail(ref);
+    }
+    git_reference_free(out);
+    return 1;
+}
+
+static const struct git_backend libgit2_backend = {
+    "libgit2",          lg2_resolve,     lg2_head_branch, lg2_index_clean,
+    lg2_worktree_clean, lg2_has_changes, lg2_update_ref,
+};
+#endif
+
+static const struct git_backend* const git_backends[] = {
+#ifdef KAISHAKU_LIBGIT2
+    &libgit2_backend,
+#endif
+    &exec_backend,
+};
+
+const struct git_backend* git;
+
+static void select_git_backend(void) {
+    const char* name = getenv("KAISHAKU_BACKEND");
+    git = git_backends[0];
+    for (size_t i = 0; name && i < sizeof(git_backends) / sizeof(git_backends[0]); i++) {
+        if (strcmp(git_backends[i]->name, name) == 0) {
+            git = git_backends[i];
+        }
+    }
+}
+
+// Pending ref transaction. Commands queue create/update/delete instructions here instead
+// of running update-ref per ref, and everything queued is applied atomically by one
+// `git update-ref --stdin`: either every ref moves or none does. While writes are deferred
+// the transaction stays open until store_flush(), so a whole batch costs one process.
+struct ref_transaction {
+    char* buf;
+    size_t len, cap;
+    size_t count;
+    char message[DEFAULT_BUFFER_SIZE];
+} ref_tx;
+
+// op is "create", "update" or "delete". An old value makes the instruction fail, and the
+// transaction with it, if the ref has moved in the meantime; NULL skips the check.
+void ref_queue(const char* op, const char* ref, const char* new_oid, const char* old_oid) {
+    char line[DEFAULT_BUFFER_SIZE * 2];
+    int n = snprintf(line, sizeof(line), "%s %s", op, ref);
+    if (new_oid && n < (int)sizeof(line)) {
+        n += snprintf(line + n, sizeof(line) - n, " %s", new_oid);
+    }
+    if (old_oid && n < (int)sizeof(line)) {
+        n += snprintf(line + n, sizeof(line) - n, " %s", old_oid);
+    }
+    if (n >= (int)sizeof(line)) {
+        fprintf(stderr, "Error: Ref name too long: %s\n", ref);
+        exit(EXIT_FAILURE);
+    }
+    // Whitespace would split the instruction, so a bad name could smuggle in another one
+    for (const char* p = ref; *p; p++) {
+        if ((unsigned char)*p <= ' ' || *p == 0x7f) {
+            fprintf(stderr, "Error: Invalid ref name: %s\n", ref);
+            exit(EXIT_FAILURE);
+        }
+    }
+    append_line(&ref_tx.buf, &ref_tx.len, &ref_tx.cap, line);
+    ref_tx.count++;
+}
+
+// Apply everything queued so far. The reflog message of the first caller wins.
+int ref_flush(void) {
+    if (ref_tx.count == 0) {
+        return 1;
+    }
+
+    char cmd[DEFAULT_BUFFER_SIZE * 5];
+    char* quoted = shell_quote(ref_tx.message[0] ? ref_tx.message : "kaishaku");
+    snprintf(cmd, sizeof(cmd), "git update-ref -m %s --stdin", quoted);
+    free(quoted);
+
+    char* output = NULL;
+    int status = run_git_filter(cmd, ref_tx.buf, ref_tx.len, &output);
+    free(output);
+    if (status != 0) {
+        fprintf(stderr, "Error: Failed to update %zu ref(s); none were changed.\n", ref_tx.count);
+    }
+
+    free(ref_tx.buf);
+    memset(&ref_tx, 0, sizeof(ref_tx));
+    return status == 0;
+}
+
+// End of a command's ref changes: applied now, or with the rest of the deferred writes.
+int ref_commit(const char* message) {
+    if (ref_tx.count && !ref_tx.message[0]) {
+        snprintf(ref_tx.message, sizeof(ref_tx.message), "%s", message);
+    }
+    return store_defer || ref_flush();
+}
+
+// Batch commands: a command's deferred file and ref changes are taken back if it fails,
+// so the batch commits only what its successful commands did.
+static size_t ref_mark_len, ref_mark_count;
+
+void store_begin_command(void) {
+    for (size_t i = 0; i < store_undo_len; i++) {
+        free(store_undo[i].path);
+    }
+    store_undo_len = 0;
+    ref_mark_len = ref_tx.len;
+    ref_mark_count = ref_tx.count;
+}
+
+void store_rollback_command(void) {
+    for (size_t i = store_undo_len; i-- > 0;) {
+        struct store_entry* e = store_insert(store_undo[i].path, store_undo[i].is_dir);
+        e->content = store_undo[i].content;
+        e->dirty = store_undo[i].dirty;
+    }
+    store_begin_command();
+
+    ref_tx.len = ref_mark_len;
+    ref_tx.count = ref_mark_count;
+    if (ref_tx.buf) {
+        ref_tx.buf[ref_tx.len] = '\0';
+    }
+    if (!ref_tx.count) {
+        ref_tx.message[0] = '\0';
+    }
+}
+
+// Apply the steps recorded by store_flush(): "W <path>" moves the staged content into
+// place, "U <path>" removes a file and "D <path>" a directory. Every step can be
+// repeated, so a log left behind halfway is simply applied again from the top.
+static int store_replay(char* steps) {
+    int ok = 1;
+    char* save = NULL;
+    for (char* line = strtok_r(steps, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        const char* path = line + 2;
+        char staged[MAX_PATH_LENGTH];
+        int failed = 0;
+        if (line[0] == 'W') {
+            snprintf(staged, sizeof(staged), "%s" STORE_STAGE_SUFFIX, path);
+            failed = rename(staged, path) == -1 && errno != ENOENT;
+        } else if (line[0] == 'U') {
+            failed = unlink(path) == -1 && errno != ENOENT;
+        } else if (line[0] == 'D') {
+            failed = rmdir(path) == -1 && errno != ENOENT;
+        }
+        if (failed) {
+            fprintf(stderr, "Error: Failed to update %s: %s\n", path, strerror(errno));
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+// Commit all deferred changes, all or nothing. New contents are staged next to their
+// files first and the ref transaction runs next, so a failure in either leaves every
+// file as it was. Only then are the steps recorded in .git/kaishaku/.intent and
+// applied; a process that dies while applying them leaves the log behind, and the next
+// writer finishes it (store_recover) before it changes anything itself.
+int store_flush(void) {
+    char* steps = NULL;
+    size_t steps_len = 0, steps_cap = 0;
+    int ok = 1;
+
+    // Contents first, then file removals, then directories, which are empty by then
+    for (int pass = 0; pass < 3; pass++) {
+        for (int i = 0; i < STORE_BUCKETS; i++) {
+            for (struct store_entry* e = store[i]; e; e = e->next) {
+                char line[MAX_PATH_LENGTH + 2];
+                if (!e->dirty) {
+                    continue;
+                } else if (pass == 0 && !e->is_dir && e->content) {
+                    char staged[MAX_PATH_LENGTH];
+                    snprintf(staged, sizeof(staged), "%s" STORE_STAGE_SUFFIX, e->path);
+                    ok = ok && write_file_replace(staged, e->content);
+                    snprintf(line, sizeof(line), "W %s", e->path);
+                } else if (pass == 1 && !e->is_dir && !e->content) {
+                    snprintf(line, sizeof(line), "U %s", e->path);
+                } else if (pass == 2 && e->is_dir && !e->content) {
+                    snprintf(line, sizeof(line), "D %s", e->path);
+                } else {
+                    continue;
+                }
+                append_line(&steps, &steps_len, &steps_cap, line);
+                e->dirty = 0;
+            }
+        }
+    }
+
+    if (ok) {
+        ok = ref_flush();
+    } else {
+        free(ref_tx.buf);
+        memset(&ref_tx, 0, sizeof(ref_tx));
+    }
+
+    char* intent = STORE_INTENT_FILE;
+    if (ok && steps && write_file_replace(intent, steps)) {
+        ok = store_replay(steps);
+        unlink(intent);
+    } else if (steps) {
+        // Nothing was applied: drop whatever got staged
+        fprintf(stderr, "Error: Session metadata was left unchanged.\n");
+        char* save = NULL;
+        for (char* line = strtok_r(steps, "\n", &save); line;
+             line = strtok_r(NULL, "\n", &save)) {
+            char staged[MAX_PATH_LENGTH];
+            if (line[0] == 'W') {
+                snprintf(staged, sizeof(staged), "%s" STORE_STAGE_SUFFIX, line + 2);
+                unlink(staged);
+            }
+        }
+        ok = 0;
+    }
+    free(intent);
+    free(steps);
+    return ok;
+}
+
+// Finish a store_flush() whose process died while applying it. Called with the lock held.
+void store_recover(void) {
+    char* intent = STORE_INTENT_FILE;
+    char* steps = read_file_contents(intent);
+    if (steps) {
+        fprintf(stderr, "%sFinishing an interrupted update of session metadata...%s\n",
+                COLOR_YELLOW, COLOR_RESET);
+        store_replay(steps);
+        unlink(intent);
+        free(steps);
+    }
+    free(intent);
+}
+
+// Sparse sessions: a session's "sparse" file lists cone-mode directories. They are set
+// before the session's tree is checked out, so only the cone gets written, and whatever
+// sparse state the repository had before is kept in .sparse-prev and put back on exit.
+static void save_sparse_state(void) {
+    char* settings = capture_git_output("git config --bool --get-regexp '^core\\.sparsecheckout'");
+    int enabled = settings && strstr(settings, "core.sparsecheckout true");
+    int cone = settings && strstr(settings, "core.sparsecheckoutcone true");
+    free(settings);
+
+    char* patterns_path = safe_path_join(root, ".git/info/sparse-checkout");
+    char* patterns = enabled ? read_file_contents(patterns_path) : NULL;
+    free(patterns_path);
+
+    size_t size = (patterns ? strlen(patterns) : 0) + 8;
+    char* state = malloc(size);
+    if (!state) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(state, size, "%d %d\n%s", enabled ? 1 : 0, cone ? 1 : 0, patterns ? patterns : "");
+    write_to_file(SPARSE_PREV_FILE, state);
+    free(state);
+    free(patterns);
+}
+
+static int apply_sparse_cones(const char* cones) {
+    if (!file_exists(SPARSE_PREV_FILE)) {
+        save_sparse_state();
+    }
+
+    char* output = NULL;
+    int status = run_git_filter("git sparse-checkout set --cone --stdin", cones, strlen(cones),
+                                &output);
+    free(output);
+    if (status != 0) {
+        fprintf(stderr, "Error: Failed to apply sparse-checkout: %s\n", error_message);
+        return 0;
+    }
+    return 1;
+}
+
+// Undo what apply_sparse_cones did, if anything.
+void restore_sparse_state(void) {
+    const char* state = read_all_from_file(SPARSE_PREV_FILE);
+    if (!state) {
+        return;
+    }
+
+    if (state[0] != '1') {
+        if (!execute_git_command("git sparse-checkout disable", NULL, 0)) {
+            fprintf(stderr, "Warning: %s\n", error_message);
+        }
+    } else {
+        // Replaced in one step: reapply must never run on a half-written pattern file
+        const char* patterns = strchr(state, '\n');
+        char* text = strdup(patterns ? patterns + 1 : "");
+        if (!text) {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+        size_t len = strlen(text);
+        if (len > 0 && text[len - 1] == '\n') {
+            text[len - 1] = '\0';  // write_file_replace() adds it back
+        }
+        char* patterns_path = safe_path_join(root, ".git/info/sparse-checkout");
+        int written = write_file_replace(patterns_path, text);
+        free(patterns_path);
+        free(text);
+        if (!written) {
+            fprintf(stderr, "%sWarning: Sparse patterns not restored; trying again next time.%s\n",
+                    COLOR_YELLOW, COLOR_RESET);
+            return;
+        }
+
+        char cmd[DEFAULT_BUFFER_SIZE];
+        snprintf(cmd, sizeof(cmd),
+                 "git config core.sparseCheckout true && git config core.sparseCheckoutCone %s "
+                 "&& git sparse-checkout reapply",
+                 state[2] == '1' ? "true" : "false");
+        if (!execute_git_command(cmd, NULL, 0)) {
+            fprintf(stderr, "Warning: %s\n", error_message);
+        }
+    }
+
+    remove_file(SPARSE_PREV_FILE);
+}
+
+// Make the working tree's sparsity match the session about to be checked out.
+void sync_session_sparse(const char* session) {
+    const char* cones = read_all_from_file(SESSION_SPARSE_FILE(session));
+    if (cones && cones[0]) {
+        if (!apply_sparse_cones(cones)) {
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        restore_sparse_state();
+    }
+}
+
+// Operation journal: .git/kaishaku/.journal gets one fixed-size record per operation,
+// appended and never rewritten, so undo finds the latest one with a seek from the end
+// instead of digging through reflogs.
+#define JOURNAL_FILE (safe_path_join(kaishaku_dir, ".journal"))
+#define JOURNAL_MAGIC 0x314a534bu  // "KSJ1"
+#define JOURNAL_RECORD_SIZE 2048
+#define JOURNAL_OID_SIZE 72  // Room for SHA-256 object names
+#define JOURNAL_NAME_SIZE 128
+
+enum journal_op {
+    JOURNAL_CHECKOUT = 1,
+    JOURNAL_SWITCH,
+    JOURNAL_SAVE,
+    JOURNAL_EXIT,
+    JOURNAL_ABORT,
+    JOURNAL_UNDO,
+    JOURNAL_RESTACK
+};
+
+static const char* const journal_op_names[] = {"?",    "checkout", "switch", "save",
+                                               "exit", "abort",    "undo",   "restack"};
+
+struct journal_record {
+    uint32_t magic;
+    uint32_t op;
+    int64_t time;
+    uint32_t had_session;  // session_branch/session_head hold the session files from before
+    uint32_t group;  // Nonzero on each record of an operation that changed several sessions
+    char session[JOURNAL_NAME_SIZE];
+    char active_before[JOURNAL_NAME_SIZE], active_after[JOURNAL_NAME_SIZE];
+    char branch_before[JOURNAL_NAME_SIZE], branch_after[JOURNAL_NAME_SIZE];  // Empty if detached
+    char head_before[JOURNAL_OID_SIZE], head_after[JOURNAL_OID_SIZE];
+    char wip[JOURNAL_OID_SIZE];        // Changes an exit discarded, from git stash create
+    char watch_wip[JOURNAL_OID_SIZE];  // The session's latest watch snapshot
+    char ref_name[JOURNAL_NAME_SIZE + 16];  // A branch the operation moved (save)
+    char ref_before[JOURNAL_OID_SIZE], ref_after[JOURNAL_OID_SIZE];
+    char session_branch[JOURNAL_NAME_SIZE], session_head[JOURNAL_OID_SIZE];
+};
+
+_Static_assert(sizeof(struct journal_record) <= JOURNAL_RECORD_SIZE, "journal record too large");
+
+static void journal_copy(char* dst, size_t size, const char* src) {
+    snprintf(dst, size, "%s", src ? src : "");
+}
+
+// HEAD and the branch it is on, from a single rev-parse
+static void journal_read_head(char* head, char* branch) {
+    char* out = capture_git_output("git rev-parse HEAD --symbolic-full-name HEAD 2>/dev/null");
+    head[0] = branch[0] = '\0';
+    if (!out) {
+        return;
+    }
+
+    char* nl = strchr(out, '\n');
+    if (nl) {
+        *nl = '\0';
+        char* ref = nl + 1;
+        ref[strcspn(ref, "\n")] = '\0';
+        if (strncmp(ref, "refs/heads/", 11) == 0) {
+            journal_copy(branch, JOURNAL_NAME_SIZE, ref + 11);
+        }
+    }
+    journal_copy(head, JOURNAL_OID_SIZE, out);
+    free(out);
+}
+
+static void journal_begin(struct journal_record* rec, enum journal_op op, const char* session) {
+    memset(rec, 0, sizeof(*rec));
+    rec->magic = JOURNAL_MAGIC;
+    rec->op = op;
+    rec->time = (int64_t)time(NULL);
+    journal_copy(rec->session, sizeof(rec->session), session);
+    journal_copy(rec->active_before, sizeof(rec->active_before), read_from_file(ACTIVE_FILE));
+    journal_read_head(rec->head_before, rec->branch_before);
+
+    if (session && file_exists(SESSION_FILE(session))) {
+        rec->had_session = 1;
+        journal_copy(rec->session_branch, sizeof(rec->session_branch),
+                     read_from_file(SESSION_FILE(session)));
+        journal_copy(rec->session_head, sizeof(rec->session_head),
+                     read_from_file(HEAD_FILE(session)));
+    }
+}
+
+static void journal_append(struct journal_record* rec) {
+    journal_copy(rec->active_after, sizeof(rec->active_after), read_from_file(ACTIVE_FILE));
+    journal_read_head(rec->head_after, rec->branch_after);
+
+    char record[JOURNAL_RECORD_SIZE] = {0};
+    memcpy(record, rec, sizeof(*rec));
+
+    ensure_directory_exists(kaishaku_dir);
+    int fd = open(JOURNAL_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1 || write(fd, record, sizeof(record)) != (ssize_t)sizeof(record)) {
+        fprintf(stderr, "%sWarning: Could not write the journal: %s%s\n", COLOR_YELLOW,
+                strerror(errno), COLOR_RESET);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+static int journal_read(int fd, size_t index, struct journal_record* rec) {
+    return pread(fd, rec, sizeof(*rec), (off_t)index * JOURNAL_RECORD_SIZE) ==
+               (ssize_t)sizeof(*rec) &&
+           rec->magic == JOURNAL_MAGIC && rec->op >= JOURNAL_CHECKOUT && rec->op <= JOURNAL_RESTACK;
+}
+
+// In a partial clone, fetch every object the checkout of commit is going to need in one
+// round trip, instead of letting checkout fault blobs in a few at a time. With sparse
+// patterns only what they select counts.
+void prefetch_objects(const char* commit, const char* patterns) {
+    if (!config.promisor_remote[0]) {
+        return;
+    }
+
+    char cmd[2 * DEFAULT_BUFFER_SIZE];
+    char filter[DEFAULT_BUFFER_SIZE] = "";
+    if (patterns) {
+        // rev-list filters by patterns stored as a blob
+        char* oid = NULL;
+        if (run_git_filter("git hash-object -w --stdin", patterns, strlen(patterns), &oid) == 0 &&
+            oid) {
+            oid[strcspn(oid, "\n")] = '\0';
+            snprintf(filter, sizeof(filter), " --filter=sparse:oid=%s", oid);
+        }
+        free(oid);
+    }
+
+    // rev-list reports what is missing locally without fetching it
+    snprintf(cmd, sizeof(cmd), "git rev-list --objects --missing=print --no-walk%s %s", filter,
+             commit);
+    char* objects = capture_git_output(cmd);
+    char* missing = NULL;
+    size_t len = 0, cap = 0, count = 0;
+    for (char* line = objects ? strtok(objects, "\n") : NULL; line; line = strtok(NULL, "\n")) {
+        if (line[0] == '?') {
+            append_line(&missing, &len, &cap, line + 1);
+            count++;
+        }
+    }
+    free(objects);
+    if (!count) {
+        return;
+    }
+
+    printf("%sPrefetching %zu missing object(s) from '%s'...%s\n", COLOR_CYAN, count,
+           config.promisor_remote, COLOR_RESET);
+    fflush(stdout);
+
+    // The same fetch git runs for a single lazily fetched object, given them all at once
+    char* remote = shell_quote(config.promisor_remote);
+    snprintf(cmd, sizeof(cmd),
+             "git -c fetch.negotiationAlgorithm=noop fetch %s --no-tags --no-write-fetch-head "
+             "--recurse-submodules=no --filter=blob:none --stdin",
+             remote);
+    free(remote);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char* output = NULL;
+    int status = run_git_filter(cmd, missing, len, &output);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(output);
+    free(missing);
+
+    if (status != 0) {
+        fprintf(stderr, "%sWarning: Prefetch failed; checkout will fetch on demand. %s%s\n",
+                COLOR_YELLOW, error_message, COLOR_RESET);
+        return;
+    }
+    printf("%sPrefetched %zu object(s) in %.1fs%s\n", COLOR_GREEN, count,
+           (double)(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, COLOR_RESET);
+}
+
+// Number of entries in .git/index, from its header.
+static unsigned index_entry_count(void) {
+    unsigned char header[12];
+    char* index_path = safe_path_join(root, ".git/index");
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    free(index_path);
+    if (fd == -1) {
+        return 0;
+    }
+    ssize_t n = read(fd, header, sizeof(header));
+    close(fd);
+    if (n != (ssize_t)sizeof(header) || memcmp(header, "DIRC", 4) != 0) {
+        return 0;
+    }
+    return (unsigned)header[8] << 24 | (unsigned)header[9] << 16 | (unsigned)header[10] << 8 |
+           header[11];
+}
+
+// `-c` options for git commands that rewrite the working tree: parallel checkout
+// workers and index threads, either calibrated by `kaishaku tune` or guessed from the
+// number of cores and the size of the tree. Empty when git's defaults are as good,
+// or when the repository configures them itself.
+const char* checkout_options(void) {
+    static char options[128];
+    static int done;
+    if (done) {
+        return options;
+    }
+    done = 1;
+    if (config.own_checkout_tuning) {
+        return options;
+    }
+
+    int cpus = online_cpus();
+    int workers = config.checkout_workers, threshold = config.checkout_threshold;
+    int threads = config.index_threads;
+    if (!workers || !threads) {
+        // Workers pay off once a switch writes a few hundred files; reading the index
+        // with threads only once it has tens of thousands of entries
+        unsigned entries = index_entry_count();
+        if (!workers) {
+            workers = entries >= 2000 ? (cpus < 8 ? cpus : 8) : 1;
+        }
+        if (!threads) {
+            threads = entries >= 20000 ? cpus : 1;
+        }
+    }
+    if (!threshold) {
+        threshold = 100;  // git's default
+    }
+
+    if (workers > 1 || threads > 1) {
+        snprintf(options, sizeof(options),
+                 "-c checkout.workers=%d -c checkout.thresholdForParallelism=%d "
+                 "-c index.threads=%d",
+                 workers, threshold, threads);
+    }
+    return options;
+}
+
+static int remove_tree_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+// Seconds for one full checkout of the index into dir with the given workers.
+static double time_checkout(const char* dir, int workers) {
+    char cmd[2 * DEFAULT_BUFFER_SIZE];
+    char* prefix = shell_quote(dir);
+    snprintf(cmd, sizeof(cmd),
+             "git -c checkout.workers=%d -c checkout.thresholdForParallelism=1 "
+             "checkout-index -a -f --prefix=%s/",
+             workers, prefix);
+    free(prefix);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ok = execute_git_command(cmd, NULL, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    nftw(dir, remove_tree_entry, 16, FTW_DEPTH | FTW_PHYS);
+    if (!ok) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+    return (double)(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void cmd_tune(int argc, char* argv[]) {
+    static const char* keys[] = {"checkout.workers", "checkout.threshold", "index.threads"};
+    char cmd[DEFAULT_BUFFER_SIZE];
+
+    if (argc > 0 && strcmp(argv[0], "--reset") == 0) {
+        for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+            snprintf(cmd, sizeof(cmd), "git config --local --unset kaishaku.%s", keys[i]);
+            execute_git_command(cmd, NULL, 0);
+        }
+        printf("%sCheckout settings will be guessed again.%s\n", COLOR_GREEN, COLOR_RESET);
+        return;
+    } else if (argc > 0) {
+        usage();
+    }
+
+    unsigned entries = index_entry_count();
+    if (entries == 0) {
+        fprintf(stderr, "Error: The index is empty; nothing to measure.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Check the whole index out into a scratch directory with more and more workers.
+    // The first run only warms the page cache.
+    char* dir = safe_path_join(kaishaku_dir, ".tune");
+    nftw(dir, remove_tree_entry, 16, FTW_DEPTH | FTW_PHYS);
+    int cpus = online_cpus();
+    printf("%sMeasuring checkout of %u file(s) on %d core(s)...%s\n", COLOR_CYAN, entries, cpus,
+           COLOR_RESET);
+    fflush(stdout);
+    time_checkout(dir, cpus);
+
+    int best = 1;
+    double best_time = 0, serial_time = 0;
+    for (int workers = 1; workers <= cpus && workers <= 32;
+         workers = workers * 2 > cpus && workers < cpus ? cpus : workers * 2) {
+        double t = time_checkout(dir, workers);
+        double again = time_checkout(dir, workers);
+        t = again < t ? again : t;
+        printf("  %2d worker(s): %.3fs\n", workers, t);
+        fflush(stdout);
+
+        if (workers == 1) {
+            serial_time = best_time = t;
+        } else if (t < best_time) {
+            best = workers;
+            best_time = t;
+        }
+    }
+    free(dir);
+
+    // Less than 10% faster is not worth the extra processes
+    if (best_time > serial_time * 0.9) {
+        best = 1;
+    }
+    int threads = entries >= 20000 ? cpus : 1;
+
+    int values[] = {best, 100, threads};
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        snprintf(cmd, sizeof(cmd), "git config --local kaishaku.%s %d", keys[i], values[i]);
+        if (!execute_git_command(cmd, NULL, 0)) {
+            fprintf(stderr, "Error: Failed to save config: %s\n", error_message);
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("%sSaved checkout.workers=%d checkout.thresholdForParallelism=%d index.threads=%d%s\n",
+           COLOR_GREEN, best, values[1], threads, COLOR_RESET);
+    if (config.own_checkout_tuning) {
+        printf("%sNote: this repository sets checkout.workers or index.threads itself, "
+               "and those win.%s\n",
+               COLOR_YELLOW, COLOR_RESET);
+    }
+}
+
+// kaishaku bench: time real commands (status, list, and switching back and forth between
+// two scratch sessions) once with each backend in this build, selected in the child
+// processes through KAISHAKU_BACKEND. The scratch sessions are removed at the end, and the
+// session or branch that was checked out before is checked out again.
+#define BENCH_SESSION_A "kaishaku-bench-a"
+#define BENCH_SESSION_B "kaishaku-bench-b"
+
+// Run this kaishaku with the given backend, output discarded. Prestaging is off: a
+// background prestage racing the next timed switch would make every run a lottery.
+static int bench_exec(const char* backend, char* const args[]) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        setenv("KAISHAKU_BACKEND", backend, 1);
+        setenv("GIT_CONFIG_COUNT", "1", 1);
+        setenv("GIT_CONFIG_KEY_0", "kaishaku.prestage", 1);
+        setenv("GIT_CONFIG_VALUE_0", "0", 1);
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, 0);
+        dup2(null_fd, 1);
+        dup2(null_fd, 2);
+        execv("/proc/self/exe", args);
+        execvp("kaishaku", args);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return 0;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void bench_must(const char* backend, char* const args[]) {
+    if (!bench_exec(backend, args)) {
+        fprintf(stderr, "Error: 'kaishaku %s %s' failed with the %s backend.\n", args[1],
+                args[2] ? args[2] : "", backend);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void cmd_bench(int argc, char* argv[]) {
+    static const char* const commands[] = {"status", "list", "switch"};
+    const size_t backend_count = sizeof(git_backends) / sizeof(git_backends[0]);
+    int iterations = 20;
+    if (argc == 2 && strcmp(argv[0], "-n") == 0 && atoi(argv[1]) > 0) {
+        iterations = atoi(argv[1]);
+    } else if (argc != 0) {
+        usage();
+    }
+
+    char head[DEFAULT_BUFFER_SIZE], parent[DEFAULT_BUFFER_SIZE];
+    if (!exec_backend.resolve("HEAD", head, sizeof(head))) {
+        fprintf(stderr, "Error: Nothing to benchmark before the first commit.\n");
+        exit(EXIT_FAILURE);
+    }
+    // Sessions a commit apart, so a switch has files to write
+    if (!exec_backend.resolve("HEAD~1", parent, sizeof(parent))) {
+        snprintf(parent, sizeof(parent), "%s", head);
+    }
+    if (exec_backend.has_changes()) {
+        fprintf(stderr, "Error: Commit or stash your changes before running bench.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (file_exists(SESSION_DIR(BENCH_SESSION_A)) || file_exists(SESSION_DIR(BENCH_SESSION_B))) {
+        fprintf(stderr, "Error: Session '%s' or '%s' exists; clean it first.\n", BENCH_SESSION_A,
+                BENCH_SESSION_B);
+        exit(EXIT_FAILURE);
+    }
+    const char* active = read_from_file(ACTIVE_FILE);
+    char* previous = active ? strdup(active) : NULL;
+
+    char* checkout_a[] = {"kaishaku", "checkout", BENCH_SESSION_A, head, NULL};
+    char* checkout_b[] = {"kaishaku", "checkout", BENCH_SESSION_B, parent, NULL};
+    bench_must(exec_backend.name, checkout_a);
+    bench_must(exec_backend.name, checkout_b);
+
+    printf("%s%-16s", COLOR_CYAN, "Command");
+    for (size_t b = 0; b < backend_count; b++) {
+        printf(" %12s", git_backends[b]->name);
+    }
+    printf("%s\n", COLOR_RESET);
+
+    for (size_t c = 0; c < sizeof(commands) / sizeof(commands[0]); c++) {
+        printf("%s%-16s%s", COLOR_YELLOW, commands[c], COLOR_RESET);
+        for (size_t b = 0; b < backend_count; b++) {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int i = 0; i < iterations; i++) {
+                // Starting in B, an even run switches to A and an odd one back
+                char* args[] = {"kaishaku", (char*)commands[c],
+                                i % 2 ? BENCH_SESSION_B : BENCH_SESSION_A, NULL};
+                if (strcmp(commands[c], "switch") != 0) {
+                    args[2] = NULL;
+                }
+                bench_must(git_backends[b]->name, args);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+            printf(" %9.3f ms", ms / iterations);
+
+            // Back in B for the next backend
+            if (strcmp(commands[c], "switch") == 0 && iterations % 2) {
+                char* back[] = {"kaishaku", "switch", BENCH_SESSION_B, NULL};
+                bench_must(exec_backend.name, back);
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    // Leave things as they were: back to the previous session, or out to the branch
+    char* restore[] = {"kaishaku", "switch", previous ? previous : BENCH_SESSION_A, NULL};
+    char* leave[] = {"kaishaku", "exit", "--force", NULL};
+    char* clean_a[] = {"kaishaku", "clean", BENCH_SESSION_A, NULL};
+    char* clean_b[] = {"kaishaku", "clean", BENCH_SESSION_B, NULL};
+    bench_must(exec_backend.name, restore);
+    if (!previous) {
+        bench_must(exec_backend.name, leave);
+    }
+    bench_must(exec_backend.name, clean_a);
+    bench_must(exec_backend.name, clean_b);
+    free(previous);
+
+    printf("%sAverage of %d run(s) per command; %s is the default backend.%s\n", COLOR_CYAN,
+           iterations, git->name, COLOR_RESET);
+}
+
+// Pre-staging: while idle, `kaishaku prestage` builds for each likely next session the
+// index a switch to it would produce (read-tree -m into an alternate index file), and
+// reads the blobs it needs so they are in the page cache. A switch that finds a
+// prestage still valid only swaps the index in and writes the changed paths.
+struct prestage_record {
+    char base[JOURNAL_OID_SIZE];      // HEAD the index was staged from
+    char target[JOURNAL_OID_SIZE];    // Session commit it was staged for
+    char checksum[JOURNAL_OID_SIZE];  // Trailing checksum of index.next
+    long long index_ino, index_size, index_mtime_sec, index_mtime_nsec;  // .git/index then
+    char* changes;  // "<status>\t<path>" lines from diff-tree
+};
+
+static int index_stat(struct stat* st) {
+    char* index_path = safe_path_join(root, ".git/index");
+    int ok = stat(index_path, st) == 0;
+    free(index_path);
+    return ok;
+}
+
+// Hex of the last 32 bytes of an index file, which end in the checksum git writes.
+static int index_checksum(const char* path, char* hex, size_t size) {
+    unsigned char raw[32];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(raw) ||
+        pread(fd, raw, sizeof(raw), st.st_size - (off_t)sizeof(raw)) != (ssize_t)sizeof(raw)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0;
+    }
+    close(fd);
+
+    int nonzero = 0;
+    for (size_t i = 0; i < sizeof(raw) && 2 * i + 2 < size; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", raw[i]);
+        nonzero |= i >= sizeof(raw) - 20 ? raw[i] : 0;
+    }
+    return nonzero;  // index.skipHash leaves the checksum zero, and then it proves nothing
+}
+
+static int read_prestage_record(const char* session, struct prestage_record* rec) {
+    char* data = read_file_contents(SESSION_PRESTAGE_FILE(session));
+    if (!data) {
+        return 0;
+    }
+    char* changes = strchr(data, '\n');
+    if (!changes ||
+        sscanf(data, "%71s %71s %71s %lld %lld %lld %lld", rec->base, rec->target, rec->checksum,
+               &rec->index_ino, &rec->index_size, &rec->index_mtime_sec,
+               &rec->index_mtime_nsec) != 7) {
+        free(data);
+        return 0;
+    }
+    rec->changes = strdup(changes + 1);
+    free(data);
+    return rec->changes != NULL;
+}
+
+// Remove the directories a deleted file leaves empty, up to (not including) the root
+static void remove_empty_parents(char* path) {
+    size_t root_len = strlen(root);
+    for (char* slash = strrchr(path, '/'); slash && (size_t)(slash - path) > root_len;
+         slash = strrchr(path, '/')) {
+        *slash = '\0';
+        if (rmdir(path) == -1) {
+            break;
+        }
+    }
+}
+
+// Run `git diff-tree -r` from base to target into "<status>\t<path>" lines, and, if
+// blobs is given, the OIDs of the blobs the target side needs. Both are malloc'd.
+static char* diff_tree_changes(const char* base, const char* target, char** blobs,
+                               size_t* blobs_len) {
+    char cmd[DEFAULT_BUFFER_SIZE];
+    snprintf(cmd, sizeof(cmd), "git -c core.quotepath=off diff-tree -r --no-renames %s %s", base,
+             target);
+    char* raw = capture_git_output(cmd);
+    char* changes = NULL;
+    size_t changes_len = 0, changes_cap = 0, blobs_cap = 0;
+    for (char* line = raw ? strtok(raw, "\n") : NULL; line; line = strtok(NULL, "\n")) {
+        // ":<old mode> <new mode> <old oid> <new oid> <status>\t<path>"
+        char new_oid[JOURNAL_OID_SIZE], status[8];
+        char* tab = strchr(line, '\t');
+        if (!tab || sscanf(line, ":%*s %*s %*s %71s %7s", new_oid, status) != 2) {
+            continue;
+        }
+        char entry[MAX_PATH_LENGTH];
+        snprintf(entry, sizeof(entry), "%c%s", status[0], tab);
+        append_line(&changes, &changes_len, &changes_cap, entry);
+        if (blobs && status[0] != 'D' && strncmp(line + 1, "160000", 6) != 0) {
+            append_line(blobs, blobs_len, &blobs_cap, new_oid);
+        }
+    }
+    free(raw);
+    return changes ? changes : strdup("");
+}
+
+// Put index_file in place as .git/index and bring a clean working tree from HEAD to
+// commit by writing only the paths in changes, as listed by diff_tree_changes(). The
+// caller has checked that index_file is commit's index and HEAD is where changes start.
+// checksum, if given, must match the file that was moved. Returns 0, with nothing
+// touched, when the working tree is not clean enough for that. The paths in changes are
+// relative to the top of the repository, wherever kaishaku was started.
+static int swap_in_index(const char* index_file, const char* checksum, const char* base,
+                         const char* commit, char* changes) {
+    int ok = 0;
+    struct stat st;
+    char* index_path = safe_path_join(root, ".git/index");
+    char* lock_path = safe_path_join(root, ".git/index.lock");
+    char* prev_path = safe_path_join(root, ".git/index.kaishaku-prev");
+    char* paths = NULL;
+    size_t paths_len = 0;
+
+    // No local edits for the new tree to clobber
+    if (!git->worktree_clean()) {
+        goto out;
+    }
+
+    for (char* line = changes; *line;) {
+        char* end = line + strcspn(line, "\n");
+        if (end == line) {
+            line++;
+            continue;
+        }
+        char* path = strchr(line, '\t');
+        if (!path || path > end || path[1] == '"') {
+            goto out;  // Quoted names are not worth the trouble here
+        }
+        path++;
+        char saved = *end;
+        *end = '\0';
+        char* full = safe_path_join(root, path);
+        int in_the_way = line[0] == 'A' && lstat(full, &st) == 0;
+        free(full);
+        *end = saved;
+        if (in_the_way) {
+            goto out;  // An untracked file is in the way
+        }
+        line = *end ? end + 1 : end;
+    }
+
+    // Keep the current index to go back to if anything below fails
+    unlink(prev_path);
+    if (link(index_path, prev_path) == -1) {
+        goto out;
+    }
+
+    // Take git's index lock, then put the new index in place through it
+    int lock = open(lock_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (lock == -1) {
+        goto out;
+    }
+    close(lock);
+
+    char moved[JOURNAL_OID_SIZE];
+    if (rename(index_file, lock_path) == -1 ||
+        (checksum && (!index_checksum(lock_path, moved, sizeof(moved)) ||
+                      strcmp(moved, checksum) != 0)) ||
+        rename(lock_path, index_path) == -1) {
+        unlink(lock_path);  // Replaced under us; do it the slow way
+        goto out;
+    }
+    unlink(index_file);  // Still there if it was a hard link to the live index
+
+    // Apply the diff to the working tree
+    for (char* line = changes; *line;) {
+        char* end = line + strcspn(line, "\n");
+        if (end == line) {
+            line++;
+            continue;
+        }
+        char saved = *end;
+        *end = '\0';
+        char* path = strchr(line, '\t') + 1;
+        if (line[0] == 'D') {
+            char* full = safe_path_join(root, path);
+            if (unlink(full) == 0) {
+                remove_empty_parents(full);
+            }
+            free(full);
+        } else {
+            size_t n = strlen(path) + 1;
+            paths = realloc(paths, paths_len + n);
+            if (!paths) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(paths + paths_len, path, n);
+            paths_len += n;
+        }
+        *end = saved;
+        line = *end ? end + 1 : end;
+    }
+
+    // checkout-index -u refreshes the stat data of exactly the paths it writes
+    char* output = NULL;
+    char cmd[DEFAULT_BUFFER_SIZE * 2];
+    char* quoted_root = shell_quote(root);
+    snprintf(cmd, sizeof(cmd), "git -C %s %s checkout-index -f -u -z --stdin", quoted_root,
+             checkout_options());
+    free(quoted_root);
+    int written = !paths_len || run_git_filter(cmd, paths, paths_len, &output) == 0;
+    free(output);
+
+    char message[DEFAULT_BUFFER_SIZE];
+    snprintf(message, sizeof(message), "checkout: moving from %s to %s", base, commit);
+    if (written && git->update_ref("HEAD", commit, NULL, message)) {
+        ok = 1;
+        goto out;
+    }
+
+    // Back to where we started: the old index, no added files, and the clean working
+    // tree it had, so the caller can switch the ordinary way
+    fprintf(stderr, "%sWarning: %s; switching the slow way.%s\n", COLOR_YELLOW, error_message,
+            COLOR_RESET);
+    if (rename(prev_path, index_path) == -1) {
+        fprintf(stderr, "Error: Failed to restore %s: %s\n", index_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (char* line = changes; *line;) {
+        char* end = line + strcspn(line, "\n");
+        if (line[0] == 'A' && line[1] == '\t') {
+            char path[MAX_PATH_LENGTH];
+            snprintf(path, sizeof(path), "%s/%.*s", root, (int)(end - line - 2), line + 2);
+            if (unlink(path) == 0) {
+                remove_empty_parents(path);
+            }
+        }
+        line = *end ? end + 1 : end;
+    }
+    quoted_root = shell_quote(root);
+    snprintf(cmd, sizeof(cmd), "git -C %s checkout -f -q", quoted_root);
+    free(quoted_root);
+    if (!execute_git_command(cmd, NULL, 0)) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+
+out:
+    unlink(prev_path);
+    free(paths);
+    free(index_path);
+    free(lock_path);
+    free(prev_path);
+    return ok;
+}
+
+// Switch to commit using the session's prestage, if it is still valid for the current
+// HEAD and index. Returns 0, with nothing touched, when it is not.
+int apply_prestaged(const char* session, const char* commit) {
+    struct prestage_record rec;
+    if (!file_exists(SESSION_PRESTAGE_FILE(session)) || !read_prestage_record(session, &rec)) {
+        return 0;
+    }
+
+    int ok = 0;
+    char head[JOURNAL_OID_SIZE];
+    struct stat st;
+    char* next_index = SESSION_NEXT_INDEX_FILE(session);
+
+    // Same start and same index as when it was staged
+    if (strcmp(rec.target, commit) == 0 &&
+        git->resolve("HEAD", head, sizeof(head)) && strcmp(head, rec.base) == 0 &&
+        index_stat(&st) && (long long)st.st_ino == rec.index_ino &&
+        (long long)st.st_size == rec.index_size &&
+        (long long)st.st_mtim.tv_sec == rec.index_mtime_sec &&
+        (long long)st.st_mtim.tv_nsec == rec.index_mtime_nsec &&
+        swap_in_index(next_index, rec.checksum, rec.base, commit, rec.changes)) {
+        remove_file(SESSION_PRESTAGE_FILE(session));
+        printf("%sUsed the prestaged index for session '%s'.%s\n", COLOR_CYAN, session,
+               COLOR_RESET);
+        ok = 1;
+    }
+
+    free(rec.changes);
+    free(next_index);
+    return ok;
+}
+
+// Keep the index of a session being left, so coming back can reuse its stat data
+// instead of starting from whatever index the other session left behind. Git always
+// replaces the index by rename, so a hard link is enough.
+void save_session_index(const char* session) {
+    char* saved = SESSION_INDEX_FILE(session);
+    const char* head = read_from_file(HEAD_FILE(session));
+    unlink(saved);
+    remove_file(SESSION_INDEX_HEAD_FILE(session));
+
+    // Only an index that is exactly HEAD's tree, outside any sparse checkout
+    if (batch_mode || config.sparse_checkout || file_exists(SPARSE_PREV_FILE) || !head ||
+        !git->index_clean()) {
+        free(saved);
+        return;
+    }
+
+    char* index_path = safe_path_join(root, ".git/index");
+    if (link(index_path, saved) == 0) {
+        write_to_file(SESSION_INDEX_HEAD_FILE(session), head);
+    }
+    free(index_path);
+    free(saved);
+}
+
+// Switch to commit through the index kept when the session was last left.
+static int restore_session_index(const char* session, const char* commit) {
+    const char* saved_head = read_from_file(SESSION_INDEX_HEAD_FILE(session));
+    char head[JOURNAL_OID_SIZE];
+    if (!saved_head || strcmp(saved_head, commit) != 0 ||
+        !git->resolve("HEAD", head, sizeof(head)) || !git->index_clean()) {
+        return 0;  // Moved on since, or staged changes that would be lost
+    }
+
+    char* saved = SESSION_INDEX_FILE(session);
+    char* changes = diff_tree_changes(head, commit, NULL, NULL);
+    int ok = swap_in_index(saved, NULL, head, commit, changes);
+    if (ok) {
+        remove_file(SESSION_INDEX_HEAD_FILE(session));
+    }
+    free(changes);
+    free(saved);
+    return ok;
+}
+
+// Move session to the front of the most-recently-used list.
+void touch_mru(const char* session) {
+    const char* mru = read_all_from_file(MRU_FILE);
+    char* list = NULL;
+    size_t len = 0, cap = 0;
+    int kept = 1;
+
+    append_line(&list, &len, &cap, session);
+    for (const char* p = mru; p && *p && kept < MRU_MAX;) {
+        size_t n = strcspn(p, "\n");
+        if (strlen(session) != n || strncmp(p, session, n) != 0) {
+            char name[256];
+            snprintf(name, sizeof(name), "%.*s", (int)n, p);
+            append_line(&list, &len, &cap, name);
+            kept++;
+        }
+        p += n + (p[n] == '\n');
+    }
+    list[len - 1] = '\0';
+    write_to_file(MRU_FILE, list);
+    free(list);
+}
+
+// Detach a low-priority `kaishaku prestage` so the next switch can be a fast one.
+void spawn_prestage(void) {
+    if (!config.prestage || batch_mode) {
+        return;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Double fork, so nobody has to wait for it
+        if (fork() != 0) {
+            _exit(0);
+        }
+        setsid();
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, 0);
+        dup2(null_fd, 1);
+        dup2(null_fd, 2);
+        if (nice(10) == -1) {
+            // Run at normal priority then
+        }
+        execl("/proc/self/exe", "kaishaku", "prestage", (char*)NULL);
+        execlp("kaishaku", "kaishaku", "prestage", (char*)NULL);
+        _exit(127);
+    }
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+}
+
+// Build index.next and the change list for one session, and warm its blobs.
+static int prestage_session(const char* session, const char* base) {
+    const char* target = read_from_file(HEAD_FILE(session));
+    const char* cones = read_all_from_file(SESSION_SPARSE_FILE(session));
+    if (!target || strlen(target) < 40 || (cones && cones[0]) || strcmp(target, base) == 0) {
+        return 0;  // Nothing to gain, or a switch that takes the sparse path anyway
+    }
+
+    struct prestage_record old;
+    if (read_prestage_record(session, &old)) {
+        struct stat st;
+        int fresh = strcmp(old.base, base) == 0 && strcmp(old.target, target) == 0 &&
+                    index_stat(&st) && (long long)st.st_mtim.tv_sec == old.index_mtime_sec &&
+                    (long long)st.st_mtim.tv_nsec == old.index_mtime_nsec &&
+                    (long long)st.st_size == old.index_size;
+        free(old.changes);
+        if (fresh && file_exists(SESSION_NEXT_INDEX_FILE(session))) {
+            return 0;
+        }
+    }
+
+    // Copy the live index, keeping its stat data, and check it did not change meanwhile.
+    // The copy stays outside the session directory until the locked rename below, so a
+    // concurrent delete never finds a stray file in it.
+    struct stat before, after;
+    char* index_path = safe_path_join(root, ".git/index");
+    char* next_index = SESSION_NEXT_INDEX_FILE(session);
+    char tmp_index[MAX_PATH_LENGTH];
+    snprintf(tmp_index, sizeof(tmp_index), "%s/.prestage.tmp.%ld", kaishaku_dir,
+             (long)getpid());
+
+    int ok = 0;
+    char* quoted_index = shell_quote(tmp_index);
+    char* changes = NULL;
+    char cmd[2 * DEFAULT_BUFFER_SIZE];
+    char checksum[JOURNAL_OID_SIZE];
+
+    int in = open(index_path, O_RDONLY | O_CLOEXEC);
+    int out = open(tmp_index, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (in == -1 || out == -1 || fstat(in, &before) == -1) {
+        goto done;
+    }
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, (size_t)n) != n) {
+            goto done;
+        }
+    }
+    if (!index_stat(&after) || after.st_mtim.tv_sec != before.st_mtim.tv_sec ||
+        after.st_mtim.tv_nsec != before.st_mtim.tv_nsec || after.st_size != before.st_size) {
+        goto done;
+    }
+
+    // Fetch first in a partial clone, or warming the cache would fault blobs in one by one
+    prefetch_objects(target, NULL);
+
+    // Two-way merge from HEAD to the target, exactly what a checkout does to the index
+    snprintf(cmd, sizeof(cmd), "GIT_INDEX_FILE=%s git read-tree -m %s %s", quoted_index, base,
+             target);
+    if (!execute_git_command(cmd, NULL, 0)) {
+        goto done;
+    }
+
+    char* blobs = NULL;
+    size_t blobs_len = 0;
+    changes = diff_tree_changes(base, target, &blobs, &blobs_len);
+
+    // Read every blob the switch will write, so it comes from the page cache
+    if (blobs) {
+        char* ignored = NULL;
+        run_git_filter("git cat-file --batch >/dev/null", blobs, blobs_len, &ignored);
+        free(ignored);
+        free(blobs);
+    }
+
+    if (!index_checksum(tmp_index, checksum, sizeof(checksum))) {
+        goto done;
+    }
+
+    // Publish under the writer lock, but never wait for it: a switch or delete running now
+    // makes this work stale anyway. The session may have gone while we were busy; the
+    // store cache predates that, so look at the directory itself.
+    if (!try_store_lock()) {
+        goto done;
+    }
+    struct stat dir_st;
+    if (stat(SESSION_DIR(session), &dir_st) == -1 || !S_ISDIR(dir_st.st_mode) ||
+        rename(tmp_index, next_index) == -1) {
+        release_store_lock();
+        goto done;
+    }
+
+    size_t size = strlen(changes) + 512;
+    char* record = malloc(size);
+    if (!record) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(record, size, "%s %s %s %lld %lld %lld %lld\n%s", base, target, checksum,
+             (long long)before.st_ino, (long long)before.st_size,
+             (long long)before.st_mtim.tv_sec, (long long)before.st_mtim.tv_nsec, changes);
+    ok = write_file_replace(SESSION_PRESTAGE_FILE(session), record);
+    free(record);
+    release_store_lock();
+
+done:
+    if (in != -1) {
+        close(in);
+    }
+    if (out != -1) {
+        close(out);
+    }
+    unlink(tmp_index);
+    free(changes);
+    free(quoted_index);
+    free(next_index);
+    free(index_path);
+    return ok;
+}
+
+void cmd_prestage(int argc, char* argv[]) {
+    int count = argc > 0 ? atoi(argv[0]) : 2;
+    if (count <= 0) {
+        usage();
+    }
+
+    // One prestage at a time; a second one would only redo the same work
+    char* lock_path = safe_path_join(kaishaku_dir, ".prestage.lock");
+    int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    free(lock_path);
+    if (lock == -1 || flock(lock, LOCK_EX | LOCK_NB) == -1) {
+        return;
+    }
+
+    char base[JOURNAL_OID_SIZE];
+    if (!git->resolve("HEAD", base, sizeof(base))) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+
+    const char* active = read_from_file(ACTIVE_FILE);
+    const char* mru = read_all_from_file(MRU_FILE);
+    int staged = 0;
+    for (const char* p = mru; p && *p && count > 0;) {
+        size_t n = strcspn(p, "\n");
+        char name[256];
+        snprintf(name, sizeof(name), "%.*s", (int)n, p);
+        p += n + (p[n] == '\n');
+
+        if ((active && strcmp(active, name) == 0) || !file_exists(SESSION_DIR(name))) {
+            continue;
+        }
+        count--;
+        if (prestage_session(name, base)) {
+            printf("%sPrestaged session '%s'%s\n", COLOR_GREEN, name, COLOR_RESET);
+            staged++;
+        }
+    }
+
+    if (!staged) {
+        printf("%sNothing to prestage.%s\n", COLOR_YELLOW, COLOR_RESET);
+    }
+    close(lock);
+}
+
+// Check out a session's commit: narrowed to its cone, if it has one, and with the objects
+// it needs fetched up front in a partial clone. Returns 0 if git checkout failed.
+int checkout_session_tree(const char* session, const char* commit) {
+    const char* cones = read_all_from_file(SESSION_SPARSE_FILE(session));
+    int sparse = cones && cones[0];
+    char* patterns = NULL;
+
+    if (!sparse && !config.sparse_checkout && !batch_mode && !file_exists(SPARSE_PREV_FILE) &&
+        (apply_prestaged(session, commit) || restore_session_index(session, commit))) {
+        return 1;
+    }
+
+    // Narrow the working tree first, so the checkout only writes the cone
+    if (sparse) {
+        if (!apply_sparse_cones(cones)) {
+            exit(EXIT_FAILURE);
+        }
+        char* patterns_path = safe_path_join(root, ".git/info/sparse-checkout");
+        patterns = read_file_contents(patterns_path);
+        free(patterns_path);
+    } else if (config.promisor_remote[0]) {
+        // The tree will end up with the sparse state from before kaishaku, if any
+        const char* state = read_all_from_file(SPARSE_PREV_FILE);
+        if (state && state[0] == '1' && strchr(state, '\n')) {
+            patterns = strdup(strchr(state, '\n') + 1);
+        } else if (!state && config.sparse_checkout) {
+            char* patterns_path = safe_path_join(root, ".git/info/sparse-checkout");
+            patterns = read_file_contents(patterns_path);
+            free(patterns_path);
+        }
+    }
+
+    prefetch_objects(commit, patterns);
+    free(patterns);
+
+    char git_cmd[DEFAULT_BUFFER_SIZE + 27];
+    snprintf(git_cmd, sizeof(git_cmd), "git %s checkout %s --detach", checkout_options(),
+             commit);
+    if (!execute_git_command(git_cmd, NULL, 0)) {
+        return 0;
+    }
+
+    // Widening after the checkout rather than before writes the full tree only once
+    if (!sparse) {
+        restore_sparse_state();
+    }
+    return 1;
+}
+
+// A session name becomes a directory under .git/kaishaku and the last component of its
+// WIP ref, so it has to be a valid ref name without any '/'.
+static void check_session_name(const char* session) {
+    char ref[DEFAULT_BUFFER_SIZE];
+    char cmd[DEFAULT_BUFFER_SIZE * 2];
+    int n = snprintf(ref, sizeof(ref), WIP_REF_PREFIX "%s", session);
+    char* quoted = shell_quote(ref);
+    snprintf(cmd, sizeof(cmd), "git check-ref-format %s", quoted);
+    free(quoted);
+
+    if (n >= (int)sizeof(ref) || strchr(session, '/') || !execute_git_command(cmd, NULL, 0)) {
+        fprintf(stderr, "Error: Invalid session name '%s'.\n", session);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void cmd_checkout(int argc, char* argv[]) {
+    const char* session = NULL;
+    const char* commit = NULL;
+    char* cones = NULL;
+    size_t cones_len = 0, cones_cap = 0;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--sparse") == 0) {
+            while (i + 1 < argc && argv[i + 1][0] != '-') {
+                append_line(&cones, &cones_len, &cones_cap, argv[++i]);
+            }
+            if (!cones) {
+                fprintf(stderr, "Error: --sparse needs at least one directory.\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (!session) {
+            session = argv[i];
+        } else if (!commit) {
+            commit = argv[i];
+        } else {
+            usage();
+        }
+    }
+
+    if (!session)
+        usage();
+    check_session_name(session);
+    ensure_directory_exists(kaishaku_dir);
+
+    struct journal_record rec;
+    journal_begin(&rec, JOURNAL_CHECKOUT, session);
+
+    char* session_dir = SESSION_DIR(session);
+    ensure_directory_exists(session_dir);
+
+    leave_active_session(session);
+
+    char current_branch[DEFAULT_BUFFER_SIZE];
+    if (!git->head_branch(current_branch, sizeof(current_branch))) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!write_to_file(SESSION_FILE(session), current_branch)) {
+        exit(EXIT_FAILURE);
+    }
+
+    char head_hash[DEFAULT_BUFFER_SIZE];
+    if (!commit) {
+        if (!git->resolve("HEAD", head_hash, sizeof(head_hash))) {
+            fprintf(stderr, "Error: %s\n", error_message);
+            exit(EXIT_FAILURE);
+        }
+        commit = head_hash;
+    }
+
+    if (!write_to_file(HEAD_FILE(session), commit)) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (!write_to_file(ACTIVE_FILE, session)) {
+        exit(EXIT_FAILURE);
+    }
+
+    update_timestamp(session);  // Update timestamp when creating session
+
+    if (cones) {
+        cones[cones_len - 1] = '\0';
+        if (!write_to_file(SESSION_SPARSE_FILE(session), cones)) {
+            exit(EXIT_FAILURE);
+        }
+        free(cones);
+    } else {
+        remove_file(SESSION_SPARSE_FILE(session));
+    }
+
+    if (!checkout_session_tree(session, commit)) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+
+    journal_append(&rec);
+    touch_mru(session);
+    printf("%sSession '%s' started at %s%s\n", COLOR_GREEN, session, commit, COLOR_RESET);
+    spawn_prestage();
+}
+
+void cmd_switch(const char* session) {
+    if (!session)
+        usage();
+
+    ensure_directory_exists(kaishaku_dir);
+
+    const char* target_head = read_from_file(HEAD_FILE(session));
+    if (!target_head) {
+        fprintf(stderr, "Error: Session '%s' not found.\n", session);
+        exit(EXIT_FAILURE);
+    }
+
+    struct journal_record rec;
+    journal_begin(&rec, JOURNAL_SWITCH, session);
+
+    leave_active_session(session);
+
+    if (!write_to_file(ACTIVE_FILE, session)) {
+        exit(EXIT_FAILURE);
+    }
+
+    update_timestamp(session);  // Update timestamp when switching to session
+
+    if (!checkout_session_tree(session, target_head)) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+
+    journal_append(&rec);
+    touch_mru(session);
+    printf("%sSwitched to session '%s'%s\n", COLOR_GREEN, session, COLOR_RESET);
+    spawn_prestage();
+}
+
+void cmd_branch(const char* branch_name) {
+    if (!branch_name)
+        usage();
+
+    if (!file_exists(ACTIVE_FILE)) {
+        fprintf(stderr, "Error: No active kaishaku session.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char git_cmd[DEFAULT_BUFFER_SIZE];
+    snprintf(git_cmd, sizeof(git_cmd), "git checkout -b %s", branch_name);
+
+    if (!execute_git_command(git_cmd, NULL, 0)) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+
+    const char* session = read_from_file(ACTIVE_FILE);
+    if (!session) {
+        fprintf(stderr, "Error: Failed to read active session.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!write_to_file(HEAD_FILE(session), "HEAD")) {
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%sCreated branch '%s' from session '%s'%s\n", COLOR_GREEN, branch_name, session,
+           COLOR_RESET);
+}
+
+void cmd_save(const char* branch_name, const char* which) {
+    if (!branch_name)
+        usage();
+    if (strcmp(branch_name, "--dry-run") == 0) {
+        save_dry_run(which);
+        return;
+    }
+
+    if (!file_exists(ACTIVE_FILE)) {
+        fprintf(stderr, "Error: No active kaishaku session\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char* session = read_from_file(ACTIVE_FILE);
+    if (!session) {
+        fprintf(stderr, "Error: Failed to read active session\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char* original_branch = read_from_file(SESSION_FILE(session));
+    if (!original_branch) {
+        fprintf(stderr, "Error: Original branch not found for session '%s'\n", session);
+        exit(EXIT_FAILURE);
+    }
+
+    // The merge moves the original branch; remember where it was for undo
+    struct journal_record rec;
+    journal_begin(&rec, JOURNAL_SAVE, session);
+    snprintf(rec.ref_name, sizeof(rec.ref_name), "refs/heads/%s", original_branch);
+
+    char cmd[DEFAULT_BUFFER_SIZE];
+    git->resolve(rec.ref_name, rec.ref_before, sizeof(rec.ref_before));
+
+    // Create a temporary branch from current session
+    snprintf(cmd, sizeof(cmd), "git checkout -b %s", branch_name);
+    if (!execute_git_command(cmd, NULL, 0)) {
+        fprintf(stderr, "Error: Failed to create branch: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+
+    // Switch back to original branch
+    snprintf(cmd, sizeof(cmd), "git %s checkout %s", checkout_options(), original_branch);
+    if (!execute_git_command(cmd, NULL, 0)) {
+        fprintf(stderr, "Error: Failed to return to original branch: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+
+    // Merge the temporary branch
+    snprintf(cmd, sizeof(cmd), "git merge %s", branch_name);
+    if (!execute_git_command(cmd, NULL, 0)) {
+        // If merge fails, clean up and exit
+        snprintf(cmd, sizeof(cmd), "git %s checkout %s", checkout_options(), branch_name);
+        execute_git_command(cmd, NULL, 0);
+        snprintf(cmd, sizeof(cmd), "git branch -D %s", branch_name);
+        execute_git_command(cmd, NULL, 0);
+        fprintf(stderr, "Error: Failed to merge changes. Please resolve conflicts manually.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Delete the temporary branch
+    snprintf(cmd, sizeof(cmd), "git branch -D %s", branch_name);
+    if (!execute_git_command(cmd, NULL, 0)) {
+        fprintf(stderr, "Warning: Failed to delete temporary branch '%s'\n", branch_name);
+    }
+
+    write_to_file(HEAD_FILE(session), "HEAD");
+    update_timestamp(session);  // Update timestamp when saving changes
+
+    git->resolve(rec.ref_name, rec.ref_after, sizeof(rec.ref_after));
+    journal_append(&rec);
+
+    printf("%sSuccessfully saved changes from session '%s' to branch '%s'%s\n", COLOR_GREEN,
+           session, original_branch, COLOR_RESET);
+}
+
+void cmd_exit(const char* option) {
+    if (!file_exists(ACTIVE_FILE)) {
+        fprintf(stderr, "Error: No active kaishaku session.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const char* session = read_from_file(ACTIVE_FILE);
+    if (!session) {
+        fprintf(stderr, "Error: Failed to read active session.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const char* original_branch = read_from_file(SESSION_FILE(session));
+    if (!original_branch) {
+        fprintf(stderr, "Error: Original branch not found for session '%s'\n", session);
+        exit(EXIT_FAILURE);
+    }
+
+    int force = option && strcmp(option, "--force") == 0;
+    int keep = option && strcmp(option, "--keep") == 0;
+    int save = option && strcmp(option, "--save") == 0;
+    int no_save = option && strcmp(option, "--no-save") == 0;
+
+    // Check if we should automatically save changes
+    if (config.auto_save && !no_save) {
+        save = 1;
+    }
+
+    // Check if we should automatically stash changes (only if not saving)
+    if (config.auto_stash && !save && !force) {
+        keep = 1;
+    }
+
+    // Check if there are actually any changes
+    int has_changes = git->has_changes();
+
+    // Confirm before discarding changes if needed
+    if (!force && !keep && !save && config.confirm_exit && has_changes) {
+        printf("Discard uncommitted changes and exit? (y/N): ");
+        // In batch mode stdin carries the commands, so there is nobody to ask.
+        char c = batch_mode ? 'n' : getchar();
+        if (c != 'y' && c != 'Y') {
+            puts("Aborted.");
+            exit(0);
+        }
+    }
+
+    struct journal_record rec;
+    journal_begin(&rec, JOURNAL_EXIT, session);
+
+    char wip_ref[DEFAULT_BUFFER_SIZE];
+    snprintf(wip_ref, sizeof(wip_ref), WIP_REF_PREFIX "%s", session);
+    git->resolve(wip_ref, rec.watch_wip, sizeof(rec.watch_wip));
+
+    // Handle changes based on configuration and options
+    if (has_changes) {
+        if (save) {
+            // Save changes before exiting
+            char commit_msg[DEFAULT_BUFFER_SIZE];
+            snprintf(commit_msg, sizeof(commit_msg), "[kaishaku] Save changes from session '%s'",
+                     session);
+
+            char commit_cmd[DEFAULT_BUFFER_SIZE + 19];
+            snprintf(commit_cmd, sizeof(commit_cmd), "git commit -m \"%s\"", commit_msg);
+
+            if (!execute_git_command(commit_cmd, NULL, 0)) {
+                fprintf(stderr, "Error: Failed to save changes: %s\n", error_message);
+                exit(EXIT_FAILURE);
+            }
+            printf("%sChanges saved successfully.%s\n", COLOR_GREEN, COLOR_RESET);
+        } else if (keep) {
+            // Save the current stash before exiting
+            char stash_msg[DEFAULT_BUFFER_SIZE];
+            snprintf(stash_msg, sizeof(stash_msg), "kaishaku: auto-stash from session '%s'",
+                     session);
+
+            char stash_cmd[DEFAULT_BUFFER_SIZE + 23];
+            snprintf(stash_cmd, sizeof(stash_cmd), "git stash push -m \"%s\"", stash_msg);
+
+            if (!execute_git_command(stash_cmd, NULL, 0)) {
+                fprintf(stderr, "Warning: %s\n", error_message);
+                fprintf(stderr, "Continuing without stashing changes.\n");
+                // Continue despite error
+            } else {
+                printf(
+                    "%sChanges stashed successfully. Use 'git stash list' to see your stashes.%s\n",
+                    COLOR_GREEN, COLOR_RESET);
+            }
+        } else {
+            // Keep the discarded changes as a dangling stash commit that undo can apply
+            execute_git_command("git stash create", rec.wip, sizeof(rec.wip));
+
+            if (!execute_git_command("git reset --hard", NULL, 0)) {
+                fprintf(stderr, "Error: %s\n", error_message);
+                exit(EXIT_FAILURE);
+            }
+            printf("%sChanges discarded.%s\n", COLOR_YELLOW, COLOR_RESET);
+        }
+    } else if (keep || save) {
+        printf("%sNo changes to save or stash.%s\n", COLOR_YELLOW, COLOR_RESET);
+    }
+
+    record_session_tip(session);
+
+    // Return to original branch
+    char git_cmd[DEFAULT_BUFFER_SIZE];
+    snprintf(git_cmd, sizeof(git_cmd), "git %s checkout %s", checkout_options(), original_branch);
+
+    if (!execute_git_command(git_cmd, NULL, 0)) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+
+    restore_sparse_state();
+    remove_file(ACTIVE_FILE);
+    journal_append(&rec);
+    printf("%sReturned to branch '%s' from session '%s'%s\n", COLOR_GREEN, original_branch, session,
+           COLOR_RESET);
+}
+
+void cmd_status(void) {
+    if (!file_exists(ACTIVE_FILE)) {
+        printf("%sNo active kaishaku session.%s\n", COLOR_YELLOW, COLOR_RESET);
+        return;
+    }
+
+    const char* session = read_from_file(ACTIVE_FILE);
+    if (!session) {
+        fprintf(stderr, "Error: Failed to read active session.\n");
+        return;
+    }
+
+    const char* original_branch = read_from_file(SESSION_FILE(session));
+    const char* head = read_from_file(HEAD_FILE(session));
+
+    printf("%sActive session:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE, session);
+    printf("  %sOriginal branch:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
+           original_branch ? original_branch : "(unknown)");
+    printf("  %sSession HEAD:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
+           head ? head : "(unknown)");
+
+    printf("\n%sCurrent HEAD:%s\n", COLOR_CYAN, COLOR_RESET);
+    if (system("git log --oneline -1") > -1) {
+        printf("\n%sUncommitted changes:%s\n", COLOR_CYAN, COLOR_RESET);
+
+        if (system("git status --short") > -1) {
+            printf("\n%sConfiguration:%s\n", COLOR_CYAN, COLOR_RESET);
+            printf("  %sconfirm_exit:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
+                   config.confirm_exit ? "yes" : "no");
+            printf("  %sauto_stash:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
+                   config.auto_stash ? "yes" : "no");
+            printf("  %sauto_save:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
+                   config.auto_save ? "yes" : "no");
+        }
+    }
+}
+
+// Read the first line of a file without going through the store, for worker threads.
+static int read_line_file(const char* path, char* buf, size_t size) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+
+    int ok = fgets(buf, (int)size, fp) != NULL;
+    fclose(fp);
+    if (ok) {
+        buf[strcspn(buf, "\n")] = '\0';
+    }
+    return ok;
+}
+
+static int compare_sessions(const void* a, const void* b) {
+    const struct session_info* x = a;
+    const struct session_info* y = b;
+    int c = strcmp(x->repo, y->repo);
+    return c ? c : strcmp(x->name, y->name);
+}
+
+// Collect every session below sessions_dir, sorted by name. The current repository goes
+// through the store (use_store) so a batch sees its own pending changes; other
+// repositories are read directly. Returns 0 if the directory cannot be read.
+int load_session_list(const char* repo, const char* sessions_dir, int use_store,
+                      struct session_list* list) {
+    DIR* dir = opendir(sessions_dir);
+    if (!dir) {
+        return 0;
+    }
+
+    char path[MAX_PATH_LENGTH];
+    char active[DEFAULT_BUFFER_SIZE] = "";
+    snprintf(path, sizeof(path), "%s/.active", sessions_dir);
+    if (use_store) {
+        const char* session = read_from_file(ACTIVE_FILE);
+        snprintf(active, sizeof(active), "%s", session ? session : "");
+    } else {
+        read_line_file(path, active, sizeof(active));
+    }
+
+    size_t first = list->count;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // Skip dotfiles and the active session marker
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        // Skip sessions removed earlier in the same batch
+        if (use_store && !file_exists(SESSION_DIR(entry->d_name))) {
+            continue;
+        }
+
+        if (list->count == list->cap) {
+            list->cap = list->cap ? list->cap * 2 : 16;
+            list->items = realloc(list->items, list->cap * sizeof(*list->items));
+            if (!list->items) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        struct session_info* info = &list->items[list->count++];
+        memset(info, 0, sizeof(*info));
+        info->repo = repo;
+        snprintf(info->name, sizeof(info->name), "%s", entry->d_name);
+        info->active = strcmp(active, entry->d_name) == 0;
+
+        char time_str[DEFAULT_BUFFER_SIZE] = "";
+        if (use_store) {
+            const char* branch = read_from_file(SESSION_FILE(entry->d_name));
+            const char* head = read_from_file(HEAD_FILE(entry->d_name));
+            const char* time_value = read_from_file(SESSION_TIME_FILE(entry->d_name));
+            info->corrupted = !branch || !head;
+            snprintf(info->branch, sizeof(info->branch), "%s", branch ? branch : "");
+            snprintf(info->head, sizeof(info->head), "%s", head ? head : "");
+            snprintf(time_str, sizeof(time_str), "%s", time_value ? time_value : "");
+        } else {
+            snprintf(path, sizeof(path), "%s/%s/session", sessions_dir, entry->d_name);
+            info->corrupted = !read_line_file(path, info->branch, sizeof(info->branch));
+            snprintf(path, sizeof(path), "%s/%s/head", sessions_dir, entry->d_name);
+            info->corrupted |= !read_line_file(path, info->head, sizeof(info->head));
+            snprintf(path, sizeof(path), "%s/%s/time", sessions_dir, entry->d_name);
+            read_line_file(path, time_str, sizeof(time_str));
+        }
+        info->time = atol(time_str);
+    }
+
+    closedir(dir);
+    qsort(list->items + first, list->count - first, sizeof(*list->items), compare_sessions);
+    return 1;
+}
+
+// Object lookup without git. Every pack .idx, and the multi-pack-index when there is
+// one, is mapped and searched through its fanout table; anything not found there is a
+// loose object or missing. Alternates are followed like git does.
+#define ODB_MAX_ALTERNATE_DEPTH 5
+
+struct packfile {
+    char* path;
+    unsigned char* map;  // Mapped on first use
+    size_t size;
+    size_t hash_len;     // Of the trailing checksum and of REF_DELTA bases, as in the index
+    int failed;
+};
+
+struct pack_idx {
+    unsigned char* map;
+    size_t size;
+    size_t hash_len;              // 20 for SHA-1, 32 for SHA-256
+    uint32_t nr;                  // Number of objects
+    const unsigned char* fanout;  // 256 cumulative big-endian counts by first byte
+    const unsigned char* oids;    // Sorted object ids, stride bytes apart
+    size_t stride;
+    char* path;                   // The .idx file, or the multi-pack-index
+    int version;                  // 1 or 2, or 0 for a multi-pack-index
+    const unsigned char* offsets;  // v2: 4-byte offsets; midx: (pack, offset) pairs
+    const unsigned char* large_offsets;  // 8-byte offsets the others point at
+    size_t nr_large;
+    struct packfile* packfiles;  // The .pack, or every pack a multi-pack-index names
+    size_t nr_packfiles;
+};
+
+struct delta_cache;
+
+struct odb {
+    char** dirs;  // Object directories: the repository's, then its alternates
+    size_t nr_dirs;
+    struct pack_idx* packs;
+    size_t nr_packs;
+    struct delta_cache* cache;  // Recently used pack objects, for delta bases
+};
+
+static uint32_t get_be32(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t get_be64(const unsigned char* p) {
+    return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static unsigned char* map_file(const char* path, size_t* size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    return map;
+}
+
+// The fanout table must count up to nr and the ids must fit in the file.
+static int pack_idx_check(struct pack_idx* idx, size_t end) {
+    uint32_t prev = 0;
+    for (int i = 0; i < 256; i++) {
+        uint32_t n = get_be32(idx->fanout + 4 * i);
+        if (n < prev) {
+            return 0;
+        }
+        prev = n;
+    }
+    idx->nr = prev;
+    return (size_t)(idx->oids - idx->map) + (size_t)idx->nr * idx->stride <= end;
+}
+
+static int pack_idx_open(struct pack_idx* idx, const char* path) {
+    memset(idx, 0, sizeof(*idx));
+    idx->map = map_file(path, &idx->size);
+    if (!idx->map) {
+        return 0;
+    }
+
+    static const unsigned char v2_magic[] = {0xff, 't', 'O', 'c'};
+    if (idx->size >= 8 + 1024 && memcmp(idx->map, v2_magic, 4) == 0 &&
+        get_be32(idx->map + 4) == 2) {
+        // Header, fanout, ids, CRCs, 32-bit offsets, 64-bit offsets, two checksums. The
+        // hash size is not recorded; only one of them makes the sizes add up.
+        idx->fanout = idx->map + 8;
+        idx->oids = idx->map + 8 + 1024;
+        uint32_t nr = get_be32(idx->fanout + 4 * 255);
+        for (size_t hash_len = 20; hash_len <= 32 && !idx->hash_len; hash_len += 12) {
+            size_t fixed = 8 + 1024 + (size_t)nr * (hash_len + 8) + 2 * hash_len;
+            if (idx->size >= fixed && (idx->size - fixed) % 8 == 0 &&
+                (idx->size - fixed) / 8 <= nr) {
+                idx->hash_len = idx->stride = hash_len;
+            }
+        }
+    } else if (idx->size >= 1024 + 40) {
+        // Version 1: fanout, then a 4-byte offset before each SHA-1
+        idx->fanout = idx->map;
+        idx->oids = idx->map + 1024 + 4;
+        idx->hash_len = 20;
+        idx->stride = 24;
+    }
+
+    if (!idx->hash_len || !pack_idx_check(idx, idx->size)) {
+        munmap(idx->map, idx->size);
+        idx->map = NULL;
+        return 0;
+    }
+    idx->version = idx->stride == 24 ? 1 : 2;
+    if (idx->version == 2) {
+        idx->offsets = idx->oids + (size_t)idx->nr * (idx->hash_len + 4);
+        idx->large_offsets = idx->offsets + (size_t)idx->nr * 4;
+        idx->nr_large = (idx->size - 2 * idx->hash_len -
+                         (size_t)(idx->large_offsets - idx->map)) / 8;
+    }
+
+    size_t len = strlen(path);
+    idx->path = strdup(path);
+    idx->packfiles = calloc(1, sizeof(*idx->packfiles));
+    if (!idx->path || !idx->packfiles || !(idx->packfiles->path = malloc(len + 2))) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(idx->packfiles->path, "%.*s.pack", (int)(len - 4), path);
+    idx->packfiles->hash_len = idx->hash_len;
+    idx->nr_packfiles = 1;
+    return 1;
+}
+
+// Map a multi-pack-index. Its PNAM chunk goes to *names so the packs it covers are
+// not opened a second time.
+static int midx_open(struct pack_idx* idx, const char* path, const char** names,
+                     size_t* names_size) {
+    const unsigned char* large_end = NULL;
+    memset(idx, 0, sizeof(*idx));
+    idx->map = map_file(path, &idx->size);
+    if (!idx->map) {
+        return 0;
+    }
+
+    const unsigned char* m = idx->map;
+    size_t chunks = idx->size >= 12 ? m[6] : 0;
+    if (idx->size < 12 + (chunks + 1) * 12 || memcmp(m, "MIDX", 4) != 0 || m[4] != 1 ||
+        (m[5] != 1 && m[5] != 2)) {
+        munmap(idx->map, idx->size);
+        idx->map = NULL;
+        return 0;
+    }
+    idx->hash_len = idx->stride = m[5] == 1 ? 20 : 32;
+
+    for (size_t i = 0; i < chunks; i++) {
+        const unsigned char* entry = m + 12 + i * 12;
+        uint64_t offset = get_be64(entry + 4), next = get_be64(entry + 16);
+        if (offset > idx->size || next > idx->size || next < offset) {
+            break;
+        }
+        if (memcmp(entry, "OIDF", 4) == 0 && next - offset >= 1024) {
+            idx->fanout = m + offset;
+        } else if (memcmp(entry, "OIDL", 4) == 0) {
+            idx->oids = m + offset;
+        } else if (memcmp(entry, "PNAM", 4) == 0) {
+            *names = (const char*)m + offset;
+            *names_size = (size_t)(next - offset);
+        } else if (memcmp(entry, "OOFF", 4) == 0) {
+            idx->offsets = m + offset;
+        } else if (memcmp(entry, "LOFF", 4) == 0) {
+            idx->large_offsets = m + offset;
+            large_end = m + next;
+        }
+    }
+
+    if (!idx->fanout || !idx->oids || !idx->offsets || !*names ||
+        !pack_idx_check(idx, idx->size) ||
+        (size_t)(idx->offsets - m) + (size_t)idx->nr * 8 > idx->size) {
+        munmap(idx->map, idx->size);
+        idx->map = NULL;
+        *names = NULL;
+        return 0;
+    }
+    idx->nr_large = idx->large_offsets ? (size_t)(large_end - idx->large_offsets) / 8 : 0;
+
+    // The packs, in pack-int-id order
+    char* dir = strdup(path);
+    if (!dir) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    *strrchr(dir, '/') = '\0';
+    for (const char* p = *names; p < *names + *names_size && *p; p += strlen(p) + 1) {
+        struct packfile* packfiles =
+            realloc(idx->packfiles, (idx->nr_packfiles + 1) * sizeof(*packfiles));
+        size_t len = strlen(p);
+        if (!packfiles || len < 5) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        idx->packfiles = packfiles;
+        struct packfile* pack = &idx->packfiles[idx->nr_packfiles++];
+        memset(pack, 0, sizeof(*pack));
+        pack->hash_len = idx->hash_len;
+        pack->path = malloc(strlen(dir) + len + 3);
+        if (!pack->path) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        sprintf(pack->path, "%s/%.*s.pack", dir, (int)(len - 4), p);
+    }
+    free(dir);
+    idx->path = strdup(path);
+    return 1;
+}
+
+static void odb_add_pack(struct odb* odb, const struct pack_idx* idx) {
+    struct pack_idx* packs = realloc(odb->packs, (odb->nr_packs + 1) * sizeof(*packs));
+    if (!packs) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    odb->packs = packs;
+    odb->packs[odb->nr_packs++] = *idx;
+}
+
+static int name_in_list(const char* names, size_t size, const char* name) {
+    for (const char* p = names; names && p < names + size && *p; p += strlen(p) + 1) {
+        if (strcmp(p, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void odb_add_dir(struct odb* odb, const char* objects, int depth) {
+    for (size_t i = 0; i < odb->nr_dirs; i++) {
+        if (strcmp(odb->dirs[i], objects) == 0) {
+            return;
+        }
+    }
+    char** dirs = realloc(odb->dirs, (odb->nr_dirs + 1) * sizeof(*dirs));
+    if (!dirs || !(dirs[odb->nr_dirs] = strdup(objects))) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    odb->dirs = dirs;
+    odb->nr_dirs++;
+
+    char path[MAX_PATH_LENGTH];
+    struct pack_idx idx;
+    const char* names = NULL;
+    size_t names_size = 0;
+    if (snprintf(path, sizeof(path), "%s/pack/multi-pack-index", objects) >= (int)sizeof(path)) {
+        return;
+    }
+    if (midx_open(&idx, path, &names, &names_size)) {
+        odb_add_pack(odb, &idx);
+    }
+
+    snprintf(path, sizeof(path), "%s/pack", objects);
+    DIR* dir = opendir(path);
+    struct dirent* entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len < 5 || strcmp(entry->d_name + len - 4, ".idx") != 0 ||
+            name_in_list(names, names_size, entry->d_name)) {
+            continue;
+        }
+        // Like git, ignore an index whose pack is gone
+        if (snprintf(path, sizeof(path), "%s/pack/%.*s.pack", objects, (int)(len - 4),
+                     entry->d_name) >= (int)sizeof(path) ||
+            access(path, F_OK) == -1) {
+            continue;
+        }
+        snprintf(path + strlen(path) - 5, 6, ".idx");
+        if (pack_idx_open(&idx, path)) {
+            odb_add_pack(odb, &idx);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+
+    if (depth >= ODB_MAX_ALTERNATE_DEPTH ||
+        snprintf(path, sizeof(path), "%s/info/alternates", objects) >= (int)sizeof(path)) {
+        return;
+    }
+    char* alternates = read_file_contents(path);
+    char* saveptr = NULL;
+    for (char* line = alternates ? strtok_r(alternates, "\n", &saveptr) : NULL; line;
+         line = strtok_r(NULL, "\n", &saveptr)) {
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+        int n = line[0] == '/' ? snprintf(path, sizeof(path), "%s", line)
+                               : snprintf(path, sizeof(path), "%s/%s", objects, line);
+        if (n < (int)sizeof(path)) {
+            odb_add_dir(odb, path, depth + 1);
+        }
+    }
+    free(alternates);
+}
+
+// A working tree's git directory, and the common one it shares with the other
+// worktrees (the same directory outside linked worktrees).
+static void repo_git_dirs(const char* repo, char** gitdir, char** commondir) {
+    char line[MAX_PATH_LENGTH];
+    struct stat st;
+    *gitdir = safe_path_join(repo, ".git");
+    *commondir = NULL;
+    if (stat(*gitdir, &st) == 0 && S_ISREG(st.st_mode) &&
+        read_line_file(*gitdir, line, sizeof(line)) && strncmp(line, "gitdir: ", 8) == 0) {
+        free(*gitdir);
+        *gitdir = line[8] == '/' ? strdup(line + 8) : safe_path_join(repo, line + 8);
+        char* path = safe_path_join(*gitdir, "commondir");
+        if (read_line_file(path, line, sizeof(line))) {
+            *commondir = line[0] == '/' ? strdup(line) : safe_path_join(*gitdir, line);
+        }
+        free(path);
+    }
+    if (!*commondir) {
+        *commondir = strdup(*gitdir);
+    }
+    if (!*gitdir || !*commondir) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// The object directory of the repository whose working tree is at repo
+static char* repo_objects_dir(const char* repo) {
+    char *gitdir, *commondir;
+    repo_git_dirs(repo, &gitdir, &commondir);
+    char* objects = safe_path_join(commondir, "objects");
+    free(gitdir);
+    free(commondir);
+    return objects;
+}
+
+void odb_open(struct odb* odb, const char* repo) {
+    memset(odb, 0, sizeof(*odb));
+    const char* env = repo == root ? getenv("GIT_OBJECT_DIRECTORY") : NULL;
+    char* objects = env ? strdup(env) : repo_objects_dir(repo);
+    odb_add_dir(odb, objects, 0);
+    free(objects);
+}
+
+static void delta_cache_free(struct delta_cache* cache);
+
+void odb_close(struct odb* odb) {
+    for (size_t i = 0; i < odb->nr_packs; i++) {
+        struct pack_idx* idx = &odb->packs[i];
+        for (size_t k = 0; k < idx->nr_packfiles; k++) {
+            if (idx->packfiles[k].map) {
+                munmap(idx->packfiles[k].map, idx->packfiles[k].size);
+            }
+            free(idx->packfiles[k].path);
+        }
+        free(idx->packfiles);
+        munmap(idx->map, idx->size);
+        free(idx->path);
+    }
+    delta_cache_free(odb->cache);
+    for (size_t i = 0; i < odb->nr_dirs; i++) {
+        free(odb->dirs[i]);
+    }
+    free(odb->packs);
+    free(odb->dirs);
+}
+
+// Position of oid in a pack index, or -1.
+static long pack_idx_find(const struct pack_idx* idx, const unsigned char* oid) {
+    uint32_t lo = oid[0] ? get_be32(idx->fanout + 4 * (oid[0] - 1)) : 0;
+    uint32_t hi = get_be32(idx->fanout + 4 * oid[0]);
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int c = memcmp(idx->oids + (size_t)mid * idx->stride, oid, idx->hash_len);
+        if (c == 0) {
+            return (long)mid;
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return -1;
+}
+
+static int hex_to_oid(const char* hex, unsigned char* oid, size_t* len) {
+    size_t n = strlen(hex);
+    if (n != 40 && n != 64) {
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        char c = hex[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (v < 0) {
+            return 0;
+        }
+        oid[i / 2] = (unsigned char)(i % 2 ? oid[i / 2] << 4 | v : v);
+    }
+    *len = n / 2;
+    return 1;
+}
+
+// Whether the object named by a full hex id is in the repository. Names that are not
+// full ids return -1 and have to be resolved by git.
+int odb_has_object(const struct odb* odb, const char* hex) {
+    unsigned char oid[32];
+    size_t len;
+    if (!hex_to_oid(hex, oid, &len)) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < odb->nr_packs; i++) {
+        if (odb->packs[i].hash_len == len && pack_idx_find(&odb->packs[i], oid) >= 0) {
+            return 1;
+        }
+    }
+
+    struct stat st;
+    char path[MAX_PATH_LENGTH];
+    for (size_t i = 0; i < odb->nr_dirs; i++) {
+        snprintf(path, sizeof(path), "%s/%.2s/%s", odb->dirs[i], hex, hex + 2);
+        if (stat(path, &st) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Reading objects: loose objects are inflated whole, packed ones are inflated and, for
+// deltas, rebuilt from their base. Bases come from a small LRU cache, since the commits
+// of one history tend to be deltas against the same few objects.
+#define OBJ_COMMIT 1
+#define OBJ_TREE 2
+#define OBJ_BLOB 3
+#define OBJ_TAG 4
+#define OBJ_OFS_DELTA 6
+#define OBJ_REF_DELTA 7
+#define OBJECT_MAX_SIZE (64 * 1024 * 1024)
+#define DELTA_MAX_DEPTH 4096
+#define DELTA_CACHE_ENTRIES 256
+#define DELTA_CACHE_BUCKETS 512
+#define DELTA_CACHE_MAX_BYTES (32 * 1024 * 1024)
+
+struct delta_cache_entry {
+    const struct packfile* pack;
+    uint64_t offset;
+    int type;
+    unsigned char* data;
+    size_t size;
+    int prev, next;  // LRU list, most recent first
+    int chain;       // Next entry in the same bucket
+};
+
+struct delta_cache {
+    struct delta_cache_entry entries[DELTA_CACHE_ENTRIES];
+    int buckets[DELTA_CACHE_BUCKETS];
+    int head, tail, used;
+    size_t bytes;
+};
+
+static size_t delta_cache_bucket(const struct packfile* pack, uint64_t offset) {
+    return (size_t)(((uintptr_t)pack >> 4) ^ offset ^ (offset >> 9)) % DELTA_CACHE_BUCKETS;
+}
+
+static void delta_cache_unlink(struct delta_cache* cache, int i) {
+    struct delta_cache_entry* e = &cache->entries[i];
+    if (e->prev >= 0) {
+        cache->entries[e->prev].next = e->next;
+    } else {
+        cache->head = e->next;
+    }
+    if (e->next >= 0) {
+        cache->entries[e->next].prev = e->prev;
+    } else {
+        cache->tail = e->prev;
+    }
+}
+
+static void delta_cache_push_front(struct delta_cache* cache, int i) {
+    struct delta_cache_entry* e = &cache->entries[i];
+    e->prev = -1;
+    e->next = cache->head;
+    if (cache->head >= 0) {
+        cache->entries[cache->head].prev = i;
+    }
+    cache->head = i;
+    if (cache->tail < 0) {
+        cache->tail = i;
+    }
+}
+
+static struct delta_cache_entry* delta_cache_get(struct delta_cache* cache,
+                                                 const struct packfile* pack, uint64_t offset) {
+    if (!cache) {
+        return NULL;
+    }
+    for (int i = cache->buckets[delta_cache_bucket(pack, offset)]; i >= 0;
+         i = cache->entries[i].chain) {
+        if (cache->entries[i].pack == pack && cache->entries[i].offset == offset) {
+            delta_cache_unlink(cache, i);
+            delta_cache_push_front(cache, i);
+            return &cache->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void delta_cache_evict(struct delta_cache* cache) {
+    int i = cache->tail;
+    struct delta_cache_entry* e = &cache->entries[i];
+    int* link = &cache->buckets[delta_cache_bucket(e->pack, e->offset)];
+    while (*link != i) {
+        link = &cache->entries[*link].chain;
+    }
+    *link = e->chain;
+    delta_cache_unlink(cache, i);
+    cache->bytes -= e->size;
+    free(e->data);
+    e->data = NULL;
+    e->pack = NULL;
+}
+
+// Keep a copy of an object read from a pack.
+static void delta_cache_put(struct odb* odb, const struct packfile* pack, uint64_t offset,
+                            int type, const unsigned char* data, size_t size) {
+    if (size > DELTA_CACHE_MAX_BYTES / 4 || delta_cache_get(odb->cache, pack, offset)) {
+        return;
+    }
+    if (!odb->cache) {
+        odb->cache = calloc(1, sizeof(*odb->cache));
+        if (!odb->cache) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        odb->cache->head = odb->cache->tail = -1;
+        for (int i = 0; i < DELTA_CACHE_BUCKETS; i++) {
+            odb->cache->buckets[i] = -1;
+        }
+    }
+    struct delta_cache* cache = odb->cache;
+    while (cache->tail >= 0 && cache->bytes + size > DELTA_CACHE_MAX_BYTES) {
+        delta_cache_evict(cache);
+    }
+
+    // A free slot, or the least recently used one
+    int i = cache->used < DELTA_CACHE_ENTRIES ? cache->used++ : -1;
+    for (int k = 0; i < 0 && k < DELTA_CACHE_ENTRIES; k++) {
+        if (!cache->entries[k].pack) {
+            i = k;
+        }
+    }
+    if (i < 0) {
+        i = cache->tail;
+        delta_cache_evict(cache);
+    }
+
+    struct delta_cache_entry* e = &cache->entries[i];
+    e->data = malloc(size + 1);
+    if (!e->data) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(e->data, data, size);
+    e->data[size] = '\0';
+    e->pack = pack;
+    e->offset = offset;
+    e->type = type;
+    e->size = size;
+    size_t bucket = delta_cache_bucket(pack, offset);
+    e->chain = cache->buckets[bucket];
+    cache->buckets[bucket] = i;
+    delta_cache_push_front(cache, i);
+    cache->bytes += size;
+}
+
+static void delta_cache_free(struct delta_cache* cache) {
+    if (!cache) {
+        return;
+    }
+    for (int i = 0; i < DELTA_CACHE_ENTRIES; i++) {
+        free(cache->entries[i].data);
+    }
+    free(cache);
+}
+
+// Inflate exactly size bytes from a zlib stream. Returns a NUL-terminated buffer.
+static unsigned char* inflate_exact(const unsigned char* in, size_t in_len, size_t size) {
+    unsigned char* out = malloc(size + 1);
+    if (!out) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    zs.next_in = (unsigned char*)in;
+    zs.avail_in = in_len > UINT_MAX ? UINT_MAX : (unsigned)in_len;
+    zs.next_out = out;
+    zs.avail_out = (unsigned)size;
+    int status = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+
+    if ((status != Z_STREAM_END && !(status == Z_BUF_ERROR && zs.avail_out == 0)) ||
+        zs.total_out != size) {
+        free(out);
+        return NULL;
+    }
+    out[size] = '\0';
+    return out;
+}
+
+static int delta_size(const unsigned char** p, const unsigned char* end, size_t* size) {
+    size_t value = 0;
+    int shift = 0;
+    unsigned char c;
+    do {
+        if (*p >= end || shift > 56) {
+            return 0;
+        }
+        c = *(*p)++;
+        value |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    *size = value;
+    return 1;
+}
+
+// Rebuild an object from its base and a git delta.
+static unsigned char* apply_delta(const unsigned char* base, size_t base_size,
+                                  const unsigned char* delta, size_t delta_len, size_t* size) {
+    const unsigned char* p = delta;
+    const unsigned char* end = delta + delta_len;
+    size_t expected_base, result_size;
+    if (!delta_size(&p, end, &expected_base) || expected_base != base_size ||
+        !delta_size(&p, end, &result_size) || result_size > OBJECT_MAX_SIZE) {
+        return NULL;
+    }
+
+    unsigned char* out = malloc(result_size + 1);
+    if (!out) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t pos = 0;
+    while (p < end) {
+        unsigned char cmd = *p++;
+        if (cmd & 0x80) {
+            // Copy from the base: which offset and size bytes follow is in the low bits
+            size_t offset = 0, n = 0;
+            for (int i = 0; i < 4; i++) {
+                if (cmd & (1 << i)) {
+                    offset |= (size_t)(p < end ? *p++ : 0) << (8 * i);
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                if (cmd & (0x10 << i)) {
+                    n |= (size_t)(p < end ? *p++ : 0) << (8 * i);
+                }
+            }
+            if (n == 0) {
+                n = 0x10000;
+            }
+            if (offset + n > base_size || pos + n > result_size) {
+                break;
+            }
+            memcpy(out + pos, base + offset, n);
+            pos += n;
+        } else if (cmd) {
+            // Insert the next cmd bytes of the delta
+            if ((size_t)(end - p) < cmd || pos + cmd > result_size) {
+                break;
+            }
+            memcpy(out + pos, p, cmd);
+            pos += cmd;
+            p += cmd;
+        } else {
+            break;
+        }
+    }
+
+    if (p != end || pos != result_size) {
+        free(out);
+        return NULL;
+    }
+    out[result_size] = '\0';
+    *size = result_size;
+    return out;
+}
+
+// Where an object is in the packs, if it is packed.
+static int odb_find_packed(struct odb* odb, const unsigned char* oid, size_t len,
+                           struct packfile** pack, uint64_t* offset) {
+    for (size_t i = 0; i < odb->nr_packs; i++) {
+        struct pack_idx* idx = &odb->packs[i];
+        long pos = idx->hash_len == len ? pack_idx_find(idx, oid) : -1;
+        if (pos < 0) {
+            continue;
+        }
+
+        uint32_t pack_id = 0, value;
+        if (idx->version == 1) {
+            value = get_be32(idx->oids - 4 + (size_t)pos * idx->stride);
+        } else if (idx->version == 2) {
+            value = get_be32(idx->offsets + (size_t)pos * 4);
+        } else {
+            pack_id = get_be32(idx->offsets + (size_t)pos * 8);
+            value = get_be32(idx->offsets + (size_t)pos * 8 + 4);
+        }
+        if (value & 0x80000000u && idx->version != 1) {
+            value &= 0x7fffffffu;
+            if (value >= idx->nr_large) {
+                continue;
+            }
+            *offset = get_be64(idx->large_offsets + (size_t)value * 8);
+        } else {
+            *offset = value;
+        }
+        if (pack_id >= idx->nr_packfiles) {
+            continue;
+        }
+
+        struct packfile* p = &idx->packfiles[pack_id];
+        if (!p->map && !p->failed) {
+            p->map = map_file(p->path, &p->size);
+            p->failed = !p->map || p->size < 32 || memcmp(p->map, "PACK", 4) != 0;
+        }
+        if (p->failed || *offset >= p->size) {
+            continue;
+        }
+        *pack = p;
+        return 1;
+    }
+    return 0;
+}
+
+static unsigned char* odb_read_oid(struct odb* odb, const unsigned char* oid, size_t len,
+                                   int* type, size_t* size, int depth);
+
+// Read the object at offset in pack, resolving deltas.
+static unsigned char* pack_read_object(struct odb* odb, struct packfile* pack, uint64_t offset,
+                                       int* type, size_t* size, int depth) {
+    struct delta_cache_entry* cached = delta_cache_get(odb->cache, pack, offset);
+    if (cached) {
+        unsigned char* copy = malloc(cached->size + 1);
+        if (!copy) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(copy, cached->data, cached->size + 1);
+        *type = cached->type;
+        *size = cached->size;
+        return copy;
+    }
+    if (depth > DELTA_MAX_DEPTH) {
+        return NULL;
+    }
+
+    // Type and inflated size: 3 bits and 4 bits, then 7 more bits per byte
+    const unsigned char* p = pack->map + offset;
+    const unsigned char* end = pack->map + pack->size - pack->hash_len;
+    unsigned char c = *p++;
+    int obj_type = (c >> 4) & 7;
+    size_t obj_size = c & 15;
+    for (int shift = 4; c & 0x80; shift += 7) {
+        if (p >= end || shift > 56) {
+            return NULL;
+        }
+        c = *p++;
+        obj_size |= (size_t)(c & 0x7f) << shift;
+    }
+    if (obj_size > OBJECT_MAX_SIZE) {
+        return NULL;
+    }
+
+    unsigned char* base = NULL;
+    size_t base_size = 0;
+    if (obj_type == OBJ_OFS_DELTA) {
+        // Distance back to the base, in git's offset encoding
+        if (p >= end) {
+            return NULL;
+        }
+        c = *p++;
+        uint64_t distance = c & 0x7f;
+        while (c & 0x80) {
+            if (p >= end) {
+                return NULL;
+            }
+            c = *p++;
+            distance = ((distance + 1) << 7) | (c & 0x7f);
+        }
+        if (distance == 0 || distance > offset) {
+            return NULL;
+        }
+        base = pack_read_object(odb, pack, offset - distance, type, &base_size, depth + 1);
+        if (base) {
+            delta_cache_put(odb, pack, offset - distance, *type, base, base_size);
+        }
+    } else if (obj_type == OBJ_REF_DELTA) {
+        if ((size_t)(end - p) < pack->hash_len) {
+            return NULL;
+        }
+        base = odb_read_oid(odb, p, pack->hash_len, type, &base_size, depth + 1);
+        p += pack->hash_len;
+    } else if (obj_type >= OBJ_COMMIT && obj_type <= OBJ_TAG) {
+        *type = obj_type;
+        *size = obj_size;
+        return inflate_exact(p, (size_t)(end - p), obj_size);
+    } else {
+        return NULL;
+    }
+    if (!base) {
+        return NULL;
+    }
+
+    unsigned char* delta = inflate_exact(p, (size_t)(end - p), obj_size);
+    unsigned char* result = delta ? apply_delta(base, base_size, delta, obj_size, size) : NULL;
+    free(delta);
+    free(base);
+    return result;
+}
+
+// Read a loose object: a zlib stream of "<type> <size>\0<content>".
+static unsigned char* loose_read_object(const struct odb* odb, const char* hex, int* type,
+                                        size_t* size) {
+    static const char* names[] = {NULL, "commit", "tree", "blob", "tag"};
+    char path[MAX_PATH_LENGTH];
+    unsigned char* map = NULL;
+    size_t map_size = 0;
+    for (size_t i = 0; i < odb->nr_dirs && !map; i++) {
+        if (snprintf(path, sizeof(path), "%s/%.2s/%s", odb->dirs[i], hex, hex + 2) <
+            (int)sizeof(path)) {
+            map = map_file(path, &map_size);
+        }
+    }
+    if (!map) {
+        return NULL;
+    }
+
+    // Inflate the header first to learn the size, then the rest into place
+    unsigned char header[64];
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    unsigned char* out = NULL;
+    if (inflateInit(&zs) != Z_OK) {
+        munmap(map, map_size);
+        return NULL;
+    }
+    zs.next_in = map;
+    zs.avail_in = map_size > UINT_MAX ? UINT_MAX : (unsigned)map_size;
+    zs.next_out = header;
+    zs.avail_out = sizeof(header);
+    int status = inflate(&zs, Z_SYNC_FLUSH);
+    size_t got = sizeof(header) - zs.avail_out;
+    unsigned char* nul = memchr(header, '\0', got);
+    char* space = nul ? memchr(header, ' ', (size_t)(nul - header)) : NULL;
+
+    if ((status == Z_OK || status == Z_STREAM_END) && space) {
+        *space = '\0';
+        *type = 0;
+        for (int t = OBJ_COMMIT; t <= OBJ_TAG; t++) {
+            if (strcmp((char*)header, names[t]) == 0) {
+                *type = t;
+            }
+        }
+        *size = strtoul(space + 1, NULL, 10);
+        size_t have = got - (size_t)(nul + 1 - header);
+        if (*type && *size <= OBJECT_MAX_SIZE && have <= *size) {
+            out = malloc(*size + 1);
+            if (!out) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(out, nul + 1, have);
+            zs.next_out = out + have;
+            zs.avail_out = (unsigned)(*size - have);
+            if (have < *size || status != Z_STREAM_END) {
+                status = inflate(&zs, Z_FINISH);
+            }
+            if (zs.total_out != got - have + *size ||
+                (status != Z_STREAM_END && status != Z_BUF_ERROR)) {
+                free(out);
+                out = NULL;
+            } else {
+                out[*size] = '\0';
+            }
+        }
+    }
+    inflateEnd(&zs);
+    munmap(map, map_size);
+    return out;
+}
+
+static unsigned char* odb_read_oid(struct odb* odb, const unsigned char* oid, size_t len,
+                                   int* type, size_t* size, int depth) {
+    struct packfile* pack;
+    uint64_t offset;
+    if (odb_find_packed(odb, oid, len, &pack, &offset)) {
+        return pack_read_object(odb, pack, offset, type, size, depth);
+    }
+
+    char hex[65];
+    for (size_t i = 0; i < len; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", oid[i]);
+    }
+    return loose_read_object(odb, hex, type, size);
+}
+
+// Read the object named by a full hex id. Returns a NUL-terminated malloc'd buffer.
+unsigned char* odb_read_object(struct odb* odb, const char* hex, int* type, size_t* size) {
+    unsigned char oid[32];
+    size_t len;
+    if (!hex_to_oid(hex, oid, &len)) {
+        return NULL;
+    }
+    return odb_read_oid(odb, oid, len, type, size, 0);
+}
+
+// What list shows about a commit
+struct commit_summary {
+    char parent[72];    // First parent, "" for a root commit
+    int parents;
+    long author_time;
+    char subject[256];  // First line of the message
+};
+
+int odb_read_commit(struct odb* odb, const char* hex, struct commit_summary* summary) {
+    int type;
+    size_t size;
+    char* data = (char*)odb_read_object(odb, hex, &type, &size);
+    if (!data || type != OBJ_COMMIT) {
+        free(data);
+        return 0;
+    }
+
+    memset(summary, 0, sizeof(*summary));
+    char* line = data;
+    while (*line && *line != '\n') {
+        char* end = line + strcspn(line, "\n");
+        if (strncmp(line, "parent ", 7) == 0) {
+            if (summary->parents++ == 0) {
+                snprintf(summary->parent, sizeof(summary->parent), "%.*s", (int)(end - line - 7),
+                         line + 7);
+            }
+        } else if (strncmp(line, "author ", 7) == 0) {
+            // "author Name <email> <seconds> <zone>"
+            char* email_end = memchr(line, '>', (size_t)(end - line));
+            if (email_end) {
+                summary->author_time = strtol(email_end + 1, NULL, 10);
+            }
+        }
+        line = *end ? end + 1 : end;
+    }
+
+    if (*line == '\n') {
+        line++;
+        snprintf(summary->subject, sizeof(summary->subject), "%.*s", (int)strcspn(line, "\n"),
+                 line);
+    }
+    free(data);
+    return 1;
+}
+
+// The tree a commit points at
+static int odb_commit_tree(struct odb* odb, const char* hex, char* tree, size_t size) {
+    int type;
+    size_t len;
+    char* data = (char*)odb_read_object(odb, hex, &type, &len);
+    int ok = data && type == OBJ_COMMIT && strncmp(data, "tree ", 5) == 0;
+    if (ok) {
+        snprintf(tree, size, "%.*s", (int)strcspn(data + 5, "\n"), data + 5);
+    }
+    free(data);
+    return ok;
+}
+
+// The entry at a slash-separated path inside a tree, as "<mode> <id>", or "" when the
+// path is not there.
+static void odb_tree_entry(struct odb* odb, const char* tree, const char* path, char* entry,
+                           size_t size) {
+    char id[72], mode[8] = "";
+    snprintf(id, sizeof(id), "%s", tree);
+    entry[0] = '\0';
+
+    for (const char* name = path; *name;) {
+        size_t name_len = strcspn(name, "/"), hash_len = strlen(id) / 2;
+        int type, found = 0;
+        size_t tree_size;
+        unsigned char* data = odb_read_object(odb, id, &type, &tree_size);
+        if (!data || type != OBJ_TREE) {
+            free(data);
+            return;
+        }
+
+        // "<mode> <name>\0<raw id>" per entry
+        const unsigned char* end = data + tree_size;
+        for (const unsigned char* p = data; p < end && !found;) {
+            const unsigned char* space = memchr(p, ' ', (size_t)(end - p));
+            const unsigned char* nul = space ? memchr(space, '\0', (size_t)(end - space)) : NULL;
+            if (!nul || (size_t)(end - nul - 1) < hash_len) {
+                break;
+            }
+            if ((size_t)(nul - space - 1) == name_len && memcmp(space + 1, name, name_len) == 0) {
+                snprintf(mode, sizeof(mode), "%.*s", (int)(space - p), (const char*)p);
+                for (size_t i = 0; i < hash_len; i++) {
+                    snprintf(id + 2 * i, 3, "%02x", nul[1 + i]);
+                }
+                found = 1;
+            }
+            p = nul + 1 + hash_len;
+        }
+        free(data);
+        if (!found) {
+            return;
+        }
+        name += name_len;
+        name += *name == '/';
+    }
+    snprintf(entry, size, "%s %s", mode, id);
+}
+
+// Commit-graph: git's cache of each commit's tree, parents and generation number, in
+// objects/info/commit-graph or as a chain of split layers under info/commit-graphs
+// (oldest first). Commits are numbered across the layers, lower layers first, and
+// parents are stored as those numbers. A commit's generation is larger than any of its
+// parents', so visiting commits in decreasing generation order is a topological order
+// and a walk can stop as soon as nothing left in its queue can change the answer.
+#define GRAPH_NO_PARENT 0x70000000
+#define GRAPH_EXTRA_EDGES 0x80000000
+
+struct graph_layer {
+    unsigned char* map;
+    size_t size;
+    const unsigned char *fanout, *oids, *data, *edges, *generations, *overflow;
+    uint32_t nr;    // Commits in this layer
+    uint32_t base;  // Commits in the layers below it
+    size_t nr_edges, nr_overflow;
+    const unsigned char *bloom_index, *bloom_data;  // Changed-path filters, if written
+    size_t bloom_size;
+    uint32_t bloom_version, bloom_hashes;
+};
+
+struct commit_graph {
+    struct graph_layer* layers;
+    size_t nr_layers;
+    size_t hash_len;
+    uint32_t nr;    // Commits in all layers
+    int corrected;  // Generations are corrected commit dates rather than topological levels
+};
+
+static int graph_layer_open(struct graph_layer* layer, const char* path, size_t* hash_len) {
+    size_t generations_size = 0, bloom_index_size = 0;
+    memset(layer, 0, sizeof(*layer));
+    layer->map = map_file(path, &layer->size);
+    if (!layer->map) {
+        return 0;
+    }
+
+    const unsigned char* m = layer->map;
+    size_t chunks = layer->size >= 8 ? m[6] : 0;
+    size_t len = layer->size >= 8 && m[5] == 2 ? 32 : 20;
+    if (layer->size < 8 + (chunks + 1) * 12 || memcmp(m, "CGPH", 4) != 0 || m[4] != 1 ||
+        (m[5] != 1 && m[5] != 2) || (*hash_len && *hash_len != len)) {
+        munmap(layer->map, layer->size);
+        layer->map = NULL;
+        return 0;
+    }
+    *hash_len = len;
+
+    for (size_t i = 0; i < chunks; i++) {
+        const unsigned char* entry = m + 8 + i * 12;
+        uint64_t offset = get_be64(entry + 4), next = get_be64(entry + 16);
+        if (offset > layer->size || next > layer->size || next < offset) {
+            break;
+        }
+        if (memcmp(entry, "OIDF", 4) == 0 && next - offset >= 1024) {
+            layer->fanout = m + offset;
+        } else if (memcmp(entry, "OIDL", 4) == 0) {
+            layer->oids = m + offset;
+        } else if (memcmp(entry, "CDAT", 4) == 0) {
+            layer->data = m + offset;
+        } else if (memcmp(entry, "EDGE", 4) == 0) {
+            layer->edges = m + offset;
+            layer->nr_edges = (size_t)(next - offset) / 4;
+        } else if (memcmp(entry, "GDA2", 4) == 0) {
+            layer->generations = m + offset;
+            generations_size = (size_t)(next - offset);
+        } else if (memcmp(entry, "GDO2", 4) == 0) {
+            layer->overflow = m + offset;
+            layer->nr_overflow = (size_t)(next - offset) / 8;
+        } else if (memcmp(entry, "BIDX", 4) == 0) {
+            layer->bloom_index = m + offset;
+            bloom_index_size = (size_t)(next - offset);
+        } else if (memcmp(entry, "BDAT", 4) == 0 && next - offset >= 12) {
+            // Hash version, number of hashes and bits per entry, then the filters
+            layer->bloom_version = get_be32(m + offset);
+            layer->bloom_hashes = get_be32(m + offset + 4);
+            layer->bloom_data = m + offset + 12;
+            layer->bloom_size = (size_t)(next - offset - 12);
+        }
+    }
+
+    layer->nr = layer->fanout ? get_be32(layer->fanout + 255 * 4) : 0;
+    if (!layer->fanout || !layer->oids || !layer->data ||
+        (size_t)(layer->oids - m) + (size_t)layer->nr * len > layer->size ||
+        (size_t)(layer->data - m) + (size_t)layer->nr * (len + 16) > layer->size) {
+        munmap(layer->map, layer->size);
+        layer->map = NULL;
+        return 0;
+    }
+    if (generations_size < (size_t)layer->nr * 4) {
+        layer->generations = NULL;
+    }
+    if (bloom_index_size < (size_t)layer->nr * 4 || !layer->bloom_data ||
+        (layer->bloom_version != 1 && layer->bloom_version != 2) || !layer->bloom_hashes ||
+        layer->bloom_hashes > 64) {
+        layer->bloom_index = NULL;
+    }
+    return 1;
+}
+
+static void graph_close(struct commit_graph* graph) {
+    for (size_t i = 0; i < graph->nr_layers; i++) {
+        munmap(graph->layers[i].map, graph->layers[i].size);
+    }
+    free(graph->layers);
+    memset(graph, 0, sizeof(*graph));
+}
+
+// Map the repository's commit-graph. A chain whose upper layers are missing or damaged
+// still serves the layers below them, which do not depend on the ones above.
+static int graph_open(struct commit_graph* graph, const char* repo) {
+    memset(graph, 0, sizeof(*graph));
+    char* objects = repo_objects_dir(repo);
+    char* info = safe_path_join(objects, "info");
+    char* dir = safe_path_join(info, "commit-graphs");
+    char* chain_path = safe_path_join(dir, "commit-graph-chain");
+    char** paths = NULL;
+    size_t nr_paths = 0;
+    struct stat st;
+
+    // Git prefers a single file over a chain when both are there
+    char* chain = NULL;
+    char* single = safe_path_join(info, "commit-graph");
+    if (stat(single, &st) != 0) {
+        chain = read_file_contents(chain_path);
+        free(single);
+        single = NULL;
+    }
+    for (char* line = chain ? strtok(chain, "\n") : NULL; single || line;
+         line = strtok(NULL, "\n")) {
+        paths = realloc(paths, (nr_paths + 1) * sizeof(*paths));
+        if (!paths) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        if (single) {
+            paths[nr_paths++] = single;
+            break;
+        }
+        char name[DEFAULT_BUFFER_SIZE];
+        snprintf(name, sizeof(name), "graph-%.64s.graph", line);
+        paths[nr_paths++] = safe_path_join(dir, name);
+    }
+
+    graph->layers = calloc(nr_paths + 1, sizeof(*graph->layers));
+    if (!graph->layers) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < nr_paths; i++) {
+        struct graph_layer* layer = &graph->layers[graph->nr_layers];
+        if (graph->nr_layers == i && graph_layer_open(layer, paths[i], &graph->hash_len)) {
+            if ((uint64_t)graph->nr + layer->nr >= GRAPH_NO_PARENT) {
+                munmap(layer->map, layer->size);
+            } else {
+                layer->base = graph->nr;
+                graph->nr += layer->nr;
+                graph->nr_layers++;
+            }
+        }
+        free(paths[i]);
+    }
+
+    // Corrected dates only count when every layer has them
+    graph->corrected = graph->nr_layers > 0;
+    for (size_t i = 0; i < graph->nr_layers; i++) {
+        graph->corrected &= graph->layers[i].generations != NULL;
+    }
+
+    free(paths);
+    free(chain);
+    free(chain_path);
+    free(dir);
+    free(info);
+    free(objects);
+    if (!graph->nr_layers) {
+        graph_close(graph);
+        return 0;
+    }
+    return 1;
+}
+
+// Position of a commit in the graph, or -1 when the graph does not have it.
+static long graph_find(const struct commit_graph* graph, const unsigned char* oid) {
+    for (size_t i = 0; i < graph->nr_layers; i++) {
+        const struct graph_layer* layer = &graph->layers[i];
+        uint32_t lo = oid[0] ? get_be32(layer->fanout + 4 * (oid[0] - 1)) : 0;
+        uint32_t hi = get_be32(layer->fanout + 4 * oid[0]);
+        hi = hi < layer->nr ? hi : layer->nr;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int c = memcmp(layer->oids + (size_t)mid * graph->hash_len, oid, graph->hash_len);
+            if (c == 0) {
+                return (long)layer->base + mid;
+            }
+            if (c < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+    }
+    return -1;
+}
+
+// The CDAT entry for a position: tree id, two parent words, generation and commit date.
+static const unsigned char* graph_commit(const struct commit_graph* graph, uint32_t pos,
+                                         const struct graph_layer** layer) {
+    size_t i = graph->nr_layers;
+    while (i > 1 && pos < graph->layers[i - 1].base) {
+        i--;
+    }
+    *layer = &graph->layers[i - 1];
+    return (*layer)->data + (size_t)(pos - (*layer)->base) * (graph->hash_len + 16);
+}
+
+static void graph_tree_hex(const struct commit_graph* graph, uint32_t pos, char* hex) {
+    const struct graph_layer* layer;
+    const unsigned char* tree = graph_commit(graph, pos, &layer);
+    for (size_t i = 0; i < graph->hash_len; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", tree[i]);
+    }
+}
+
+static int graph_add_parent(const struct commit_graph* graph, uint32_t parent,
+                            uint32_t** parents, size_t* n, size_t* cap) {
+    if (parent >= graph->nr) {
+        return 0;
+    }
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 8;
+        *parents = realloc(*parents, *cap * sizeof(**parents));
+        if (!*parents) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*parents)[(*n)++] = parent;
+    return 1;
+}
+
+// Store the parents' positions in *parents, growing it as needed. Returns how many
+// there are, or -1 when the graph is damaged.
+static int graph_parents(const struct commit_graph* graph, uint32_t pos, uint32_t** parents,
+                         size_t* cap) {
+    const struct graph_layer* layer;
+    const unsigned char* entry = graph_commit(graph, pos, &layer) + graph->hash_len;
+    uint32_t first = get_be32(entry), second = get_be32(entry + 4);
+    size_t n = 0;
+
+    if (first == GRAPH_NO_PARENT) {
+        return 0;
+    }
+    if (!graph_add_parent(graph, first, parents, &n, cap)) {
+        return -1;
+    }
+    if (second == GRAPH_NO_PARENT) {
+        return 1;
+    }
+    if (!(second & GRAPH_EXTRA_EDGES)) {
+        return graph_add_parent(graph, second, parents, &n, cap) ? 2 : -1;
+    }
+
+    // Octopus merges list their second and later parents in the EDGE chunk
+    for (size_t e = second & ~GRAPH_EXTRA_EDGES;; e++) {
+        if (e >= layer->nr_edges) {
+            return -1;
+        }
+        uint32_t edge = get_be32(layer->edges + 4 * e);
+        if (!graph_add_parent(graph, edge & ~GRAPH_EXTRA_EDGES, parents, &n, cap)) {
+            return -1;
+        }
+        if (edge & GRAPH_EXTRA_EDGES) {
+            return (int)n;
+        }
+    }
+}
+
+// The corrected commit date when every layer has one, else the topological level.
+static uint64_t graph_generation(const struct commit_graph* graph, uint32_t pos) {
+    const struct graph_layer* layer;
+    const unsigned char* entry = graph_commit(graph, pos, &layer) + graph->hash_len + 8;
+    if (!graph->corrected) {
+        return get_be32(entry) >> 2;
+    }
+
+    uint64_t date = (uint64_t)(get_be32(entry) & 3) << 32 | get_be32(entry + 4);
+    uint32_t offset = get_be32(layer->generations + 4 * (size_t)(pos - layer->base));
+    if (offset & 0x80000000) {
+        size_t k = offset & 0x7fffffff;
+        return k < layer->nr_overflow ? date + get_be64(layer->overflow + 8 * k) : UINT64_MAX;
+    }
+    return date + offset;
+}
+
+// Refs, read directly: loose files and packed-refs, or the reftable stack of repositories
+// created with --ref-format=reftable. Only plain ref names are looked up here; anything
+// using git's revision syntax is left to git.
+//
+// A reftable is a sorted run of ref blocks, optionally indexed by the last name in each
+// block, with a footer saying where the index is. Inside a block, names are prefix
+// compressed and every few records there is a restart point holding a full name, so a
+// lookup binary searches the restarts and decodes at most one run of records. A stack
+// of tables (reftable/tables.list, oldest first) is searched newest first; the first
+// table holding a name decides, and a deletion record there means the ref is gone.
+#define REFTABLE_NAME_MAX 1024
+
+struct reftable {
+    unsigned char* map;
+    size_t size;
+    size_t header_len;  // 24 for version 1, 28 for version 2
+    size_t hash_len;
+    uint32_t block_size;  // 0 when blocks are not aligned
+    uint64_t ref_index;   // Offset of the top-level ref index block, or 0
+    size_t end;           // Start of the footer
+};
+
+struct reftable_stack {
+    struct reftable* tables;
+    size_t count;
+};
+
+struct refdb {
+    char* gitdir;     // HEAD and the other per-worktree refs
+    char* commondir;  // Everything else
+    int reftable;
+    struct reftable_stack common_stack, worktree_stack;
+    unsigned char* packed;  // packed-refs
+    size_t packed_size;
+};
+
+// A ref as stored: an object id, or the name of the ref it points at
+struct ref_value {
+    int symbolic;
+    char target[REFTABLE_NAME_MAX];
+};
+
+static uint32_t get_be24(const unsigned char* p) {
+    return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+// Git's variable-length integers, the same as in ofs-delta offsets
+static int reftable_varint(const unsigned char** p, const unsigned char* end, uint64_t* value) {
+    if (*p >= end) {
+        return 0;
+    }
+    uint64_t v = **p & 0x7f;
+    while (*(*p)++ & 0x80) {
+        if (*p >= end || v > (UINT64_MAX >> 8)) {
+            return 0;
+        }
+        v = ((v + 1) << 7) | (**p & 0x7f);
+    }
+    *value = v;
+    return 1;
+}
+
+static int reftable_open(struct reftable* t, const char* path) {
+    memset(t, 0, sizeof(*t));
+    if (!(t->map = map_file(path, &t->size))) {
+        return 0;
+    }
+
+    int version = t->size >= 24 ? t->map[4] : 0;
+    t->header_len = version == 2 ? 28 : 24;
+    t->hash_len = version == 2 && get_be32(t->map + 24) == 0x73323536 ? 32 : 20;  // "s256"
+    size_t footer_len = t->header_len + 44;
+    if (memcmp(t->map, "REFT", 4) != 0 || (version != 1 && version != 2) ||
+        t->size < t->header_len + footer_len) {
+        munmap(t->map, t->size);
+        t->map = NULL;
+        return 0;
+    }
+    t->block_size = get_be24(t->map + 5);
+    t->end = t->size - footer_len;
+    t->ref_index = get_be64(t->map + t->end + t->header_len);
+    return 1;
+}
+
+struct reftable_block {
+    const unsigned char* base;     // Start of the block; the file header in the first one
+    const unsigned char* records;  // First record
+    const unsigned char* restarts; // 3-byte offsets from base, restart_count of them
+    const unsigned char* end;      // End of the records
+    unsigned restart_count;
+    int type;
+    size_t full_len;  // Distance to the next block
+};
+
+static int reftable_block_at(const struct reftable* t, uint64_t off, struct reftable_block* b) {
+    size_t header = off == 0 ? t->header_len : 0;
+    if (off + header + 4 > t->end) {
+        return 0;
+    }
+    const unsigned char* base = t->map + off;
+    size_t len = get_be24(base + header + 1);
+    if (len < header + 6 || off + len > t->end) {
+        return 0;
+    }
+
+    b->base = base;
+    b->type = base[header];
+    b->records = base + header + 4;
+    b->restart_count = (unsigned)base[len - 2] << 8 | base[len - 1];
+    if (header + 4 + 3 * (size_t)b->restart_count + 2 > len) {
+        return 0;
+    }
+    b->restarts = base + len - 2 - 3 * (size_t)b->restart_count;
+    b->end = b->restarts;
+
+    // Padded to the block size, unless the next block follows right away
+    b->full_len = t->block_size && len < t->block_size ? t->block_size : len;
+    if (off + b->full_len > t->end || (off + len < t->end && base[len] != 0)) {
+        b->full_len = len;
+    }
+    return 1;
+}
+
+// Decode the record at *p into name, which holds the previous name for the shared prefix.
+// Index records yield the block position in *position, ref records their value.
+static int reftable_record(const struct reftable* t, const struct reftable_block* b,
+                           const unsigned char** p, char* name, size_t* name_len,
+                           uint64_t* position, int* value_type, const unsigned char** value,
+                           size_t* value_len) {
+    uint64_t prefix, suffix, update;
+    if (!reftable_varint(p, b->end, &prefix) || !reftable_varint(p, b->end, &suffix) ||
+        prefix > *name_len) {
+        return 0;
+    }
+    *value_type = (int)(suffix & 7);
+    suffix >>= 3;
+    if (prefix + suffix >= REFTABLE_NAME_MAX || suffix > (size_t)(b->end - *p)) {
+        return 0;
+    }
+    memcpy(name + prefix, *p, suffix);
+    *name_len = prefix + suffix;
+    name[*name_len] = '\0';
+    *p += suffix;
+
+    if (b->type == 'i') {
+        return reftable_varint(p, b->end, position);
+    }
+    if (!reftable_varint(p, b->end, &update)) {
+        return 0;
+    }
+
+    *value = *p;
+    if (*value_type == 1 || *value_type == 2) {
+        *value_len = t->hash_len;
+        *p += t->hash_len * (size_t)*value_type;
+    } else if (*value_type == 3) {
+        uint64_t len;
+        if (!reftable_varint(p, b->end, &len) || len >= REFTABLE_NAME_MAX) {
+            return 0;
+        }
+        *value = *p;
+        *value_len = len;
+        *p += len;
+    } else {
+        *value_len = 0;
+    }
+    return *p <= b->end;
+}
+
+// Find the first record whose name is not below name: binary search over the restart
+// points, then a linear decode. Returns 1 with the record filled in, 0 when every name in
+// the block is smaller, -1 on a malformed block.
+static int reftable_block_seek(const struct reftable* t, const struct reftable_block* b,
+                               const char* name, char* found, uint64_t* position,
+                               int* value_type, const unsigned char** value,
+                               size_t* value_len) {
+    size_t lo = 0, hi = b->restart_count;
+    const unsigned char* start = b->records;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const unsigned char* p = b->base + get_be24(b->restarts + 3 * mid);
+        size_t len = 0;
+        uint64_t pos;
+        int type;
+        const unsigned char* v;
+        size_t vlen;
+        if (p < b->records || p >= b->end ||
+            !reftable_record(t, b, &p, found, &len, &pos, &type, &v, &vlen)) {
+            return -1;
+        }
+        if (strcmp(found, name) <= 0) {
+            start = b->base + get_be24(b->restarts + 3 * mid);
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    size_t len = 0;
+    for (const unsigned char* p = start; p < b->end;) {
+        if (!reftable_record(t, b, &p, found, &len, position, value_type, value, value_len)) {
+            return -1;
+        }
+        if (strcmp(found, name) >= 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Look name up in one table. 1 with the value, 0 when the table does not have it,
+// 2 when it records the ref's deletion, -1 when the table is malformed.
+static int reftable_find(const struct reftable* t, const char* name, struct ref_value* ref) {
+    struct reftable_block b;
+    char found[REFTABLE_NAME_MAX];
+    uint64_t position = 0, off = t->ref_index;
+    int type = 0;
+    const unsigned char* value = NULL;
+    size_t value_len = 0;
+
+    if (off) {
+        // Index records are keyed by the last name in the block they point at
+        for (int depth = 0;; depth++) {
+            if (depth > 8 || !reftable_block_at(t, off, &b)) {
+                return -1;
+            }
+            if (b.type != 'i') {
+                break;
+            }
+            int r = reftable_block_seek(t, &b, name, found, &position, &type, &value,
+                                        &value_len);
+            if (r <= 0) {
+                return r;
+            }
+            off = position;
+        }
+    } else {
+        // No index: move on while the next ref block starts at or before name
+        if (!reftable_block_at(t, 0, &b)) {
+            return t->end <= t->header_len ? 0 : -1;
+        }
+        while (b.type == 'r') {
+            struct reftable_block next;
+            const unsigned char* p;
+            size_t len = 0;
+            if (!reftable_block_at(t, off + b.full_len, &next) || next.type != 'r') {
+                break;
+            }
+            p = next.records;
+            if (!reftable_record(t, &next, &p, found, &len, &position, &type, &value,
+                                 &value_len) ||
+                strcmp(found, name) > 0) {
+                break;
+            }
+            off += b.full_len;
+            b = next;
+        }
+    }
+
+    if (!reftable_block_at(t, off, &b)) {
+        return -1;
+    } else if (b.type != 'r') {
+        return 0;
+    }
+    int r = reftable_block_seek(t, &b, name, found, &position, &type, &value, &value_len);
+    if (r <= 0 || strcmp(found, name) != 0) {
+        return r < 0 ? -1 : 0;
+    }
+
+    if (type == 0) {
+        return 2;
+    } else if (type == 3) {
+        ref->symbolic = 1;
+        snprintf(ref->target, sizeof(ref->target), "%.*s", (int)value_len, value);
+    } else if (type == 1 || type == 2) {
+        ref->symbolic = 0;
+        for (size_t i = 0; i < value_len; i++) {
+            sprintf(ref->target + 2 * i, "%02x", value[i]);
+        }
+    } else {
+        return -1;
+    }
+    return 1;
+}
+
+static void reftable_stack_open(struct reftable_stack* stack, const char* gitdir) {
+    char path[MAX_PATH_LENGTH];
+    memset(stack, 0, sizeof(*stack));
+    if (snprintf(path, sizeof(path), "%s/reftable/tables.list", gitdir) >= (int)sizeof(path)) {
+        return;
+    }
+    char* list = read_file_contents(path);
+    if (!list) {
+        return;
+    }
+
+    char* save = NULL;
+    for (char* name = strtok_r(list, "\n", &save); name; name = strtok_r(NULL, "\n", &save)) {
+        struct reftable t;
+        if (snprintf(path, sizeof(path), "%s/reftable/%s", gitdir, name) < (int)sizeof(path) &&
+            reftable_open(&t, path)) {
+            stack->tables = realloc(stack->tables, (stack->count + 1) * sizeof(*stack->tables));
+            if (!stack->tables) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            stack->tables[stack->count++] = t;
+        }
+    }
+    free(list);
+}
+
+static void reftable_stack_close(struct reftable_stack* stack) {
+    for (size_t i = 0; i < stack->count; i++) {
+        munmap(stack->tables[i].map, stack->tables[i].size);
+    }
+    free(stack->tables);
+}
+
+void refdb_open(struct refdb* db, const char* repo) {
+    memset(db, 0, sizeof(*db));
+    repo_git_dirs(repo, &db->gitdir, &db->commondir);
+
+    char* list = safe_path_join(db->commondir, "reftable/tables.list");
+    db->reftable = access(list, F_OK) == 0;
+    free(list);
+
+    if (db->reftable) {
+        reftable_stack_open(&db->common_stack, db->commondir);
+        if (strcmp(db->gitdir, db->commondir) != 0) {
+            reftable_stack_open(&db->worktree_stack, db->gitdir);
+        }
+    } else {
+        char* packed = safe_path_join(db->commondir, "packed-refs");
+        db->packed = map_file(packed, &db->packed_size);
+        free(packed);
+    }
+}
+
+void refdb_close(struct refdb* db) {
+    reftable_stack_close(&db->common_stack);
+    reftable_stack_close(&db->worktree_stack);
+    if (db->packed) {
+        munmap(db->packed, db->packed_size);
+    }
+    free(db->gitdir);
+    free(db->commondir);
+}
+
+// HEAD, pseudorefs and a few namespaces are kept per worktree
+static int ref_is_per_worktree(const char* name) {
+    return !strchr(name, '/') || strncmp(name, "refs/bisect/", 12) == 0 ||
+           strncmp(name, "refs/worktree/", 14) == 0 || strncmp(name, "refs/rewritten/", 15) == 0;
+}
+
+// Read one ref without following it. 1 when found, 0 when not, -1 when unreadable.
+static int refdb_read(const struct refdb* db, const char* name, struct ref_value* ref) {
+    int per_worktree = ref_is_per_worktree(name);
+
+    if (db->reftable) {
+        const struct reftable_stack* stack =
+            per_worktree && db->worktree_stack.count ? &db->worktree_stack : &db->common_stack;
+        for (size_t i = stack->count; i-- > 0;) {
+            int r = reftable_find(&stack->tables[i], name, ref);
+            if (r != 0) {
+                return r == 2 ? 0 : r;
+            }
+        }
+        return 0;
+    }
+
+    // A loose file wins over packed-refs
+    char path[MAX_PATH_LENGTH];
+    char line[REFTABLE_NAME_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", per_worktree ? db->gitdir : db->commondir, name);
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (!read_line_file(path, line, sizeof(line))) {
+            return -1;
+        }
+        ref->symbolic = strncmp(line, "ref: ", 5) == 0;
+        snprintf(ref->target, sizeof(ref->target), "%s", ref->symbolic ? line + 5 : line);
+        return 1;
+    }
+    if (per_worktree || !db->packed) {
+        return 0;
+    }
+
+    // "<oid> <name>" lines, with "^<oid>" lines after annotated tags
+    size_t name_len = strlen(name);
+    const unsigned char* data = db->packed;
+    const unsigned char* end = data + db->packed_size;
+    for (const unsigned char* p = data; p < end;) {
+        const unsigned char* eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) {
+            eol = end;
+        }
+        const unsigned char* space = memchr(p, ' ', (size_t)(eol - p));
+        if (*p != '#' && *p != '^' && space && (size_t)(eol - space - 1) == name_len &&
+            memcmp(space + 1, name, name_len) == 0 && space - p < (long)sizeof(ref->target)) {
+            ref->symbolic = 0;
+            snprintf(ref->target, sizeof(ref->target), "%.*s", (int)(space - p), p);
+            return 1;
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
+
+// Resolve a ref name the way `git rev-parse` does for plain names: the name itself if
+// it is HEAD-like or a full ref, else refs/, refs/tags/, refs/heads/ and refs/remotes/,
+// following symbolic refs. 1 with the object id, 0 when no such ref exists, -1 when
+// git has to decide (revision syntax, possible abbreviated ids, unreadable refs).
+int refdb_resolve(const struct refdb* db, const char* name, char* oid, size_t size) {
+    static const char* const rules[] = {"%s",           "refs/%s",
+                                        "refs/tags/%s", "refs/heads/%s",
+                                        "refs/remotes/%s", "refs/remotes/%s/HEAD"};
+    if (!name[0] || name[0] == '-' || strpbrk(name, "^~:?*[\\ ") || strstr(name, "@{") ||
+        strcmp(name, "@") == 0) {
+        return -1;
+    }
+
+    int top_level = strncmp(name, "refs/", 5) == 0 ||
+                    strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZ_") == strlen(name);
+    for (size_t i = top_level ? 0 : 1; i < sizeof(rules) / sizeof(rules[0]); i++) {
+        char full[REFTABLE_NAME_MAX];
+        struct ref_value ref;
+        if (snprintf(full, sizeof(full), rules[i], name) >= (int)sizeof(full)) {
+            return -1;
+        }
+
+        int r = refdb_read(db, full, &ref);
+        for (int depth = 0; r == 1 && ref.symbolic && depth < 5; depth++) {
+            snprintf(full, sizeof(full), "%s", ref.target);
+            r = refdb_read(db, full, &ref);
+        }
+        if (r == 0) {
+            continue;
+        }
+        if (r < 0 || ref.symbolic || strlen(ref.target) >= size) {
+            return -1;
+        }
+        snprintf(oid, size, "%s", ref.target);
+        return 1;
+    }
+
+    // Could still be an abbreviated object id
+    return strspn(name, "0123456789abcdef") == strlen(name) && strlen(name) >= 4 ? -1 : 0;
+}
+
+// A name resolved without git: the object id, if the ref exists and so does its object.
+// Returns 0 when git has to resolve it.
+static int resolve_natively(const struct refdb* refs, const struct odb* odb, const char* name,
+                            char* oid, size_t size) {
+    int found = odb_has_object(odb, name);
+    if (found == -1) {
+        found = refdb_resolve(refs, name, oid, size);
+        if (found == 1 && odb_has_object(odb, oid) == 0) {
+            oid[0] = '\0';
+        }
+        return found != -1;
+    }
+    if (found == 1) {
+        snprintf(oid, size, "%.64s", name);  // A full id, as odb_has_object checked
+    }
+    return 1;
+}
+
+// Resolve every session's original branch and HEAD from the refs and object store
+// directly, loose, packed or reftable. Whatever needs git's revision syntax goes to one
+// cat-file process instead of two rev-parse calls per session. Unresolvable names leave
+// the oid empty.
+int verify_session_list(const char* repo, struct session_list* list) {
+    struct odb odb;
+    struct refdb refs;
+    odb_open(&odb, repo);
+    refdb_open(&refs, repo);
+
+    size_t len = 0, cap = 4096, pending = 0;
+    char* input = malloc(cap);
+    char** answers = malloc((2 * list->count + 1) * sizeof(*answers));
+    if (!input || !answers) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < list->count; i++) {
+        struct session_info* info = &list->items[i];
+        if (info->repo != repo) {
+            continue;
+        }
+        while (cap - len < sizeof(info->branch) + sizeof(info->head) + 4) {
+            cap *= 2;
+            input = realloc(input, cap);
+            if (!input) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        // An empty line would be reported as missing, which keeps the answers aligned
+        if (!resolve_natively(&refs, &odb, info->branch, info->branch_oid,
+                              sizeof(info->branch_oid))) {
+            len += (size_t)sprintf(input + len, "%s\n", info->branch);
+            answers[pending++] = info->branch_oid;
+        }
+        if (!resolve_natively(&refs, &odb, info->head, info->head_oid, sizeof(info->head_oid))) {
+            len += (size_t)sprintf(input + len, "%s\n", info->head);
+            answers[pending++] = info->head_oid;
+        }
+    }
+    refdb_close(&refs);
+
+    char* output = NULL;
+    if (pending) {
+        char* quoted = shell_quote(repo);
+        char cmd[MAX_PATH_LENGTH + 64];
+        snprintf(cmd, sizeof(cmd),
+                 "git -C %s cat-file --batch-check='%%(objectname)' 2>/dev/null", quoted);
+        free(quoted);
+
+        if (run_git_filter(cmd, input, len, &output) != 0) {
+            free(output);
+            free(input);
+            free(answers);
+            odb_close(&odb);
+            return 0;
+        }
+    }
+    free(input);
+
+    char* line = output;
+    for (size_t k = 0; k < pending && line; k++) {
+        char* next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+        // Missing objects come back as "<name> missing"
+        if (!strchr(line, ' ') && strlen(line) < sizeof(list->items[0].head_oid)) {
+            strcpy(answers[k], line);
+        }
+        line = next;
+    }
+    free(output);
+    free(answers);
+
+    // Subject, date and parent straight from the object store
+    for (size_t i = 0; i < list->count; i++) {
+        struct session_info* info = &list->items[i];
+        struct commit_summary commit;
+        if (info->repo == repo && info->head_oid[0] &&
+            odb_read_commit(&odb, info->head_oid, &commit)) {
+            snprintf(info->subject, sizeof(info->subject), "%s", commit.subject);
+            snprintf(info->parent, sizeof(info->parent), "%s", commit.parent);
+            info->author_time = commit.author_time;
+        }
+    }
+
+    odb_close(&odb);
+    return 1;
+}
+
+void format_session_time(long t, char* buf, size_t size) {
+    if (!t) {
+        snprintf(buf, size, "unknown");
+        return;
+    }
+
+    time_t tt = (time_t)t;
+    struct tm tm_info;
+    if (!localtime_r(&tt, &tm_info)) {
+        snprintf(buf, size, "invalid");
+        return;
+    }
+    strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm_info);
+}
+
+// Ahead/behind and diffstat of a session against its original branch. Results are
+// cached in .git/kaishaku/.stats keyed by (session tip, base) object ids, so only
+// sessions whose tip or base moved are recomputed, all of them in a few batched git calls.
+struct session_stats {
+    char tip[72], base[72];
+    int ahead, behind;
+    int files, insertions, deletions;
+    int valid;
+};
+
+// Open-addressing map from object id strings to indexes
+struct oid_map {
+    const char** keys;
+    size_t* values;
+    size_t cap;
+    size_t count;  // Entries added with oid_map_add()
+};
+
+static size_t oid_hash(const char* oid) {
+    size_t h = 0;
+    for (int i = 0; i < 16 && oid[i]; i++) {
+        h = h * 16 + (size_t)(oid[i] <= '9' ? oid[i] - '0' : (oid[i] | 0x20) - 'a' + 10);
+    }
+    return h;
+}
+
+static void oid_map_init(struct oid_map* map, size_t expected) {
+    map->cap = 64;
+    map->count = 0;
+    while (map->cap < expected * 2) {
+        map->cap *= 2;
+    }
+    map->keys = calloc(map->cap, sizeof(*map->keys));
+    map->values = calloc(map->cap, sizeof(*map->values));
+    if (!map->keys || !map->values) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void oid_map_free(struct oid_map* map) {
+    free(map->keys);
+    free(map->values);
+}
+
+// Returns the slot for oid; an empty key means it is not in the map yet.
+static size_t oid_map_slot(const struct oid_map* map, const char* oid, size_t oid_len) {
+    size_t i = oid_hash(oid) & (map->cap - 1);
+    while (map->keys[i] &&
+           (strncmp(map->keys[i], oid, oid_len) != 0 || map->keys[i][oid_len] > ' ')) {
+        i = (i + 1) & (map->cap - 1);
+    }
+    return i;
+}
+
+// Add a key (which must outlive the map) that is not in it yet, doubling the map
+// whenever it gets half full.
+static void oid_map_add(struct oid_map* map, const char* oid, size_t value) {
+    if ((map->count + 1) * 2 > map->cap) {
+        struct oid_map bigger;
+        oid_map_init(&bigger, map->cap);
+        for (size_t i = 0; i < map->cap; i++) {
+            if (map->keys[i]) {
+                size_t slot = oid_map_slot(&bigger, map->keys[i], strcspn(map->keys[i], " "));
+                bigger.keys[slot] = map->keys[i];
+                bigger.values[slot] = map->values[i];
+            }
+        }
+        bigger.count = map->count;
+        oid_map_free(map);
+        *map = bigger;
+    }
+    size_t slot = oid_map_slot(map, oid, strcspn(oid, " "));
+    map->keys[slot] = oid;
+    map->values[slot] = value;
+    map->count++;
+}
+
+static const char* stats_cache_path(void) {
+    static char* path = NULL;
+    if (!path) {
+        path = safe_path_join(kaishaku_dir, ".stats");
+    }
+    return path;
+}
+
+static void load_stats_cache(struct session_stats** cache, size_t* count) {
+    *cache = NULL;
+    *count = 0;
+
+    char* data = read_file_contents(stats_cache_path());
+    if (!data) {
+        return;
+    }
+
+    size_t cap = 0;
+    for (char* line = strtok(data, "\n"); line; line = strtok(NULL, "\n")) {
+        struct session_stats entry = {.valid = 1};
+        if (sscanf(line, "%71s %71s %d %d %d %d %d", entry.tip, entry.base, &entry.ahead,
+                   &entry.behind, &entry.files, &entry.insertions, &entry.deletions) != 7) {
+            continue;
+        }
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 32;
+            *cache = realloc(*cache, cap * sizeof(**cache));
+            if (!*cache) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        (*cache)[(*count)++] = entry;
+    }
+    free(data);
+}
+
+static void save_stats_cache(const struct session_stats* stats, size_t count) {
+    size_t cap = count * 180 + 1;
+    char* data = malloc(cap);
+    if (!data) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t len = 0;
+    data[0] = '\0';
+    for (size_t i = 0; i < count; i++) {
+        if (stats[i].valid) {
+            len += (size_t)snprintf(data + len, cap - len, "%s %s %d %d %d %d %d\n",
+                                    stats[i].tip, stats[i].base, stats[i].ahead,
+                                    stats[i].behind, stats[i].files, stats[i].insertions,
+                                    stats[i].deletions);
+        }
+    }
+    if (len > 0) {
+        data[len - 1] = '\0';  // write_file_replace() adds the final newline
+    }
+
+    // A reader may race another reader here; both write correct data, last one wins
+    write_file_replace(stats_cache_path(), data);
+    free(data);
+}
+
+// MurmurHash3 (x86, 32-bit), as git uses for changed-path filters. Version 1 filters were
+// written by a git that read path bytes as signed chars, which only matters above 0x7f.
+static uint32_t murmur3_byte(const char* data, size_t i, int signed_bytes) {
+    return signed_bytes ? (uint32_t)(int32_t)(signed char)data[i] : (unsigned char)data[i];
+}
+
+static uint32_t rotl32(uint32_t x, int r) {
+    return x << r | x >> (32 - r);
+}
+
+static uint32_t murmur3_32(const char* data, size_t len, uint32_t seed, int signed_bytes) {
+    const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+    uint32_t h = seed;
+
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        uint32_t k = murmur3_byte(data, i, signed_bytes) |
+                     murmur3_byte(data, i + 1, signed_bytes) << 8 |
+                     murmur3_byte(data, i + 2, signed_bytes) << 16 |
+                     murmur3_byte(data, i + 3, signed_bytes) << 24;
+        h ^= rotl32(k * c1, 15) * c2;
+        h = rotl32(h, 13) * 5 + 0xe6546b64;
+    }
+
+    uint32_t k = 0;
+    switch (len & 3) {
+    case 3:
+        k ^= murmur3_byte(data, i + 2, signed_bytes) << 16;
+        // fallthrough
+    case 2:
+        k ^= murmur3_byte(data, i + 1, signed_bytes) << 8;
+        // fallthrough
+    case 1:
+        k ^= murmur3_byte(data, i, signed_bytes);
+        h ^= rotl32(k * c1, 15) * c2;
+    }
+
+    h ^= (uint32_t)len;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+// Whether a commit's changed-path filter may hold path or any directory above it (each
+// one is added along with a changed path). Returns -1 when the commit has no filter.
+// Filters compare a commit with its first parent only.
+static int graph_bloom_maybe(const struct commit_graph* graph, uint32_t pos, const char* path) {
+    const struct graph_layer* layer;
+    graph_commit(graph, pos, &layer);
+    if (!layer->bloom_index) {
+        return -1;
+    }
+    size_t i = pos - layer->base;
+    uint32_t start = i ? get_be32(layer->bloom_index + 4 * (i - 1)) : 0;
+    uint32_t end = get_be32(layer->bloom_index + 4 * i);
+    if (end <= start || end > layer->bloom_size) {
+        return -1;  // Not computed, or too many changes to keep a filter for
+    }
+    const unsigned char* filter = layer->bloom_data + start;
+    uint64_t bits = (uint64_t)(end - start) * 8;
+
+    // The path itself, then each directory above it
+    for (size_t len = strlen(path); len > 0;) {
+        uint32_t h0 = murmur3_32(path, len, 0x293ae76f, layer->bloom_version == 1);
+        uint32_t h1 = murmur3_32(path, len, 0x7e646e2c, layer->bloom_version == 1);
+        for (uint32_t k = 0; k < layer->bloom_hashes; k++) {
+            uint64_t bit = (uint32_t)(h0 + k * h1) % bits;
+            if (!(filter[bit / 8] & (1 << (bit % 8)))) {
+                return 0;
+            }
+        }
+        while (len > 0 && path[len - 1] != '/') {
+            len--;
+        }
+        len -= len > 0;  // The slash
+    }
+    return 1;
+}
+
+// The two trees a pending session's diff runs between, "" when unknown
+struct stats_trees {
+    char from[72], to[72];
+};
+
+// A walk over session history using the commit-graph. Commits the graph does not have
+// yet (everything since it was last written) are read from the object database; they
+// can only be descendants of graph commits, so they are all visited first.
+#define GRAPH_WALK_MAX_LOOSE 4096
+#define PAIR_LOW_BITS 0x5555555555555555ULL
+
+struct walk_commit {
+    long pos;  // Position in the commit-graph, or -1
+    uint64_t generation;
+    char* line;  // Commits outside the graph: "<commit> <tree> <parents...>"
+    int state;   // 0 new, 1 queued, 2 visited
+};
+
+struct graph_walk {
+    struct commit_graph graph;
+    struct odb odb;
+    struct walk_commit* commits;
+    size_t nr, cap;
+    uint64_t* bits;     // Per commit: bit 2k if pending tip k reaches it, 2k + 1 for its base
+    size_t words;       // Bit words per commit
+    uint32_t* by_pos;   // Graph position -> commit index + 1
+    struct oid_map loose;
+    size_t nr_loose;
+    size_t *heap, nr_heap;    // Queued graph commits, by decreasing generation
+    size_t *order, nr_order;  // Visited commits, children before parents
+    size_t active;            // Queued commits that some pending session reaches one side of
+    long* merge_base;         // Per pending session, or -1 while not found
+    size_t pending, missing;
+};
+
+static size_t graph_walk_add(struct graph_walk* walk, long pos, char* line) {
+    if (walk->nr == walk->cap) {
+        walk->cap = walk->cap ? walk->cap * 2 : 256;
+        walk->commits = realloc(walk->commits, walk->cap * sizeof(*walk->commits));
+        walk->bits = realloc(walk->bits, walk->cap * walk->words * sizeof(*walk->bits));
+        walk->heap = realloc(walk->heap, walk->cap * sizeof(*walk->heap));
+        walk->order = realloc(walk->order, walk->cap * sizeof(*walk->order));
+        if (!walk->commits || !walk->bits || !walk->heap || !walk->order) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct walk_commit* commit = &walk->commits[walk->nr];
+    commit->pos = pos;
+    commit->generation = pos >= 0 ? graph_generation(&walk->graph, (uint32_t)pos) : UINT64_MAX;
+    commit->line = line;
+    commit->state = 0;
+    memset(walk->bits + walk->nr * walk->words, 0, walk->words * sizeof(*walk->bits));
+    return walk->nr++;
+}
+
+static size_t graph_walk_at(struct graph_walk* walk, uint32_t pos) {
+    if (!walk->by_pos[pos]) {
+        walk->by_pos[pos] = (uint32_t)graph_walk_add(walk, (long)pos, NULL) + 1;
+    }
+    return walk->by_pos[pos] - 1;
+}
+
+// "<commit> <tree> <parents...>" for a commit object, or NULL when it cannot be read.
+static char* graph_walk_read(struct odb* odb, const char* hex) {
+    int type;
+    size_t size;
+    char* data = (char*)odb_read_object(odb, hex, &type, &size);
+    char* line = data && type == OBJ_COMMIT ? malloc(strlen(hex) + size + 2) : NULL;
+    if (!line) {
+        free(data);
+        return NULL;
+    }
+
+    size_t len = (size_t)sprintf(line, "%s", hex);
+    for (const char* p = data; *p && *p != '\n';) {
+        size_t n = strcspn(p, "\n");
+        if (strncmp(p, "tree ", 5) == 0 || strncmp(p, "parent ", 7) == 0) {
+            const char* value = p + strcspn(p, " ") + 1;
+            len += (size_t)sprintf(line + len, " %.*s", (int)(p + n - value), value);
+        }
+        p += n + (p[n] != '\0');
+    }
+    free(data);
+    return line;
+}
+
+// The walk's index for a commit id, adding the commit if it is new. Returns -1 when the
+// commit cannot be read, or the graph is too far behind to be worth using.
+static long graph_walk_find(struct graph_walk* walk, const char* hex, size_t hex_len) {
+    unsigned char oid[32];
+    char id[72];
+    size_t len;
+    snprintf(id, sizeof(id), "%.*s", (int)hex_len, hex);
+    if (!hex_to_oid(id, oid, &len) || len != walk->graph.hash_len) {
+        return -1;
+    }
+
+    long pos = graph_find(&walk->graph, oid);
+    if (pos >= 0) {
+        return (long)graph_walk_at(walk, (uint32_t)pos);
+    }
+
+    size_t slot = oid_map_slot(&walk->loose, id, strlen(id));
+    if (walk->loose.keys[slot]) {
+        return (long)walk->loose.values[slot];
+    }
+    char* line = walk->nr_loose < GRAPH_WALK_MAX_LOOSE ? graph_walk_read(&walk->odb, id) : NULL;
+    if (!line) {
+        return -1;
+    }
+    walk->nr_loose++;
+    walk->loose.keys[slot] = line;
+    walk->loose.values[slot] = graph_walk_add(walk, -1, line);
+    return (long)walk->loose.values[slot];
+}
+
+// Whether some pending session reaches commit c from its tip or its base, but not both
+static int graph_walk_active(const struct graph_walk* walk, size_t c) {
+    const uint64_t* bits = walk->bits + c * walk->words;
+    for (size_t w = 0; w < walk->words; w++) {
+        if ((bits[w] ^ bits[w] >> 1) & PAIR_LOW_BITS) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Pass child's reachability on to parent
+static void graph_walk_merge(struct graph_walk* walk, size_t parent, size_t child) {
+    int queued = walk->commits[parent].state == 1;
+    walk->active -= queued && graph_walk_active(walk, parent);
+    for (size_t w = 0; w < walk->words; w++) {
+        walk->bits[parent * walk->words + w] |= walk->bits[child * walk->words + w];
+    }
+    walk->active += queued && graph_walk_active(walk, parent);
+}
+
+static void graph_walk_queue(struct graph_walk* walk, size_t c) {
+    const struct walk_commit* commits = walk->commits;
+    size_t i = walk->nr_heap++;
+    while (i > 0 && commits[walk->heap[(i - 1) / 2]].generation < commits[c].generation) {
+        walk->heap[i] = walk->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    walk->heap[i] = c;
+    walk->commits[c].state = 1;
+    walk->active += graph_walk_active(walk, c);
+}
+
+static size_t graph_walk_next(struct graph_walk* walk) {
+    const struct walk_commit* commits = walk->commits;
+    size_t top = walk->heap[0], last = walk->heap[--walk->nr_heap], i = 0;
+    for (size_t child; (child = 2 * i + 1) < walk->nr_heap; i = child) {
+        if (child + 1 < walk->nr_heap &&
+            commits[walk->heap[child + 1]].generation > commits[walk->heap[child]].generation) {
+            child++;
+        }
+        if (commits[walk->heap[child]].generation <= commits[last].generation) {
+            break;
+        }
+        walk->heap[i] = walk->heap[child];
+    }
+    walk->heap[i] = last;
+    walk->active -= graph_walk_active(walk, top);
+    return top;
+}
+
+// Record commit c as visited. The first commit visited that both sides of a session
+// reach is a best merge base for it, since it cannot be an ancestor of a later one.
+static void graph_walk_visit(struct graph_walk* walk, size_t c) {
+    walk->commits[c].state = 2;
+    walk->order[walk->nr_order++] = c;
+    const uint64_t* bits = walk->bits + c * walk->words;
+    for (size_t w = 0; walk->missing && w < walk->words; w++) {
+        uint64_t common = bits[w] & bits[w] >> 1 & PAIR_LOW_BITS;
+        for (size_t b = 0; common && b < 64; b += 2) {
+            size_t pair = (w * 64 + b) / 2;
+            if ((common >> b & 1) && walk->merge_base[pair] < 0) {
+                walk->merge_base[pair] = (long)c;
+                walk->missing--;
+            }
+        }
+    }
+}
+
+static void graph_walk_tree(const struct graph_walk* walk, size_t c, char* hex, size_t size) {
+    const struct walk_commit* commit = &walk->commits[c];
+    if (commit->pos >= 0) {
+        graph_tree_hex(&walk->graph, (uint32_t)commit->pos, hex);
+    } else {
+        const char* tree = commit->line + strcspn(commit->line, " ") + 1;
+        snprintf(hex, size, "%.*s", (int)strcspn(tree, " "), tree);
+    }
+}
+
+// The parents of a commit outside the graph, each after a space; "" for graph commits
+static const char* graph_walk_parents(const struct graph_walk* walk, size_t c) {
+    const char* p = walk->commits[c].line;
+    if (!p) {
+        return "";
+    }
+    p += strcspn(p, " ");                   // Skip the commit
+    p += *p ? 1 + strcspn(p + 1, " ") : 0;  // and its tree
+    return p;
+}
+
+// Visit everything outside the graph, children first, then graph commits by decreasing
+// generation until no queued commit can change an answer: every session reaches each
+// of them from both sides or neither, and every session has its merge base.
+static int graph_walk_run(struct graph_walk* walk) {
+    // Resolve the parents of every commit outside the graph; the ones found are appended
+    // and resolved in turn
+    for (size_t c = 0; c < walk->nr; c++) {
+        for (const char* q = graph_walk_parents(walk, c); *q == ' '; q += strcspn(q, " ")) {
+            q++;
+            if (graph_walk_find(walk, q, strcspn(q, " ")) < 0) {
+                return 0;
+            }
+        }
+    }
+
+    // Their children outside the graph come first (Kahn's algorithm)
+    size_t* in_degree = calloc(walk->nr + 1, sizeof(*in_degree));
+    size_t* ready = calloc(walk->nr + 1, sizeof(*ready));
+    size_t nr_ready = 0;
+    if (!in_degree || !ready) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t c = 0; c < walk->nr; c++) {
+        for (const char* q = graph_walk_parents(walk, c); *q == ' '; q += strcspn(q, " ")) {
+            q++;
+            in_degree[graph_walk_find(walk, q, strcspn(q, " "))]++;
+        }
+    }
+    for (size_t c = 0; c < walk->nr; c++) {
+        if (walk->commits[c].line && in_degree[c] == 0) {
+            ready[nr_ready++] = c;
+        }
+    }
+    while (nr_ready) {
+        size_t c = ready[--nr_ready];
+        graph_walk_visit(walk, c);
+        for (const char* q = graph_walk_parents(walk, c); *q == ' '; q += strcspn(q, " ")) {
+            q++;
+            size_t parent = (size_t)graph_walk_find(walk, q, strcspn(q, " "));
+            graph_walk_merge(walk, parent, c);
+            if (walk->commits[parent].line && --in_degree[parent] == 0) {
+                ready[nr_ready++] = parent;
+            }
+        }
+    }
+    free(ready);
+    free(in_degree);
+
+    for (size_t c = 0; c < walk->nr; c++) {
+        if (walk->commits[c].pos >= 0) {
+            graph_walk_queue(walk, c);
+        }
+    }
+
+    uint32_t* parents = NULL;
+    size_t parents_cap = 0;
+    int ok = 1;
+    while (ok && walk->nr_heap && (walk->active || walk->missing)) {
+        size_t c = graph_walk_next(walk);
+        graph_walk_visit(walk, c);
+        int n = graph_parents(&walk->graph, (uint32_t)walk->commits[c].pos, &parents,
+                              &parents_cap);
+        ok = n >= 0;
+        for (int k = 0; ok && k < n; k++) {
+            size_t parent = graph_walk_at(walk, parents[k]);
+            // A parent at or above its child's generation means the graph is damaged
+            ok = walk->commits[parent].generation < walk->commits[c].generation;
+            if (ok) {
+                graph_walk_merge(walk, parent, c);
+                if (walk->commits[parent].state == 0) {
+                    graph_walk_queue(walk, parent);
+                }
+            }
+        }
+    }
+    free(parents);
+    return ok;
+}
+
+// Start a walk for the given number of tip/base pairs. Returns 0 when the repository has
+// no usable commit-graph.
+static int graph_walk_open(struct graph_walk* walk, size_t pending) {
+    memset(walk, 0, sizeof(*walk));
+    char *gitdir, *commondir;
+    repo_git_dirs(root, &gitdir, &commondir);
+    char* shallow = safe_path_join(commondir, "shallow");
+    struct stat st;
+    // Grafts change history, so shallow clones are left to git
+    int usable = stat(shallow, &st) != 0 && graph_open(&walk->graph, root);
+    free(shallow);
+    free(gitdir);
+    free(commondir);
+    if (!usable) {
+        return 0;
+    }
+
+    odb_open(&walk->odb, root);
+    walk->words = (pending * 2 + 63) / 64;
+    walk->pending = walk->missing = pending;
+    walk->by_pos = calloc((size_t)walk->graph.nr + 1, sizeof(*walk->by_pos));
+    walk->merge_base = malloc((pending + 1) * sizeof(*walk->merge_base));
+    if (!walk->by_pos || !walk->merge_base) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t p = 0; p < pending; p++) {
+        walk->merge_base[p] = -1;
+    }
+    oid_map_init(&walk->loose, GRAPH_WALK_MAX_LOOSE);
+    return 1;
+}
+
+// Mark a commit as reached from side bit (2k for tip k, 2k + 1 for its base). Returns
+// its index, or -1 when the walk cannot use it.
+static long graph_walk_mark(struct graph_walk* walk, const char* hex, size_t bit) {
+    long c = graph_walk_find(walk, hex, strlen(hex));
+    if (c >= 0) {
+        walk->bits[(size_t)c * walk->words + bit / 64] |= 1ULL << (bit % 64);
+    }
+    return c;
+}
+
+static void graph_walk_close(struct graph_walk* walk) {
+    for (size_t c = 0; c < walk->nr; c++) {
+        free(walk->commits[c].line);
+    }
+    oid_map_free(&walk->loose);
+    free(walk->merge_base);
+    free(walk->order);
+    free(walk->heap);
+    free(walk->by_pos);
+    free(walk->bits);
+    free(walk->commits);
+    odb_close(&walk->odb);
+    graph_close(&walk->graph);
+}
+
+// Fill in ahead/behind and the diff trees of pending sessions from the commit-graph.
+// Returns 0, leaving them alone, when there is no usable graph.
+static int graph_session_stats(struct session_stats* stats, size_t count, size_t pending,
+                               struct stats_trees* trees) {
+    struct graph_walk walk;
+    if (!graph_walk_open(&walk, pending)) {
+        return 0;
+    }
+    size_t* owner = malloc(pending * sizeof(*owner));
+    size_t* ends = malloc(pending * 2 * sizeof(*ends));  // Each session's tip and base
+    if (!owner || !ends) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    int ok = 1;
+    size_t p = 0;
+    for (size_t i = 0; ok && i < count; i++) {
+        if (stats[i].valid) {
+            continue;
+        }
+        for (size_t k = 0; ok && k < 2; k++) {
+            long c = graph_walk_mark(&walk, k == 0 ? stats[i].tip : stats[i].base, 2 * p + k);
+            ok = c >= 0;
+            ends[2 * p + k] = (size_t)c;
+        }
+        owner[p++] = i;
+    }
+
+    if (ok && graph_walk_run(&walk)) {
+        for (size_t v = 0; v < walk.nr_order; v++) {
+            const uint64_t* bits = walk.bits + walk.order[v] * walk.words;
+            for (size_t w = 0; w < walk.words; w++) {
+                uint64_t tip_only = bits[w] & ~(bits[w] >> 1) & PAIR_LOW_BITS;
+                uint64_t base_only = bits[w] >> 1 & ~bits[w] & PAIR_LOW_BITS;
+                for (size_t b = 0; b < 64 && (tip_only | base_only) >> b; b += 2) {
+                    if ((tip_only | base_only) >> b & 1) {
+                        struct session_stats* entry = &stats[owner[(w * 64 + b) / 2]];
+                        entry->ahead += (int)(tip_only >> b & 1);
+                        entry->behind += (int)(base_only >> b & 1);
+                    }
+                }
+            }
+        }
+        for (p = 0; p < pending; p++) {
+            long from = walk.merge_base[p] >= 0 ? walk.merge_base[p] : (long)ends[2 * p + 1];
+            graph_walk_tree(&walk, (size_t)from, trees[p].from, sizeof(trees[p].from));
+            graph_walk_tree(&walk, ends[2 * p], trees[p].to, sizeof(trees[p].to));
+            stats[owner[p]].valid = 1;
+        }
+    } else {
+        ok = 0;
+    }
+
+    free(ends);
+    free(owner);
+    graph_walk_close(&walk);
+    return ok;
+}
+
+// Fill in ahead/behind and the diff trees of pending sessions with git. One rev-list walk
+// over the part of history the sessions do not all share answers all of them. Returns 0
+// when git fails.
+static int revlist_session_stats(struct session_stats* stats, size_t count, size_t pending,
+                                 struct stats_trees* trees) {
+    char* refs = NULL;
+    size_t refs_len = 0, refs_cap = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!stats[i].valid) {
+            append_line(&refs, &refs_len, &refs_cap, stats[i].tip);
+            append_line(&refs, &refs_len, &refs_cap, stats[i].base);
+        }
+    }
+
+    // Everything reachable from a common ancestor of all of them counts for neither side,
+    // so the walk can stop there (the ancestor itself is kept to serve as a merge base).
+    char stop[DEFAULT_BUFFER_SIZE] = "";
+    if (refs_len < 64 * 1024) {
+        char* cmd = malloc(refs_len + 64);
+        if (!cmd) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        sprintf(cmd, "git merge-base --octopus %s 2>/dev/null", refs);
+        for (char* p = cmd; *p; p++) {
+            if (*p == '\n') {
+                *p = ' ';
+            }
+        }
+        if (execute_git_command(cmd, stop, sizeof(stop))) {
+            char negated[DEFAULT_BUFFER_SIZE + 8];
+            snprintf(negated, sizeof(negated), "^%s^@", stop);
+            append_line(&refs, &refs_len, &refs_cap, negated);
+        }
+        free(cmd);
+    }
+
+    char* walk;
+    if (run_git_filter("git rev-list --topo-order --format='%H %T %P' --stdin", refs, refs_len,
+                       &walk) != 0) {
+        fprintf(stderr, "Warning: %s\n", error_message);
+        free(walk);
+        free(refs);
+        return 0;
+    }
+
+    // One line per commit: "<commit> <tree> <parents...>", children before parents
+    size_t commit_count = 0;
+    char** lines = NULL;
+    for (char* line = strtok(walk, "\n"); line; line = strtok(NULL, "\n")) {
+        if (strncmp(line, "commit ", 7) == 0) {
+            continue;
+        }
+        lines = realloc(lines, (commit_count + 1) * sizeof(*lines));
+        if (!lines) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        lines[commit_count++] = line;
+    }
+
+    struct oid_map commits;
+    oid_map_init(&commits, commit_count);
+    for (size_t i = 0; i < commit_count; i++) {
+        size_t slot = oid_map_slot(&commits, lines[i], strcspn(lines[i], " "));
+        commits.keys[slot] = lines[i];
+        commits.values[slot] = i;
+    }
+
+    // One reachability bit per tip/base, propagated from children to parents
+    size_t words = (pending * 2 + 63) / 64;
+    uint64_t* bits = calloc(commit_count * words + 1, sizeof(uint64_t));
+    if (!bits) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t bit = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (stats[i].valid) {
+            continue;
+        }
+        for (int k = 0; k < 2; k++, bit++) {
+            const char* oid = k == 0 ? stats[i].tip : stats[i].base;
+            size_t slot = oid_map_slot(&commits, oid, strlen(oid));
+            if (commits.keys[slot]) {
+                bits[commits.values[slot] * words + bit / 64] |= 1ULL << (bit % 64);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < commit_count; i++) {
+        const char* p = lines[i] + strcspn(lines[i], " ");  // Skip the commit
+        p += *p ? 1 + strcspn(p + 1, " ") : 0;                // and its tree
+        while (*p == ' ') {
+            p++;
+            size_t len = strcspn(p, " ");
+            size_t slot = oid_map_slot(&commits, p, len);
+            if (commits.keys[slot]) {
+                uint64_t* parent_bits = &bits[commits.values[slot] * words];
+                for (size_t w = 0; w < words; w++) {
+                    parent_bits[w] |= bits[i * words + w];
+                }
+            }
+            p += len;
+        }
+    }
+
+    bit = 0;
+    for (size_t i = 0, p = 0; i < count; i++) {
+        if (stats[i].valid) {
+            continue;
+        }
+
+        size_t tip_bit = bit++, base_bit = bit++;
+        const char* merge_base = NULL;
+        for (size_t c = 0; c < commit_count; c++) {
+            int in_tip = (bits[c * words + tip_bit / 64] >> (tip_bit % 64)) & 1;
+            int in_base = (bits[c * words + base_bit / 64] >> (base_bit % 64)) & 1;
+            stats[i].ahead += in_tip && !in_base;
+            stats[i].behind += in_base && !in_tip;
+            // The first common commit in topological order is a best merge base
+            if (in_tip && in_base && !merge_base) {
+                merge_base = lines[c];
+            }
+        }
+        stats[i].valid = 1;
+
+        // Diff from the merge base's tree (or the base's, for unrelated histories)
+        size_t tip_slot = oid_map_slot(&commits, stats[i].tip, strlen(stats[i].tip));
+        size_t base_slot = oid_map_slot(&commits, stats[i].base, strlen(stats[i].base));
+        const char* from = merge_base ? merge_base : commits.keys[base_slot];
+        const char* to = commits.keys[tip_slot];
+        if (from && to) {
+            from += strcspn(from, " ") + 1;
+            to += strcspn(to, " ") + 1;
+            snprintf(trees[p].from, sizeof(trees[p].from), "%.*s", (int)strcspn(from, " "), from);
+            snprintf(trees[p].to, sizeof(trees[p].to), "%.*s", (int)strcspn(to, " "), to);
+        }
+        p++;
+    }
+
+    free(bits);
+    oid_map_free(&commits);
+    free(lines);
+    free(walk);
+    free(refs);
+    return 1;
+}
+
+// Size the diff of every "<tree> <tree>" line with one diff-tree process, storing pair
+// k's file, insertion and deletion counts in sizes[k]. Returns 0 if git failed.
+static int diff_tree_sizes(const char* pairs, size_t pairs_len, size_t pair_count,
+                           struct session_stats** sizes) {
+    // diff-tree echoes each "<tree> <tree>" pair, followed by a shortstat line when they differ
+    char* diff = NULL;
+    if (run_git_filter("git diff-tree -r --stdin --shortstat", pairs, pairs_len, &diff) != 0) {
+        free(diff);
+        return 0;
+    }
+
+    size_t k = 0;
+    struct session_stats* current = NULL;
+    for (char* line = strtok(diff, "\n"); line; line = strtok(NULL, "\n")) {
+        if (line[0] != ' ') {
+            current = k < pair_count ? sizes[k++] : NULL;
+            continue;
+        }
+        if (!current) {
+            continue;
+        }
+
+        // " 3 files changed, 10 insertions(+), 2 deletions(-)"
+        for (char* part = line; part; part = strchr(part, ',')) {
+            part += *part == ',';
+            int n = atoi(part);
+            const char* word = part + strspn(part, " 0123456789");
+            if (strncmp(word, "file", 4) == 0) {
+                current->files = n;
+            } else if (strncmp(word, "insertion", 9) == 0) {
+                current->insertions = n;
+            } else if (strncmp(word, "deletion", 8) == 0) {
+                current->deletions = n;
+            }
+        }
+    }
+    free(diff);
+    return 1;
+}
+
+// Fill in every stats entry that is not valid yet: ahead/behind and the merge base come
+// from the commit-graph when there is one, else from one rev-list walk; one diff-tree
+// process then sizes every session's diff from its merge base. Returns 0, leaving the
+// entries not valid, when the ancestry could not be worked out.
+static int compute_session_stats(struct session_stats* stats, size_t count) {
+    size_t pending = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (stats[i].valid) {
+            continue;
+        }
+        if (strcmp(stats[i].tip, stats[i].base) == 0) {
+            stats[i].valid = 1;  // Nothing to compare
+            continue;
+        }
+        pending++;
+    }
+    if (!pending) {
+        return 1;
+    }
+
+    // Pair k of the diff-tree input belongs to stats[pair_owner[k]]
+    struct stats_trees* trees = calloc(pending, sizeof(*trees));
+    size_t* pair_owner = calloc(pending, sizeof(*pair_owner));
+    if (!trees || !pair_owner) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t p = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!stats[i].valid) {
+            pair_owner[p++] = i;
+        }
+    }
+    if (!graph_session_stats(stats, count, pending, trees) &&
+        !revlist_session_stats(stats, count, pending, trees)) {
+        free(pair_owner);
+        free(trees);
+        return 0;
+    }
+
+    char* pairs = NULL;
+    size_t pairs_len = 0, pairs_cap = 0, pair_count = 0;
+    for (p = 0; p < pending; p++) {
+        if (trees[p].from[0] && trees[p].to[0]) {
+            char pair[160];
+            snprintf(pair, sizeof(pair), "%s %s", trees[p].from, trees[p].to);
+            append_line(&pairs, &pairs_len, &pairs_cap, pair);
+            pair_owner[pair_count++] = pair_owner[p];
+        }
+    }
+
+    struct session_stats** sizes = calloc(pair_count + 1, sizeof(*sizes));
+    if (!sizes) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t k = 0; k < pair_count; k++) {
+        sizes[k] = &stats[pair_owner[k]];
+    }
+    if (pair_count && !diff_tree_sizes(pairs, pairs_len, pair_count, sizes)) {
+        fprintf(stderr, "Warning: %s\n", error_message);
+    }
+
+    free(sizes);
+    free(pairs);
+    free(pair_owner);
+    free(trees);
+    return 1;
+}
+
+
+// Stats for every session in the list, in the same order. Entries without a tip or
+// base (missing commits or branches) are left with an empty tip, and those that could
+// not be computed are left not valid.
+static struct session_stats* collect_session_stats(const struct session_list* list) {
+    struct session_stats* stats = calloc(list->count + 1, sizeof(*stats));
+    if (!stats) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // The active session's tip is wherever HEAD is now
+    char head[DEFAULT_BUFFER_SIZE] = "";
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->items[i].active) {
+            git->resolve("HEAD", head, sizeof(head));
+        }
+    }
+
+    struct session_stats* cache;
+    size_t cache_count, stale = 0;
+    load_stats_cache(&cache, &cache_count);
+
+    for (size_t i = 0; i < list->count; i++) {
+        const struct session_info* info = &list->items[i];
+        const char* tip = info->active && head[0] ? head : info->head_oid;
+        stats[i].valid = 1;
+        if (!tip[0] || !info->branch_oid[0] || strlen(tip) >= sizeof(stats[i].tip)) {
+            continue;
+        }
+
+        snprintf(stats[i].tip, sizeof(stats[i].tip), "%s", tip);
+        snprintf(stats[i].base, sizeof(stats[i].base), "%s", info->branch_oid);
+        stats[i].valid = 0;
+
+        for (size_t k = 0; k < cache_count; k++) {
+            if (strcmp(cache[k].tip, stats[i].tip) == 0 &&
+                strcmp(cache[k].base, stats[i].base) == 0) {
+                stats[i] = cache[k];
+                break;
+            }
+        }
+        stale += !stats[i].valid;
+    }
+    free(cache);
+
+    if (stale) {
+        if (!compute_session_stats(stats, list->count)) {
+            fprintf(stderr, "%sWarning: Could not compare sessions with their branches: %s%s\n",
+                    COLOR_YELLOW, error_message, COLOR_RESET);
+        }
+
+        // Keep exactly the entries for the current sessions
+        struct session_stats* keep = calloc(list->count + 1, sizeof(*keep));
+        size_t kept = 0;
+        for (size_t i = 0; keep && i < list->count; i++) {
+            if (stats[i].tip[0]) {
+                keep[kept++] = stats[i];
+            }
+        }
+        save_stats_cache(keep, kept);
+        free(keep);
+    }
+
+    return stats;
+}
+
+struct session_key {
+    const char* name;
+    size_t index;  // Into the session list
+};
+
+static int compare_session_keys(const void* a, const void* b) {
+    return strcmp(((const struct session_key*)a)->name, ((const struct session_key*)b)->name);
+}
+
+// Where each session started, from its last checkout in the journal ("" if unknown). Every
+// record is read once and its session found by binary search in the sorted names.
+static void load_session_starts(const struct session_list* list,
+                                char (*starts)[JOURNAL_OID_SIZE]) {
+    int fd = open(JOURNAL_FILE, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || list->count == 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    struct session_key* keys = malloc(list->count * sizeof(*keys));
+    if (!keys) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < list->count; i++) {
+        keys[i] = (struct session_key){list->items[i].name, i};
+    }
+    qsort(keys, list->count, sizeof(*keys), compare_session_keys);
+
+    struct journal_record rec;
+    for (size_t k = 0; k < (size_t)st.st_size / JOURNAL_RECORD_SIZE; k++) {
+        if (!journal_read(fd, k, &rec) || rec.op != JOURNAL_CHECKOUT) {
+            continue;
+        }
+        struct session_key key = {rec.session, 0};
+        const struct session_key* hit =
+            bsearch(&key, keys, list->count, sizeof(*keys), compare_session_keys);
+        if (hit) {
+            memcpy(starts[hit->index], rec.head_after, sizeof(starts[hit->index]));
+        }
+    }
+    free(keys);
+    close(fd);
+}
+
+// Whether walk commit c changes path compared with each of its parents, so a merge that
+// takes the path unchanged from one side does not count. The changed-path filter rules
+// out most commits before any tree is read.
+static int graph_walk_touches(struct graph_walk* walk, size_t c, const char* path,
+                              uint32_t** parents, size_t* cap) {
+    long pos = walk->commits[c].pos;
+    if (pos >= 0 && graph_bloom_maybe(&walk->graph, (uint32_t)pos, path) == 0) {
+        return 0;
+    }
+
+    char tree[72], entry[DEFAULT_BUFFER_SIZE], parent_entry[DEFAULT_BUFFER_SIZE];
+    graph_walk_tree(walk, c, tree, sizeof(tree));
+    odb_tree_entry(&walk->odb, tree, path, entry, sizeof(entry));
+
+    // Parents as walk indexes; they were all resolved by the walk or are in the graph
+    size_t n = 0;
+    if (pos >= 0) {
+        int count = graph_parents(&walk->graph, (uint32_t)pos, parents, cap);
+        for (int k = 0; k < count; k++) {
+            (*parents)[n++] = (uint32_t)graph_walk_at(walk, (*parents)[k]);
+        }
+    } else {
+        for (const char* q = graph_walk_parents(walk, c); *q == ' '; q += strcspn(q, " ")) {
+            q++;
+            long parent = graph_walk_find(walk, q, strcspn(q, " "));
+            if (parent < 0) {
+                continue;
+            }
+            if (n == *cap) {
+                *cap = *cap ? *cap * 2 : 8;
+                *parents = realloc(*parents, *cap * sizeof(**parents));
+                if (!*parents) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            (*parents)[n++] = (uint32_t)parent;
+        }
+    }
+
+    for (size_t k = 0; k < n; k++) {
+        graph_walk_tree(walk, (*parents)[k], tree, sizeof(tree));
+        odb_tree_entry(&walk->odb, tree, path, parent_entry, sizeof(parent_entry));
+        if (strcmp(entry, parent_entry) == 0) {
+            return 0;
+        }
+    }
+    return n > 0 || entry[0];
+}
+
+// Flags for the sessions with a commit of their own that changes path (a file or a
+// directory, relative to the top of the repository). A session's own commits are those
+// reachable from its tip but not from where it started or from its original branch.
+// One commit-graph walk covers every session, so history they share is looked at once;
+// without a graph, git answers for each session in turn.
+static int* sessions_touching(const struct session_list* list, const char* path) {
+    int* touching = calloc(list->count + 1, sizeof(*touching));
+    size_t* owner = calloc(list->count + 1, sizeof(*owner));
+    char(*starts)[JOURNAL_OID_SIZE] = calloc(list->count + 1, sizeof(*starts));
+    if (!touching || !owner || !starts) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    load_session_starts(list, starts);
+
+    char head[DEFAULT_BUFFER_SIZE] = "";
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->items[i].active) {
+            git->resolve("HEAD", head, sizeof(head));
+        }
+    }
+
+    struct graph_walk walk;
+    int opened = graph_walk_open(&walk, list->count), use_graph = opened;
+    size_t pending = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        const struct session_info* info = &list->items[i];
+        const char* tip = info->active && head[0] ? head : info->head_oid;
+        if (!tip[0]) {
+            continue;
+        }
+        if (use_graph) {
+            // A start point that is gone only means fewer commits to leave out
+            use_graph = graph_walk_mark(&walk, tip, 2 * pending) >= 0;
+            if (starts[i][0]) {
+                graph_walk_mark(&walk, starts[i], 2 * pending + 1);
+            }
+            if (info->branch_oid[0]) {
+                graph_walk_mark(&walk, info->branch_oid, 2 * pending + 1);
+            }
+        }
+        owner[pending++] = i;
+    }
+
+    walk.missing = 0;  // No merge bases needed
+    if (use_graph && graph_walk_run(&walk)) {
+        uint32_t* parents = NULL;
+        size_t cap = 0;
+        for (size_t v = 0; v < walk.nr_order; v++) {
+            size_t c = walk.order[v];
+            int pending_here = 0;
+            for (size_t w = 0; w < walk.words; w++) {
+                const uint64_t bits = walk.bits[c * walk.words + w];
+                uint64_t own = bits & ~(bits >> 1) & PAIR_LOW_BITS;
+                for (size_t b = 0; b < 64 && own >> b; b += 2) {
+                    pending_here |= (own >> b & 1) && !touching[owner[(w * 64 + b) / 2]];
+                }
+            }
+            if (!pending_here || !graph_walk_touches(&walk, c, path, &parents, &cap)) {
+                continue;
+            }
+            for (size_t w = 0; w < walk.words; w++) {
+                const uint64_t bits = walk.bits[c * walk.words + w];
+                uint64_t own = bits & ~(bits >> 1) & PAIR_LOW_BITS;
+                for (size_t b = 0; b < 64 && own >> b; b += 2) {
+                    touching[owner[(w * 64 + b) / 2]] |= (int)(own >> b & 1);
+                }
+            }
+        }
+        free(parents);
+    } else {
+        char* quoted = shell_quote(path);
+        for (size_t p = 0; p < pending; p++) {
+            const struct session_info* info = &list->items[owner[p]];
+            char cmd[3 * DEFAULT_BUFFER_SIZE], out[DEFAULT_BUFFER_SIZE] = "";
+            snprintf(cmd, sizeof(cmd), "git rev-list -1 %s%s%s%s%s -- %s 2>/dev/null",
+                     info->active && head[0] ? head : info->head_oid,
+                     starts[owner[p]][0] ? " ^" : "", starts[owner[p]],
+                     info->branch_oid[0] ? " ^" : "", info->branch_oid, quoted);
+            touching[owner[p]] = execute_git_command(cmd, out, sizeof(out)) && out[0];
+        }
+        free(quoted);
+    }
+
+    if (opened) {
+        graph_walk_close(&walk);
+    }
+    free(starts);
+    free(owner);
+    return touching;
+}
+
+static void print_session_json(const struct session_info* info, int with_repo,
+                               const struct session_stats* stats) {
+    char time_str[64];
+    format_session_time(info->time, time_str, sizeof(time_str));
+
+    printf("{");
+    if (with_repo) {
+        printf("\"repo\":");
+        json_print_string(stdout, info->repo);
+        printf(",");
+    }
+    printf("\"session\":");
+    json_print_string(stdout, info->name);
+    printf(",\"active\":%s,\"branch\":", info->active ? "true" : "false");
+    json_print_string(stdout, info->branch);
+    printf(",\"head\":");
+    json_print_string(stdout, info->head);
+    printf(",\"modified\":");
+    json_print_string(stdout, time_str);
+    printf(",\"branch_exists\":%s,\"commit_exists\":%s,\"corrupted\":%s",
+           info->branch_oid[0] ? "true" : "false", info->head_oid[0] ? "true" : "false",
+           info->corrupted ? "true" : "false");
+    if (info->author_time) {
+        printf(",\"subject\":");
+        json_print_string(stdout, info->subject);
+        printf(",\"author_time\":%ld,\"parent\":", info->author_time);
+        json_print_string(stdout, info->parent);
+    }
+    if (stats && stats->valid && stats->tip[0]) {
+        printf(",\"ahead\":%d,\"behind\":%d,\"files\":%d,\"insertions\":%d,\"deletions\":%d",
+               stats->ahead, stats->behind, stats->files, stats->insertions, stats->deletions);
+    }
+    printf("}");
+}
+
+// Repositories are found below a root by looking for a .git entry, without descending
+// into repositories or hidden directories.
+static void find_repositories(const char* dir_path, int depth, char*** repos, size_t* count) {
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/.git", dir_path);
+    if (access(path, F_OK) == 0) {
+        *repos = realloc(*repos, (*count + 1) * sizeof(**repos));
+        if (!*repos || !((*repos)[*count] = strdup(dir_path))) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        (*count)++;
+        return;
+    }
+
+    DIR* dir = depth > 0 ? opendir(dir_path) : NULL;
+    if (!dir) {
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            find_repositories(path, depth - 1, repos, count);
+        }
+    }
+    closedir(dir);
+}
+
+// A repository's git directory may be a gitlink file ("gitdir: <path>") in worktrees
+// and submodules.
+static void repository_sessions_dir(const char* repo, char* buf, size_t size) {
+    char path[MAX_PATH_LENGTH];
+    char line[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/.git", repo);
+
+    int len;
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && read_line_file(path, line, sizeof(line)) &&
+        strncmp(line, "gitdir: ", 8) == 0) {
+        if (line[8] == '/') {
+            len = snprintf(buf, size, "%s/kaishaku", line + 8);
+        } else {
+            len = snprintf(buf, size, "%s/%s/kaishaku", repo, line + 8);
+        }
+    } else {
+        len = snprintf(buf, size, "%s/kaishaku", path);
+    }
+
+    if (len >= (int)size) {
+        buf[0] = '\0';  // Too long to hold sessions we could open anyway
+    }
+}
+
+struct repo_scan {
+    char** repos;
+    struct session_list* results;  // One list per repository
+};
+
+static void scan_repository(size_t index, void* ctx) {
+    struct repo_scan* scan = ctx;
+    const char* repo = scan->repos[index];
+    char sessions_dir[MAX_PATH_LENGTH];
+
+    repository_sessions_dir(repo, sessions_dir, sizeof(sessions_dir));
+    if (load_session_list(repo, sessions_dir, 0, &scan->results[index]) &&
+        scan->results[index].count > 0) {
+        verify_session_list(repo, &scan->results[index]);
+    }
+}
+
+static void list_repositories(char** repos, size_t repo_count, int json, int jobs) {
+    struct session_list* results = calloc(repo_count ? repo_count : 1, sizeof(*results));
+    if (!results) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    struct repo_scan scan = {.repos = repos, .results = results};
+    parallel_for(repo_count, jobs, scan_repository, &scan);
+
+    // Merge into one report sorted by repository, then session
+    struct session_list all = {0};
+    for (size_t i = 0; i < repo_count; i++) {
+        for (size_t k = 0; k < results[i].count; k++) {
+            if (all.count == all.cap) {
+                all.cap = all.cap ? all.cap * 2 : 64;
+                all.items = realloc(all.items, all.cap * sizeof(*all.items));
+                if (!all.items) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            all.items[all.count++] = results[i].items[k];
+        }
+        free(results[i].items);
+    }
+    free(results);
+    qsort(all.items, all.count, sizeof(*all.items), compare_sessions);
+
+    if (json) {
+        printf("[");
+        for (size_t i = 0; i < all.count; i++) {
+            printf(i ? ",\n " : "");
+            print_session_json(&all.items[i], 1, NULL);
+        }
+        printf("]\n");
+    } else if (all.count == 0) {
+        printf("%sNo kaishaku sessions exist.%s\n", COLOR_YELLOW, COLOR_RESET);
+    } else {
+        printf("%skaishaku sessions in %zu repositories:%s\n", COLOR_CYAN, repo_count,
+               COLOR_RESET);
+        const char* last_repo = NULL;
+        for (size_t i = 0; i < all.count; i++) {
+            const struct session_info* info = &all.items[i];
+            char time_str[64];
+            format_session_time(info->time, time_str, sizeof(time_str));
+
+            if (!last_repo || strcmp(last_repo, info->repo) != 0) {
+                printf("%s%s%s\n", COLOR_CYAN, info->repo, COLOR_RESET);
+                last_repo = info->repo;
+            }
+            printf("  %s%s%s%-24s%s %s%s  %.12s  %s%s%s\n", info->active ? COLOR_GREEN : "",
+                   info->active ? "* " : "  ", COLOR_YELLOW, info->name, COLOR_RESET,
+                   COLOR_WHITE, time_str, info->head_oid[0] ? info->head_oid : "(missing)",
+                   info->branch[0] ? info->branch : "(unknown)",
+                   !info->branch_oid[0] ? " (missing)" : "", COLOR_RESET);
+        }
+    }
+
+    free(all.items);
+}
+
+// A path from the command line, relative to the current directory or absolute, as a
+// path from the top of the repository ("" for the top itself). NULL when it is outside.
+static char* repository_path(const char* arg) {
+    char cwd[MAX_PATH_LENGTH], joined[2 * MAX_PATH_LENGTH + 2];
+    size_t root_len = strlen(root);
+    if (arg[0] == '/') {
+        snprintf(joined, sizeof(joined), "%s", arg);
+    } else if (getcwd(cwd, sizeof(cwd))) {
+        snprintf(joined, sizeof(joined), "%s/%s", cwd, arg);
+    } else {
+        return NULL;
+    }
+    if (strncmp(joined, root, root_len) != 0 || (joined[root_len] && joined[root_len] != '/')) {
+        return NULL;
+    }
+
+    // Drop "." and empty components, and resolve ".."
+    char* path = calloc(strlen(joined) + 1, 1);
+    size_t len = 0;
+    if (!path) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (char* part = strtok(joined + root_len, "/"); part; part = strtok(NULL, "/")) {
+        if (strcmp(part, ".") == 0) {
+            continue;
+        }
+        if (strcmp(part, "..") == 0) {
+            if (len == 0) {
+                free(path);
+                return NULL;
+            }
+            while (len > 0 && path[--len] != '/') {
+            }
+            path[len] = '\0';
+            continue;
+        }
+        len += (size_t)sprintf(path + len, "%s%s", len ? "/" : "", part);
+    }
+    return path;
+}
+
+void cmd_list(int argc, char* argv[]) {
+    int json = 0, jobs = 0, with_stats = 0;
+    const char* search_root = NULL;
+    const char* touching = NULL;
+    char** repos = NULL;
+    size_t repo_count = 0;
+    int multi = 0;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            with_stats = 1;
+        } else if (strcmp(argv[i], "--touching") == 0 && i + 1 < argc) {
+            touching = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--root") == 0 && i + 1 < argc) {
+            search_root = argv[++i];
+            multi = 1;
+        } else if (strcmp(argv[i], "--repos") == 0) {
+            multi = 1;
+            while (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+                repos = realloc(repos, (repo_count + 1) * sizeof(*repos));
+                if (!repos) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+                repos[repo_count++] = argv[++i];
+            }
+        } else {
+            fprintf(stderr, "Error: Unknown list option '%s'.\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (multi) {
+        if (touching) {
+            fprintf(stderr, "Error: --touching works on the current repository only.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (search_root) {
+            find_repositories(search_root, 3, &repos, &repo_count);
+        }
+        list_repositories(repos, repo_count, json, jobs);
+        free(repos);
+        return;
+    }
+
+    struct session_list list = {0};
+    if (!file_exists(kaishaku_dir) || !load_session_list(root, kaishaku_dir, 1, &list)) {
+        if (json) {
+            printf("[]\n");
+            return;
+        }
+        if (!file_exists(kaishaku_dir)) {
+            printf("%sNo kaishaku sessions exist.%s\n", COLOR_YELLOW, COLOR_RESET);
+            return;
+        }
+        fprintf(stderr, "%sError: Failed to open sessions directory: %s%s\n", COLOR_RED,
+                strerror(errno), COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+
+    // Verify branch and commit still exist, all sessions at once
+    if (list.count > 0 && !verify_session_list(root, &list)) {
+        fprintf(stderr, "Warning: %s\n", error_message);
+    }
+
+    // Keep only the sessions whose own commits change the path
+    if (touching) {
+        char* path = repository_path(touching);
+        if (!path) {
+            fprintf(stderr, "Error: '%s' is outside the repository.\n", touching);
+            exit(EXIT_FAILURE);
+        }
+        int* matches = list.count ? sessions_touching(&list, path) : NULL;
+        size_t kept = 0;
+        for (size_t i = 0; i < list.count; i++) {
+            if (matches[i]) {
+                list.items[kept++] = list.items[i];
+            }
+        }
+        list.count = kept;
+        free(matches);
+        free(path);
+    }
+
+    struct session_stats* stats = with_stats ? collect_session_stats(&list) : NULL;
+
+    if (json) {
+        printf("[");
+        for (size_t i = 0; i < list.count; i++) {
+            printf(i ? ",\n " : "");
+            print_session_json(&list.items[i], 0, stats ? &stats[i] : NULL);
+        }
+        printf("]\n");
+        free(stats);
+        free(list.items);
+        return;
+    }
+
+    int found = 0;
+    printf("%skaishaku sessions:%s\n", COLOR_CYAN, COLOR_RESET);
+
+    for (size_t i = 0; i < list.count; i++) {
+        const struct session_info* info = &list.items[i];
+
+        if (info->corrupted) {
+            // Skip corrupted sessions but warn about them
+            fprintf(stderr,
+                    "%sWarning: Session '%s' appears to be corrupted. Use 'recover' to fix.%s\n",
+                    COLOR_YELLOW, info->name, COLOR_RESET);
+            continue;
+        }
+
+        int branch_exists = info->branch_oid[0] != '\0';
+        int commit_exists = info->head_oid[0] != '\0';
+        char time_str[64];
+        format_session_time(info->time, time_str, sizeof(time_str));
+
+        // Print session info with status indicators
+        printf("  %s%s%s%s\n", info->active ? COLOR_GREEN : "", info->active ? "* " : "  ",
+               COLOR_YELLOW, info->name);
+
+        printf("    %sLast modified:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE, time_str);
+
+        printf("    %sOriginal branch:%s %s%s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
+               info->branch, !branch_exists ? " (missing)" : "");
+
+        printf("    %sSession HEAD:%s %s%s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE, info->head,
+               !commit_exists ? " (missing)" : "");
+
+        if (info->author_time) {
+            char date_str[64];
+            format_session_time(info->author_time, date_str, sizeof(date_str));
+            printf("    %sCommit:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE, info->subject);
+            printf("    %sAuthored:%s %s%s, parent %.12s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
+                   date_str, info->parent[0] ? info->parent : "(none)");
+        }
+
+        if (stats && stats[i].valid && stats[i].tip[0]) {
+            printf("    %sAhead/behind:%s %s+%d / -%d, %d file(s), +%d -%d\n", COLOR_CYAN,
+                   COLOR_RESET, COLOR_WHITE, stats[i].ahead, stats[i].behind, stats[i].files,
+                   stats[i].insertions, stats[i].deletions);
+        }
+
+        // Add warning for corrupted sessions
+        if (!branch_exists || !commit_exists) {
+            printf("    %sWarning: Session may be corrupted. Use 'recover' to fix.%s\n",
+                   COLOR_YELLOW, COLOR_RESET);
+        }
+
+        found = 1;
+    }
+
+    free(stats);
+    free(list.items);
+
+    if (!found && touching) {
+        printf("%sNo session changes %s.%s\n", COLOR_YELLOW, touching, COLOR_RESET);
+    } else if (!found) {
+        printf("%sNo kaishaku sessions exist.%s\n", COLOR_YELLOW, COLOR_RESET);
+    }
+}
+
+void cmd_clean(const char* session) {
+    if (!file_exists(kaishaku_dir)) {
+        printf("%sNo kaishaku sessions exist.%s\n", COLOR_YELLOW, COLOR_RESET);
+        return;
+    }
+
+    // If active session exists and trying to clean it, error out
+    if (file_exists(ACTIVE_FILE)) {
+        const char* active_session = read_from_file(ACTIVE_FILE);
+        if (active_session && (!session || strcmp(session, active_session) == 0)) {
+            fprintf(stderr, "Error: Cannot clean active session '%s'. Exit the session first.\n",
+                    active_session);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (session) {
+        // Clean specific session
+        char* session_dir = SESSION_DIR(session);
+        if (!file_exists(session_dir)) {
+            fprintf(stderr, "Error: Session '%s' not found.\n", session);
+            exit(EXIT_FAILURE);
+        }
+
+        char* session_file = SESSION_FILE(session);
+        char* head_file = HEAD_FILE(session);
+
+        if (remove_file(session_file) == -1 || remove_file(head_file) == -1) {
+            fprintf(stderr, "Error: Failed to remove session files: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        remove_session(session);
+        remove_session_refs(session);
+
+        if (remove_dir(session_dir) == -1) {
+            fprintf(stderr, "Error: Failed to remove session directory: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (!ref_commit("kaishaku: clean")) {
+            exit(EXIT_FAILURE);
+        }
+
+        printf("%sSession '%s' cleaned.%s\n", COLOR_GREEN, session, COLOR_RESET);
+    } else {
+        // Clean all sessions
+        DIR* dir;
+        struct dirent* entry;
+
+        dir = opendir(kaishaku_dir);
+        if (!dir) {
+            fprintf(stderr, "Error: Failed to open sessions directory: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        int cleaned = 0;
+
+        while ((entry = readdir(dir)) != NULL) {
+            // Skip dotfiles and the active session marker
+            if (entry->d_name[0] == '.' || strcmp(entry->d_name, ".active") == 0) {
+                continue;
+            }
+
+            // Check if this is a directory and has session file
+            char* session_dir = SESSION_DIR(entry->d_name);
+            if (!file_exists(session_dir)) {
+                continue;
+            }
+
+            // Check if it's the active session
+            if (file_exists(ACTIVE_FILE)) {
+                const char* active_session = read_from_file(ACTIVE_FILE);
+                if (active_session && strcmp(active_session, entry->d_name) == 0) {
+                    continue;
+                }
+            }
+
+            remove_session(entry->d_name);
+            remove_session_refs(entry->d_name);
+            remove_dir(session_dir);
+
+            cleaned++;
+        }
+
+        closedir(dir);
+        if (!ref_commit("kaishaku: clean")) {
+            exit(EXIT_FAILURE);
+        }
+
+        printf("%s%d session(s) cleaned.%s\n", COLOR_GREEN, cleaned, COLOR_RESET);
+    }
+}
+
+// Remove sessions that are done with: those whose commits are all on their original
+// branch, those unused for longer than the expiry, and those whose commit and branch
+// are both gone. Ancestry for all sessions comes from the list --stats walk, and the
+// removals are committed together at the end.
+void cmd_gc(int argc, char* argv[]) {
+    int dry_run = 0;
+    int expire = config.gc_expire;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--dry-run") == 0 || strcmp(argv[i], "-n") == 0) {
+            dry_run = 1;
+        } else if (strcmp(argv[i], "--older-than") == 0 && i + 1 < argc) {
+            expire = atoi(argv[++i]);
+        } else {
+            usage();
+        }
+    }
+    if (batch_mode) {
+        fprintf(stderr, "Error: gc cannot run inside batch.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct session_list list = {0};
+    if (!file_exists(kaishaku_dir) || !load_session_list(root, kaishaku_dir, 1, &list) ||
+        list.count == 0) {
+        printf("%sNo kaishaku sessions exist.%s\n", COLOR_YELLOW, COLOR_RESET);
+        free(list.items);
+        return;
+    }
+    if (!verify_session_list(root, &list)) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+    struct session_stats* stats = collect_session_stats(&list);
+
+    time_t now = time(NULL);
+    char(*starts)[JOURNAL_OID_SIZE] = calloc(list.count, sizeof(*starts));
+    if (!starts) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    load_session_starts(&list, starts);
+    size_t selected = 0;
+
+    for (size_t i = 0; i < list.count; i++) {
+        const struct session_info* info = &list.items[i];
+        char reason[DEFAULT_BUFFER_SIZE];
+        long days = info->time ? (long)(now - info->time) / 86400 : 0;
+
+        // A session still at its starting point is new, not merged, and one whose
+        // ancestry is unknown is never taken for merged
+        const char* start = starts[i][0] ? starts[i] : stats[i].base;
+        if (info->active || info->corrupted) {
+            continue;
+        } else if (stats[i].valid && stats[i].tip[0] && stats[i].ahead == 0 &&
+                   strcmp(stats[i].tip, start) != 0) {
+            snprintf(reason, sizeof(reason), "merged into %s", info->branch);
+        } else if (expire > 0 && info->time && days >= expire) {
+            snprintf(reason, sizeof(reason), "unused for %ld days", days);
+        } else if (!info->head_oid[0] && !info->branch_oid[0]) {
+            snprintf(reason, sizeof(reason), "commit and branch are gone");
+        } else {
+            continue;
+        }
+
+        printf("  %s%-20s%s %s\n", COLOR_YELLOW, info->name, COLOR_RESET, reason);
+        selected++;
+        if (dry_run) {
+            continue;
+        }
+
+        // Deferred, so nothing changes until every removal is known
+        store_defer = 1;
+        remove_session(info->name);
+        remove_dir(SESSION_DIR(info->name));
+        store_defer = 0;
+        remove_session_refs(info->name);
+    }
+    free(starts);
+    free(stats);
+    free(list.items);
+
+    if (selected == 0) {
+        printf("%sNothing to remove.%s\n", COLOR_GREEN, COLOR_RESET);
+        return;
+    }
+    if (dry_run) {
+        printf("%sWould remove %zu session(s).%s\n", COLOR_CYAN, selected, COLOR_RESET);
+        return;
+    }
+
+    // Snapshot refs in one transaction, then all metadata
+    if (!ref_commit("kaishaku: gc")) {
+        exit(EXIT_FAILURE);
+    }
+    if (!store_flush()) {
+        fprintf(stderr, "Error: Failed to remove session metadata.\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("%sRemoved %zu session(s).%s\n", COLOR_GREEN, selected, COLOR_RESET);
+}
+
+// Keep only the named sessions (all of them when no names are given), in list order
+static void select_sessions(struct session_list* list, char** names, int count) {
+    for (int k = 0; k < count; k++) {
+        size_t i = 0;
+        while (i < list->count && strcmp(list->items[i].name, names[k]) != 0) {
+            i++;
+        }
+        if (i == list->count) {
+            fprintf(stderr, "Error: Session '%s' does not exist.\n", names[k]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        int wanted = count == 0;
+        for (int k = 0; k < count && !wanted; k++) {
+            wanted = strcmp(list->items[i].name, names[k]) == 0;
+        }
+        if (wanted) {
+            list->items[kept++] = list->items[i];
+        }
+    }
+    list->count = kept;
+}
+
+// The commit a session is at: HEAD for the active one, "" if it is gone
+static void session_tip(const struct session_info* info, char* tip, size_t size) {
+    tip[0] = '\0';
+    if (!info->active || !git->resolve("HEAD", tip, size)) {
+        snprintf(tip, size, "%s", info->head_oid);
+    }
+}
+
+// kaishaku grep: search the tree at every session's tip without checking anything out.
+// Trees are read straight from the object store, each distinct tree once, and each
+// distinct blob is searched once by a pool of threads however many sessions share it;
+// only then are the matches spread back over the sessions and paths that hold them. If
+// an object cannot be read here (a partial clone, say), one git grep over the session
+// tips does the search instead.
+struct grep_entry {
+    char* name;
+    size_t target;  // Index into the trees or the blobs
+    int is_tree;
+};
+
+struct grep_tree {
+    char* oid;
+    struct grep_entry* entries;
+    size_t nr;
+    int has_match;  // -1 until known
+};
+
+struct grep_blob {
+    char* oid;
+    char* hits;  // "<line>:<text>\n" for every matching line
+    size_t hits_len, hits_cap;
+    int binary;  // Matched, but has NUL bytes
+};
+
+struct grep_search {
+    regex_t regex;
+    int ignore_case, fixed, names_only;
+    struct grep_tree* trees;
+    size_t nr_trees, trees_cap;
+    struct grep_blob* blobs;
+    size_t nr_blobs, blobs_cap;
+    struct oid_map tree_ids, blob_ids;
+    size_t next;  // Next blob to search
+    pthread_mutex_t lock;
+    int failed;  // Some object could not be read
+};
+
+static size_t grep_add_blob(struct grep_search* search, const char* hex) {
+    size_t slot = oid_map_slot(&search->blob_ids, hex, strlen(hex));
+    if (search->blob_ids.keys[slot]) {
+        return search->blob_ids.values[slot];
+    }
+    if (search->nr_blobs == search->blobs_cap) {
+        search->blobs_cap = search->blobs_cap ? search->blobs_cap * 2 : 256;
+        search->blobs = realloc(search->blobs, search->blobs_cap * sizeof(*search->blobs));
+        if (!search->blobs) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct grep_blob* blob = &search->blobs[search->nr_blobs];
+    memset(blob, 0, sizeof(*blob));
+    blob->oid = strdup(hex);
+    if (!blob->oid) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    oid_map_add(&search->blob_ids, blob->oid, search->nr_blobs);
+    return search->nr_blobs++;
+}
+
+// Read a tree and, the first time each is seen, everything below it. Returns its index.
+static size_t grep_add_tree(struct grep_search* search, struct odb* odb, const char* hex) {
+    size_t slot = oid_map_slot(&search->tree_ids, hex, strlen(hex));
+    if (search->tree_ids.keys[slot]) {
+        return search->tree_ids.values[slot];
+    }
+    if (search->nr_trees == search->trees_cap) {
+        search->trees_cap = search->trees_cap ? search->trees_cap * 2 : 256;
+        search->trees = realloc(search->trees, search->trees_cap * sizeof(*search->trees));
+        if (!search->trees) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t index = search->nr_trees++;
+    struct grep_tree tree = {.oid = strdup(hex), .has_match = -1};
+    if (!tree.oid) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    search->trees[index] = tree;
+    oid_map_add(&search->tree_ids, tree.oid, index);
+
+    int type;
+    size_t size, hash_len = strlen(hex) / 2;
+    unsigned char* data = odb_read_object(odb, hex, &type, &size);
+    if (!data || type != OBJ_TREE) {
+        search->failed = 1;
+        free(data);
+        return index;
+    }
+
+    // "<mode> <name>\0<raw id>" per entry; submodules are not searched
+    struct grep_entry* entries = NULL;
+    size_t nr = 0, cap = 0;
+    const unsigned char* end = data + size;
+    for (const unsigned char* p = data; p < end;) {
+        const unsigned char* space = memchr(p, ' ', (size_t)(end - p));
+        const unsigned char* nul = space ? memchr(space, '\0', (size_t)(end - space)) : NULL;
+        if (!nul || (size_t)(end - nul - 1) < hash_len) {
+            search->failed = 1;
+            break;
+        }
+        char id[72];
+        for (size_t i = 0; i < hash_len; i++) {
+            snprintf(id + 2 * i, 3, "%02x", nul[1 + i]);
+        }
+        int is_tree = space - p == 5 && memcmp(p, "40000", 5) == 0;
+        int is_gitlink = space - p == 6 && memcmp(p, "160000", 6) == 0;
+        if (!is_gitlink) {
+            if (nr == cap) {
+                cap = cap ? cap * 2 : 16;
+                entries = realloc(entries, cap * sizeof(*entries));
+                if (!entries) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            entries[nr].name = strdup((const char*)space + 1);
+            entries[nr].is_tree = is_tree;
+            entries[nr].target =
+                is_tree ? grep_add_tree(search, odb, id) : grep_add_blob(search, id);
+            nr++;
+        }
+        p = nul + 1 + hash_len;
+    }
+    free(data);
+
+    search->trees[index].entries = entries;
+    search->trees[index].nr = nr;
+    return index;
+}
+
+// Lines are matched in place, NUL bytes and all
+static int grep_line_matches(struct grep_search* search, const char* line, size_t len) {
+    regmatch_t match = {.rm_so = 0, .rm_eo = (regoff_t)len};
+    return regexec(&search->regex, line, 1, &match, REG_STARTEND) == 0;
+}
+
+static void grep_search_blob(struct grep_search* search, struct grep_blob* blob,
+                             char* data, size_t size) {
+    // Like git, anything with a NUL in its first 8000 bytes is binary
+    blob->binary = memchr(data, '\0', size < 8000 ? size : 8000) != NULL;
+
+    size_t number = 1;
+    for (char* line = data; line < data + size; number++) {
+        char* eol = memchr(line, '\n', (size_t)(data + size - line));
+        char* end = eol ? eol : data + size;
+        if (!grep_line_matches(search, line, (size_t)(end - line))) {
+            line = end + 1;
+            continue;
+        }
+        if (search->names_only || blob->binary) {
+            blob->hits = strdup("");
+            break;
+        }
+        size_t need = (size_t)(end - line) + 32;
+        if (blob->hits_len + need > blob->hits_cap) {
+            blob->hits_cap = (blob->hits_len + need) * 2;
+            blob->hits = realloc(blob->hits, blob->hits_cap);
+            if (!blob->hits) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        blob->hits_len += (size_t)sprintf(blob->hits + blob->hits_len, "%zu:%.*s\n", number,
+                                          (int)(end - line), line);
+        line = end + 1;
+    }
+    if (!blob->hits) {
+        blob->binary = 0;
+    }
+}
+
+// One per thread, each with its own object database handle
+static void grep_worker(size_t index, void* ctx) {
+    struct grep_search* search = ctx;
+    struct odb odb;
+    (void)index;
+    odb_open(&odb, root);
+    for (;;) {
+        pthread_mutex_lock(&search->lock);
+        size_t next = search->next++;
+        pthread_mutex_unlock(&search->lock);
+        if (next >= search->nr_blobs) {
+            break;
+        }
+
+        struct grep_blob* blob = &search->blobs[next];
+        int type;
+        size_t size;
+        char* data = (char*)odb_read_object(&odb, blob->oid, &type, &size);
+        if (!data || type != OBJ_BLOB) {
+            search->failed = 1;
+        } else {
+            grep_search_blob(search, blob, data, size);
+        }
+        free(data);
+    }
+    odb_close(&odb);
+}
+
+// Whether any blob below a tree matched, remembered per tree
+static int grep_tree_has_match(struct grep_search* search, size_t t) {
+    if (search->trees[t].has_match < 0) {
+        search->trees[t].has_match = 0;
+        for (size_t i = 0; i < search->trees[t].nr && !search->trees[t].has_match; i++) {
+            const struct grep_entry* entry = &search->trees[t].entries[i];
+            search->trees[t].has_match = entry->is_tree
+                                             ? grep_tree_has_match(search, entry->target)
+                                             : search->blobs[entry->target].hits != NULL;
+        }
+    }
+    return search->trees[t].has_match;
+}
+
+static void grep_print_tree(struct grep_search* search, const char* session, size_t t,
+                            const char* prefix) {
+    for (size_t i = 0; i < search->trees[t].nr; i++) {
+        const struct grep_entry* entry = &search->trees[t].entries[i];
+        if (entry->is_tree ? !grep_tree_has_match(search, entry->target)
+                           : !search->blobs[entry->target].hits) {
+            continue;
+        }
+
+        char* path = malloc(strlen(prefix) + strlen(entry->name) + 2);
+        if (!path) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        sprintf(path, "%s%s", prefix, entry->name);
+        if (entry->is_tree) {
+            strcat(path, "/");
+            grep_print_tree(search, session, entry->target, path);
+            free(path);
+            continue;
+        }
+
+        const struct grep_blob* blob = &search->blobs[entry->target];
+        if (search->names_only) {
+            printf("%s%s%s:%s\n", COLOR_YELLOW, session, COLOR_RESET, path);
+        } else if (blob->binary) {
+            printf("Binary file %s%s%s:%s matches\n", COLOR_YELLOW, session, COLOR_RESET, path);
+        } else {
+            for (const char* line = blob->hits; *line; line += strcspn(line, "\n") + 1) {
+                printf("%s%s%s:%s:%.*s\n", COLOR_YELLOW, session, COLOR_RESET, path,
+                       (int)strcspn(line, "\n"), line);
+            }
+        }
+        free(path);
+    }
+}
+
+// The same search by git, over the distinct tips; its "<tip>:" prefixes become session
+// names. Returns whether anything matched.
+static int grep_with_git(struct grep_search* search, const char* pattern, int extended,
+                         const struct session_list* list, char (*tips)[72]) {
+    char* quoted = shell_quote(pattern);
+    char* cmd = NULL;
+    size_t cmd_len = 0, cmd_cap = 0;
+    char head[DEFAULT_BUFFER_SIZE];
+    snprintf(head, sizeof(head), "git grep -n%s%s%s -e %s", search->ignore_case ? " -i" : "",
+             search->fixed ? " -F" : extended ? " -E" : "", search->names_only ? " -l" : "",
+             quoted);
+    append_line(&cmd, &cmd_len, &cmd_cap, head);
+    free(quoted);
+    for (size_t i = 0; i < list->count; i++) {
+        int seen = !tips[i][0];
+        for (size_t k = 0; k < i && !seen; k++) {
+            seen = strcmp(tips[k], tips[i]) == 0;
+        }
+        if (!seen) {
+            append_line(&cmd, &cmd_len, &cmd_cap, tips[i]);
+        }
+    }
+    for (char* p = cmd; *p; p++) {
+        *p = *p == '\n' ? ' ' : *p;
+    }
+
+    char* out = NULL;
+    int status = run_git_filter(cmd, "", 0, &out);
+    if (status != 0 && status != 1) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+    for (char* line = strtok(out, "\n"); line; line = strtok(NULL, "\n")) {
+        const char* binary = strncmp(line, "Binary file ", 12) == 0 ? "Binary file " : "";
+        line += strlen(binary);
+        size_t tip_len = strcspn(line, ":");
+        for (size_t i = 0; i < list->count; i++) {
+            if (strlen(tips[i]) == tip_len && strncmp(line, tips[i], tip_len) == 0) {
+                printf("%s%s%s%s%s\n", binary, COLOR_YELLOW, list->items[i].name, COLOR_RESET,
+                       line + tip_len);
+            }
+        }
+    }
+    free(out);
+    free(cmd);
+    return status == 0;
+}
+
+void cmd_grep(int argc, char* argv[]) {
+    struct grep_search search = {.next = 0};
+    int extended = 0, argi = 0;
+    for (; argi < argc && argv[argi][0] == '-' && argv[argi][1]; argi++) {
+        if (strcmp(argv[argi], "-i") == 0) {
+            search.ignore_case = 1;
+        } else if (strcmp(argv[argi], "-E") == 0) {
+            extended = 1;
+        } else if (strcmp(argv[argi], "-F") == 0) {
+            search.fixed = 1;
+        } else if (strcmp(argv[argi], "-l") == 0) {
+            search.names_only = 1;
+        } else if (strcmp(argv[argi], "--") == 0) {
+            argi++;
+            break;
+        } else {
+            usage();
+        }
+    }
+    if (argi >= argc) {
+        usage();
+    }
+    const char* pattern = argv[argi++];
+
+    // -F is a basic regex with every special character escaped
+    char* regex = malloc(strlen(pattern) * 2 + 1);
+    if (!regex) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    char* r = regex;
+    for (const char* p = pattern; *p; p++) {
+        if (search.fixed && strchr("\\.[]*^$", *p)) {
+            *r++ = '\\';
+        }
+        *r++ = *p;
+    }
+    *r = '\0';
+    int flags = (extended && !search.fixed ? REG_EXTENDED : 0) |
+                (search.ignore_case ? REG_ICASE : 0);
+    int err = regcomp(&search.regex, regex, flags | REG_NOSUB);
+    free(regex);
+    if (err) {
+        char msg[DEFAULT_BUFFER_SIZE];
+        regerror(err, &search.regex, msg, sizeof(msg));
+        fprintf(stderr, "Error: Invalid pattern '%s': %s\n", pattern, msg);
+        exit(EXIT_FAILURE);
+    }
+
+    struct session_list list = {0};
+    if (!file_exists(kaishaku_dir) || !load_session_list(root, kaishaku_dir, 1, &list) ||
+        list.count == 0) {
+        printf("%sNo kaishaku sessions exist.%s\n", COLOR_YELLOW, COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+    if (!verify_session_list(root, &list)) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+
+    select_sessions(&list, argv + argi, argc - argi);
+    char(*tips)[72] = calloc(list.count, sizeof(*tips));
+    if (!tips) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < list.count; i++) {
+        session_tip(&list.items[i], tips[i], sizeof(tips[i]));
+    }
+
+    // Every distinct tree and blob under the tips
+    struct odb odb;
+    odb_open(&odb, root);
+    oid_map_init(&search.tree_ids, 1024);
+    oid_map_init(&search.blob_ids, 1024);
+    size_t* roots = calloc(list.count, sizeof(*roots));
+    if (!roots) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < list.count && !search.failed; i++) {
+        if (!tips[i][0]) {
+            continue;
+        }
+        char tree[72];
+        if (!odb_commit_tree(&odb, tips[i], tree, sizeof(tree))) {
+            search.failed = 1;
+            break;
+        }
+        roots[i] = grep_add_tree(&search, &odb, tree);
+    }
+    odb_close(&odb);
+
+    int found = 0;
+    if (!search.failed) {
+        pthread_mutex_init(&search.lock, NULL);
+        int workers = online_cpus();
+        parallel_for((size_t)workers, workers, grep_worker, &search);
+        pthread_mutex_destroy(&search.lock);
+    }
+    if (search.failed) {
+        found = grep_with_git(&search, pattern, extended, &list, tips);
+    } else {
+        for (size_t i = 0; i < list.count; i++) {
+            if (tips[i][0] && grep_tree_has_match(&search, roots[i])) {
+                grep_print_tree(&search, list.items[i].name, roots[i], "");
+                found = 1;
+            }
+        }
+    }
+
+    for (size_t t = 0; t < search.nr_trees; t++) {
+        for (size_t e = 0; e < search.trees[t].nr; e++) {
+            free(search.trees[t].entries[e].name);
+        }
+        free(search.trees[t].entries);
+        free(search.trees[t].oid);
+    }
+    for (size_t b = 0; b < search.nr_blobs; b++) {
+        free(search.blobs[b].hits);
+        free(search.blobs[b].oid);
+    }
+    free(search.trees);
+    free(search.blobs);
+    oid_map_free(&search.tree_ids);
+    oid_map_free(&search.blob_ids);
+    regfree(&search.regex);
+    free(roots);
+    free(tips);
+    free(list.items);
+
+    // Like grep, fail when nothing matched
+    if (!found) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// kaishaku compare: how far each session is from its original branch and from each other
+// session. The branch side comes from the session stats cache; every pair of session
+// trees is sized by the same single diff-tree process, with equal trees skipped.
+void cmd_compare(int argc, char* argv[]) {
+    int json = 0, argi = 0;
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "--json") == 0) {
+            json = 1;
+        } else {
+            usage();
+        }
+    }
+
+    struct session_list list = {0};
+    if (!file_exists(kaishaku_dir) || !load_session_list(root, kaishaku_dir, 1, &list) ||
+        list.count == 0) {
+        printf("%sNo kaishaku sessions exist.%s\n", COLOR_YELLOW, COLOR_RESET);
+        free(list.items);
+        return;
+    }
+    if (!verify_session_list(root, &list)) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+    select_sessions(&list, argv + argi, argc - argi);
+    struct session_stats* stats = collect_session_stats(&list);
+
+    // The tree at each session's tip, "" if its commit is gone
+    size_t n = list.count;
+    char(*trees)[72] = calloc(n, sizeof(*trees));
+    struct session_stats* between = calloc(n * n + 1, sizeof(*between));
+    struct session_stats** sizes = calloc(n * n + 1, sizeof(*sizes));
+    if (!trees || !between || !sizes) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    struct odb odb;
+    odb_open(&odb, root);
+    for (size_t i = 0; i < n; i++) {
+        char tip[72], rev[DEFAULT_BUFFER_SIZE];
+        session_tip(&list.items[i], tip, sizeof(tip));
+        snprintf(rev, sizeof(rev), "%s^{tree}", tip);
+        if (tip[0] && !odb_commit_tree(&odb, tip, trees[i], sizeof(trees[i])) &&
+            !git->resolve(rev, trees[i], sizeof(trees[i]))) {
+            trees[i][0] = '\0';
+        }
+    }
+    odb_close(&odb);
+
+    // between[i * n + j] is the diff from session i to session j
+    char* pairs = NULL;
+    size_t pairs_len = 0, pairs_cap = 0, pair_count = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = i + 1; j < n; j++) {
+            if (trees[i][0] && trees[j][0] && strcmp(trees[i], trees[j]) != 0) {
+                char pair[160];
+                snprintf(pair, sizeof(pair), "%s %s", trees[i], trees[j]);
+                append_line(&pairs, &pairs_len, &pairs_cap, pair);
+                sizes[pair_count++] = &between[i * n + j];
+            }
+        }
+    }
+    if (pair_count && !diff_tree_sizes(pairs, pairs_len, pair_count, sizes)) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = i + 1; j < n; j++) {
+            between[j * n + i].files = between[i * n + j].files;
+            between[j * n + i].insertions = between[i * n + j].deletions;
+            between[j * n + i].deletions = between[i * n + j].insertions;
+        }
+    }
+
+    if (json) {
+        printf("{\"sessions\":[");
+        for (size_t i = 0; i < n; i++) {
+            printf("%s{\"session\":", i ? "," : "");
+            json_print_string(stdout, list.items[i].name);
+            printf(",\"branch\":");
+            json_print_string(stdout, list.items[i].branch);
+            if (stats[i].valid && stats[i].tip[0]) {
+                printf(",\"ahead\":%d,\"behind\":%d,\"files\":%d,\"insertions\":%d,"
+                       "\"deletions\":%d",
+                       stats[i].ahead, stats[i].behind, stats[i].files, stats[i].insertions,
+                       stats[i].deletions);
+            }
+            printf("}");
+        }
+        printf("],\"pairs\":[");
+        int first = 1;
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = i + 1; j < n; j++) {
+                if (!trees[i][0] || !trees[j][0]) {
+                    continue;
+                }
+                const struct session_stats* d = &between[i * n + j];
+                printf("%s{\"from\":", first ? "" : ",");
+                json_print_string(stdout, list.items[i].name);
+                printf(",\"to\":");
+                json_print_string(stdout, list.items[j].name);
+                printf(",\"files\":%d,\"insertions\":%d,\"deletions\":%d}", d->files,
+                       d->insertions, d->deletions);
+                first = 0;
+            }
+        }
+        printf("]}\n");
+    } else {
+        printf("Against the original branch (ahead/behind, files, +insertions -deletions):\n");
+        for (size_t i = 0; i < n; i++) {
+            printf("  %s%-20s%s ", COLOR_YELLOW, list.items[i].name, COLOR_RESET);
+            if (stats[i].valid && stats[i].tip[0]) {
+                printf("+%d / -%d, %d file(s), +%d -%d\n", stats[i].ahead, stats[i].behind,
+                       stats[i].files, stats[i].insertions, stats[i].deletions);
+            } else {
+                printf("%scommit or branch missing%s\n", COLOR_RED, COLOR_RESET);
+            }
+        }
+
+        if (n > 1) {
+            printf("\nBetween sessions, from row to column (files, +insertions -deletions):\n");
+            printf("  %-20s", "");
+            for (size_t j = 0; j < n; j++) {
+                printf(" %s%-*.20s%s", COLOR_YELLOW, j + 1 < n ? 20 : 0, list.items[j].name,
+                       COLOR_RESET);
+            }
+            printf("\n");
+            for (size_t i = 0; i < n; i++) {
+                printf("  %s%-20.20s%s", COLOR_YELLOW, list.items[i].name, COLOR_RESET);
+                for (size_t j = 0; j < n; j++) {
+                    char cell[64];
+                    const struct session_stats* d = &between[i * n + j];
+                    if (i == j || !trees[i][0] || !trees[j][0]) {
+                        snprintf(cell, sizeof(cell), "%s", i == j ? "-" : "?");
+                    } else {
+                        snprintf(cell, sizeof(cell), "%d +%d -%d", d->files, d->insertions,
+                                 d->deletions);
+                    }
+                    printf(" %-*s", j + 1 < n ? 20 : 0, cell);
+                }
+                printf("\n");
+            }
+        }
+    }
+
+    free(pairs);
+    free(sizes);
+    free(between);
+    free(trees);
+    free(stats);
+    free(list.items);
+}
+
+// What save would do for each selected session, worked out by git merge-tree without
+// touching the working tree or the index. One merge-tree per session, run in parallel.
+struct save_prediction {
+    const struct session_info* info;
+    char tip[72];
+    int status;       // 0 clean, 1 conflicts, else git failed
+    char* conflicts;  // The merged tree, then the conflicted paths, one per line
+};
+
+static void predict_save(size_t index, void* ctx) {
+    struct save_prediction* p = (struct save_prediction*)ctx + index;
+    char cmd[DEFAULT_BUFFER_SIZE];
+    snprintf(cmd, sizeof(cmd), "git merge-tree --write-tree --name-only --no-messages %s %s",
+             p->info->branch_oid, p->tip);
+    p->status = run_git_filter(cmd, "", 0, &p->conflicts);
+}
+
+// save --dry-run [--all | <session>]: the active session unless told otherwise
+void save_dry_run(const char* which) {
+    struct session_list list = {0};
+    if (!file_exists(kaishaku_dir) || !load_session_list(root, kaishaku_dir, 1, &list) ||
+        list.count == 0) {
+        printf("%sNo kaishaku sessions exist.%s\n", COLOR_YELLOW, COLOR_RESET);
+        free(list.items);
+        return;
+    }
+    if (!verify_session_list(root, &list)) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+    if (!which) {
+        size_t i = 0;
+        while (i < list.count && !list.items[i].active) {
+            i++;
+        }
+        if (i == list.count) {
+            fprintf(stderr, "Error: No active kaishaku session\n");
+            exit(EXIT_FAILURE);
+        }
+        list.items[0] = list.items[i];
+        list.count = 1;
+    } else if (strcmp(which, "--all") != 0) {
+        char* names[] = {(char*)which};
+        select_sessions(&list, names, 1);
+    }
+
+    struct save_prediction* predictions = calloc(list.count, sizeof(*predictions));
+    size_t count = 0;
+    if (!predictions) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < list.count; i++) {
+        const struct session_info* info = &list.items[i];
+        char tip[72];
+        session_tip(info, tip, sizeof(tip));
+        if (!tip[0] || !info->branch_oid[0]) {
+            printf("  %s%-20s%s %scommit or branch missing%s\n", COLOR_YELLOW, info->name,
+                   COLOR_RESET, COLOR_RED, COLOR_RESET);
+            continue;
+        }
+        predictions[count].info = info;
+        snprintf(predictions[count].tip, sizeof(predictions[count].tip), "%s", tip);
+        count++;
+    }
+
+    parallel_for(count, 0, predict_save, predictions);
+
+    int conflicted = 0;
+    for (size_t k = 0; k < count; k++) {
+        struct save_prediction* p = &predictions[k];
+        printf("  %s%-20s%s ", COLOR_YELLOW, p->info->name, COLOR_RESET);
+        if (p->status == 0) {
+            printf("%smerges cleanly into %s%s\n", COLOR_GREEN, p->info->branch, COLOR_RESET);
+        } else if (p->status == 1) {
+            printf("%sconflicts with %s%s\n", COLOR_RED, p->info->branch, COLOR_RESET);
+            strtok(p->conflicts, "\n");
+            for (char* path = strtok(NULL, "\n"); path; path = strtok(NULL, "\n")) {
+                printf("      %s\n", path);
+            }
+            conflicted = 1;
+        } else {
+            printf("%sgit merge-tree failed (git 2.38 or later is needed)%s\n", COLOR_RED,
+                   COLOR_RESET);
+            conflicted = 1;
+        }
+        free(p->conflicts);
+    }
+    free(predictions);
+    free(list.items);
+
+    // Like merge-tree itself, fail when any session would not merge cleanly
+    if (conflicted) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// kaishaku restack: replay each session's own commits onto the current tip of its original
+// branch without checking anything out. Every commit is cherry-picked in memory by git
+// merge-tree, which before git 2.40 takes no explicit merge base; merging the commit with a
+// throwaway commit that has the new tree but the commit's own parent makes that parent the
+// merge base. Sessions are replayed in parallel, a conflict only stops its own session, and
+// the new session tips are written together at the end. Only the active session's working
+// tree is touched.
+enum { RESTACK_DONE, RESTACK_CURRENT, RESTACK_CONFLICT, RESTACK_MERGES, RESTACK_FAILED };
+
+struct restack_job {
+    const struct session_info* info;
+    char tip[72], new_tip[72];
+    int status;
+    char* conflicts;  // From merge-tree: the merged tree, then the conflicted paths
+    size_t replayed, dropped;
+};
+
+// A commit object's text, from the object store or else from git
+static char* restack_read_commit(struct odb* odb, const char* hex) {
+    int type;
+    size_t size;
+    char* data = (char*)odb_read_object(odb, hex, &type, &size);
+    if (data && type == OBJ_COMMIT) {
+        return data;
+    }
+    free(data);
+
+    char cmd[DEFAULT_BUFFER_SIZE];
+    snprintf(cmd, sizeof(cmd), "git cat-file commit %s", hex);
+    if (run_git_filter(cmd, "", 0, &data) != 0) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+// Run a git command that prints one object id, into oid
+static int restack_git_oid(const char* cmd, const char* input, char* oid) {
+    char* out = NULL;
+    int ok = run_git_filter(cmd, input, strlen(input), &out) == 0 && out[0];
+    if (ok) {
+        snprintf(oid, 72, "%.*s", (int)strcspn(out, "\n"), out);
+    }
+    free(out);
+    return ok;
+}
+
+// The tree a commit points at
+static int restack_tree(struct odb* odb, const char* hex, char* tree) {
+    char* text = restack_read_commit(odb, hex);
+    int ok = text && strncmp(text, "tree ", 5) == 0;
+    if (ok) {
+        snprintf(tree, 72, "%.*s", (int)strcspn(text + 5, "\n"), text + 5);
+    }
+    free(text);
+    return ok;
+}
+
+// Cherry-pick commit, whose parent is parent, onto the commit onto with tree onto_tree,
+// and move both to the result. A change the branch already has leaves nothing to commit
+// and is dropped, as git rebase does. Returns 0 on a conflict or failure.
+static int restack_pick(struct odb* odb, struct restack_job* job, const char* commit,
+                        const char* parent, char* onto, char* onto_tree) {
+    char tree[72], parent_tree[72], merged[72], cmd[DEFAULT_BUFFER_SIZE * 4];
+    char* text = restack_read_commit(odb, commit);
+    if (!text || !restack_tree(odb, commit, tree) || !restack_tree(odb, parent, parent_tree)) {
+        job->status = RESTACK_FAILED;
+        free(text);
+        return 0;
+    }
+
+    // Nothing to merge if the parent had the same tree as onto
+    if (strcmp(parent_tree, onto_tree) == 0) {
+        snprintf(merged, sizeof(merged), "%s", tree);
+    } else {
+        char base[72];
+        snprintf(cmd, sizeof(cmd), "git commit-tree %s -p %s -m kaishaku-restack", onto_tree,
+                 parent);
+        if (!restack_git_oid(cmd, "", base)) {
+            job->status = RESTACK_FAILED;
+            free(text);
+            return 0;
+        }
+        snprintf(cmd, sizeof(cmd), "git merge-tree --write-tree --name-only --no-messages %s %s",
+                 base, commit);
+        free(job->conflicts);
+        int status = run_git_filter(cmd, "", 0, &job->conflicts);
+        if (status != 0) {
+            job->status = status == 1 ? RESTACK_CONFLICT : RESTACK_FAILED;
+            free(text);
+            return 0;
+        }
+        snprintf(merged, sizeof(merged), "%.*s", (int)strcspn(job->conflicts, "\n"),
+                 job->conflicts);
+    }
+    if (strcmp(merged, onto_tree) == 0) {
+        job->dropped++;
+        free(text);
+        return 1;
+    }
+
+    // Same author, date and message; "author Name <email> <seconds> <zone>"
+    char* author = strstr(text, "\nauthor ");
+    char* message = strstr(text, "\n\n");
+    char* email = author ? strchr(author, '<') : NULL;
+    char* email_end = email ? strchr(email, '>') : NULL;
+    if (!email_end || (message && email_end > message)) {
+        job->status = RESTACK_FAILED;
+        free(text);
+        return 0;
+    }
+    author += 8;
+    char name[DEFAULT_BUFFER_SIZE], address[DEFAULT_BUFFER_SIZE], date[64];
+    snprintf(name, sizeof(name), "%.*s", (int)(email - author - (email > author)), author);
+    snprintf(address, sizeof(address), "%.*s", (int)(email_end - email - 1), email + 1);
+    snprintf(date, sizeof(date), "%.*s", (int)strcspn(email_end + 2, "\n"), email_end + 2);
+    char* quoted_name = shell_quote(name);
+    char* quoted_address = shell_quote(address);
+    char* quoted_date = shell_quote(date);
+    snprintf(cmd, sizeof(cmd),
+             "GIT_AUTHOR_NAME=%s GIT_AUTHOR_EMAIL=%s GIT_AUTHOR_DATE=%s git commit-tree %s -p %s",
+             quoted_name, quoted_address, quoted_date, merged, onto);
+    free(quoted_name);
+    free(quoted_address);
+    free(quoted_date);
+
+    int ok = restack_git_oid(cmd, message ? message + 2 : "", onto);
+    if (ok) {
+        snprintf(onto_tree, 72, "%s", merged);
+        job->replayed++;
+    } else {
+        job->status = RESTACK_FAILED;
+    }
+    free(text);
+    return ok;
+}
+
+static void restack_session(size_t index, void* ctx) {
+    struct restack_job* job = (struct restack_job*)ctx + index;
+    char cmd[DEFAULT_BUFFER_SIZE];
+    char* commits = NULL;
+
+    // The session's own commits, oldest first, each followed by its parents
+    snprintf(cmd, sizeof(cmd), "git rev-list --reverse --topo-order --parents %s..%s",
+             job->info->branch_oid, job->tip);
+    if (run_git_filter(cmd, "", 0, &commits) != 0) {
+        job->status = RESTACK_FAILED;
+        free(commits);
+        return;
+    }
+
+    struct odb odb;
+    odb_open(&odb, root);
+    char onto[72], onto_tree[72];
+    snprintf(onto, sizeof(onto), "%s", job->info->branch_oid);
+    job->status = restack_tree(&odb, onto, onto_tree) ? RESTACK_DONE : RESTACK_FAILED;
+
+    char* save = NULL;
+    int first = 1;
+    for (char* line = strtok_r(commits, "\n", &save); line && job->status == RESTACK_DONE;
+         line = strtok_r(NULL, "\n", &save)) {
+        char commit[72], parent[72], extra[72];
+        if (sscanf(line, "%71s %71s %71s", commit, parent, extra) != 2) {
+            job->status = RESTACK_MERGES;  // Or a second root commit
+        } else if (first && strcmp(parent, onto) == 0) {
+            job->status = RESTACK_CURRENT;  // Already on top of the branch
+        } else {
+            restack_pick(&odb, job, commit, parent, onto, onto_tree);
+        }
+        first = 0;
+    }
+    odb_close(&odb);
+    free(commits);
+
+    // Without commits of its own the session just moves up to the branch
+    if (job->status == RESTACK_DONE && strcmp(onto, job->tip) == 0) {
+        job->status = RESTACK_CURRENT;
+    }
+    snprintf(job->new_tip, sizeof(job->new_tip), "%s", onto);
+}
+
+// restack [--all | <session>...]: the active session unless told otherwise
+void cmd_restack(int argc, char* argv[]) {
+    int all = argc > 0 && strcmp(argv[0], "--all") == 0;
+    if (all && argc > 1) {
+        usage();
+    }
+    if (batch_mode) {
+        fprintf(stderr, "Error: restack cannot run inside batch.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct session_list list = {0};
+    if (!file_exists(kaishaku_dir) || !load_session_list(root, kaishaku_dir, 1, &list) ||
+        list.count == 0) {
+        printf("%sNo kaishaku sessions exist.%s\n", COLOR_YELLOW, COLOR_RESET);
+        free(list.items);
+        return;
+    }
+    if (!verify_session_list(root, &list)) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+    }
+    if (argc == 0) {
+        size_t i = 0;
+        while (i < list.count && !list.items[i].active) {
+            i++;
+        }
+        if (i == list.count) {
+            fprintf(stderr, "Error: No active kaishaku session\n");
+            exit(EXIT_FAILURE);
+        }
+        list.items[0] = list.items[i];
+        list.count = 1;
+    } else if (!all) {
+        select_sessions(&list, argv, argc);
+    }
+
+    struct restack_job* jobs = calloc(list.count, sizeof(*jobs));
+    size_t count = 0;
+    int failed = 0;
+    if (!jobs) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < list.count; i++) {
+        const struct session_info* info = &list.items[i];
+        char tip[72];
+        session_tip(info, tip, sizeof(tip));
+        if (!tip[0] || !info->branch_oid[0] || strcmp(info->branch, "HEAD") == 0) {
+            printf("  %s%-20s%s %scommit or branch missing%s\n", COLOR_YELLOW, info->name,
+                   COLOR_RESET, COLOR_RED, COLOR_RESET);
+            failed = 1;
+            continue;
+        }
+        jobs[count].info = info;
+        snprintf(jobs[count].tip, sizeof(jobs[count].tip), "%s", tip);
+        count++;
+    }
+
+    parallel_for(count, 0, restack_session, jobs);
+
+    // New tips are committed first, all at once, each session with a journal record of
+    // its own that undo reverts together with the others. Only then does the active
+    // session's working tree follow; if that fails, its tip is put back.
+    struct journal_record* records = calloc(count + 1, sizeof(*records));
+    if (!records) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t moved = 0;
+    store_defer = 1;
+    for (size_t k = 0; k < count; k++) {
+        struct restack_job* job = &jobs[k];
+        if (job->status == RESTACK_DONE) {
+            journal_begin(&records[k], JOURNAL_RESTACK, job->info->name);
+            records[k].group = (uint32_t)getpid();
+            write_to_file(HEAD_FILE(job->info->name), job->new_tip);
+            update_timestamp(job->info->name);
+            moved++;
+        }
+    }
+    store_defer = 0;
+    if (moved && !store_flush()) {
+        fprintf(stderr, "Error: Failed to update session metadata.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t k = 0; k < count; k++) {
+        if (jobs[k].status == RESTACK_DONE && !jobs[k].info->active) {
+            journal_append(&records[k]);
+        }
+    }
+    for (size_t k = 0; k < count; k++) {
+        struct restack_job* job = &jobs[k];
+        if (job->status != RESTACK_DONE || !job->info->active) {
+            continue;
+        }
+        char cmd[DEFAULT_BUFFER_SIZE];
+        snprintf(cmd, sizeof(cmd), "git %s checkout %s --detach", checkout_options(),
+                 job->new_tip);
+        if (execute_git_command(cmd, NULL, 0)) {
+            journal_append(&records[k]);
+            continue;
+        }
+        fprintf(stderr, "Error: %s\n", error_message);
+        job->status = RESTACK_FAILED;
+        if (records[k].session_head[0] &&
+            !write_to_file(HEAD_FILE(job->info->name), records[k].session_head)) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(records);
+
+    for (size_t k = 0; k < count; k++) {
+        struct restack_job* job = &jobs[k];
+        printf("  %s%-20s%s ", COLOR_YELLOW, job->info->name, COLOR_RESET);
+        switch (job->status) {
+        case RESTACK_DONE:
+            printf("%srestacked onto %s (%zu commit(s)", COLOR_GREEN, job->info->branch,
+                   job->replayed);
+            if (job->dropped) {
+                printf(", %zu already there", job->dropped);
+            }
+            printf(")%s\n", COLOR_RESET);
+            break;
+        case RESTACK_CURRENT:
+            printf("already on %s\n", job->info->branch);
+            break;
+        case RESTACK_CONFLICT:
+            printf("%sconflicts with %s, left as it was%s\n", COLOR_RED, job->info->branch,
+                   COLOR_RESET);
+            strtok(job->conflicts, "\n");
+            for (char* path = strtok(NULL, "\n"); path; path = strtok(NULL, "\n")) {
+                printf("      %s\n", path);
+            }
+            failed = 1;
+            break;
+        case RESTACK_MERGES:
+            printf("%shas merge commits, left as it was%s\n", COLOR_YELLOW, COLOR_RESET);
+            failed = 1;
+            break;
+        default:
+            printf("%sfailed, left as it was%s\n", COLOR_RED, COLOR_RESET);
+            failed = 1;
+            break;
+        }
+        free(job->conflicts);
+    }
+    free(jobs);
+    free(list.items);
+
+    if (failed) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// kaishaku run-all: run a command in every session (or the named ones) at the same time,
+// each in a worktree of its own, so the user's working tree is never touched. Worktrees
+// are pooled in .git/kaishaku/.worktrees/<n> and kept for the next run, which then only
+// checks out the files that differ. At most one job per core runs at once, and a job does
+// not start while less memory is available than each job is allowed (--mem), unless
+// nothing else is running.
+#define RUN_ALL_WORKTREES ".worktrees"
+#define RUN_ALL_LOGS ".logs"
+
+struct run_all_job {
+    const struct session_info* info;
+    char tip[72];
+    char log[MAX_PATH_LENGTH];
+    int status;  // Exit status; -1 if the command did not run, -2 if the worktree failed
+    double seconds;
+};
+
+struct run_all {
+    struct run_all_job* jobs;
+    const char* command;
+    int* slot_busy;
+    int running;
+    long mem_mb;  // Memory to have available per job, 0 for no limit
+    pthread_mutex_t lock;
+};
+
+// .logs/<session>.log, with any byte of the name that is not safe in a file name written
+// as %XX, so names stay distinct and one with a '/' does not point into a missing directory
+static void run_all_log_path(char* out, size_t size, const char* logs, const char* name) {
+    char safe[DEFAULT_BUFFER_SIZE];
+    size_t n = 0;
+    for (const char* p = name; *p && n + 4 < sizeof(safe); p++) {
+        unsigned char c = (unsigned char)*p;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+            c == '-' || c == '_' || (c == '.' && p != name)) {
+            safe[n++] = (char)c;
+        } else {
+            n += snprintf(safe + n, sizeof(safe) - n, "%%%02X", c);
+        }
+    }
+    safe[n] = '\0';
+    snprintf(out, size, "%s/%s.log", logs, safe);
+}
+
+// MemAvailable in MiB, or -1 where /proc/meminfo does not say
+static long mem_available_mb(void) {
+    FILE* fp = fopen("/proc/meminfo", "r");
+    char line[DEFAULT_BUFFER_SIZE];
+    long kb = -1;
+    while (fp && kb < 0 && fgets(line, sizeof(line), fp)) {
+        sscanf(line, "MemAvailable: %ld kB", &kb);
+    }
+    if (fp) {
+        fclose(fp);
+    }
+    return kb < 0 ? -1 : kb / 1024;
+}
+
+// Point pooled worktree slot at commit, creating it the first time
+static int run_all_prepare(struct run_all* run, const char* path, const char* commit) {
+    char cmd[DEFAULT_BUFFER_SIZE * 2];
+    char* quoted = shell_quote(path);
+    char* git_file = safe_path_join(path, ".git");
+    int fresh = !file_exists(git_file);
+    free(git_file);
+
+    // Adding worktrees changes shared metadata, so one at a time
+    int ok = 1;
+    if (fresh) {
+        snprintf(cmd, sizeof(cmd), "git worktree add -q --detach --no-checkout %s %s", quoted,
+                 commit);
+        pthread_mutex_lock(&run->lock);
+        ok = execute_git_command(cmd, NULL, 0);
+        pthread_mutex_unlock(&run->lock);
+    }
+
+    char* out = NULL;
+    snprintf(cmd, sizeof(cmd),
+             "git -C %s %s checkout -q --detach --force %s && git -C %s clean -q -f -d -x",
+             quoted, checkout_options(), commit, quoted);
+    ok = ok && run_git_filter(cmd, "", 0, &out) == 0;
+    free(out);
+    free(quoted);
+    return ok;
+}
+
+static void run_all_job(size_t index, void* ctx) {
+    struct run_all* run = ctx;
+    struct run_all_job* job = &run->jobs[index];
+
+    pthread_mutex_lock(&run->lock);
+    long available;
+    while (run->running > 0 && run->mem_mb > 0 && (available = mem_available_mb()) >= 0 &&
+           available < run->mem_mb) {
+        pthread_mutex_unlock(&run->lock);
+        struct timespec pause = {0, 200 * 1000000L};
+        nanosleep(&pause, NULL);
+        pthread_mutex_lock(&run->lock);
+    }
+    int slot = 0;
+    while (run->slot_busy[slot]) {
+        slot++;
+    }
+    run->slot_busy[slot] = 1;
+    run->running++;
+    pthread_mutex_unlock(&run->lock);
+
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/" RUN_ALL_WORKTREES "/%d", kaishaku_dir, slot);
+    long start = monotonic_ms();
+    if (!run_all_prepare(run, path, job->tip)) {
+        job->status = -2;
+    } else {
+        // Everything the child needs is set up before fork(): another thread may hold the
+        // malloc or environment lock at that moment, so the child only makes
+        // async-signal-safe calls.
+        char session_var[DEFAULT_BUFFER_SIZE];
+        snprintf(session_var, sizeof(session_var), "KAISHAKU_SESSION=%s", job->info->name);
+        size_t env_count = 0;
+        while (environ[env_count]) {
+            env_count++;
+        }
+        char** envp = malloc((env_count + 2) * sizeof(*envp));
+        if (!envp) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        size_t n = 0;
+        for (size_t i = 0; i < env_count; i++) {
+            if (strncmp(environ[i], "KAISHAKU_SESSION=", 17) != 0) {
+                envp[n++] = environ[i];
+            }
+        }
+        envp[n++] = session_var;
+        envp[n] = NULL;
+
+        int log = open(job->log, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        int null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        pid_t pid = -1;
+        if (log == -1 || null == -1) {
+            fprintf(stderr, "Warning: Cannot write %s: %s\n", job->log, strerror(errno));
+        } else if ((pid = fork()) == 0) {
+            if (chdir(path) == -1) {
+                _exit(127);
+            }
+            dup2(null, STDIN_FILENO);
+            dup2(log, STDOUT_FILENO);
+            dup2(log, STDERR_FILENO);
+            close(null);
+            close(log);
+            execle("/bin/sh", "sh", "-c", run->command, (char*)NULL, envp);
+            _exit(127);
+        }
+        if (log != -1) {
+            close(log);
+        }
+        if (null != -1) {
+            close(null);
+        }
+        free(envp);
+
+        int status;
+        while (pid > 0 && waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+        }
+        job->status = pid > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+    job->seconds = (double)(monotonic_ms() - start) / 1000;
+
+    pthread_mutex_lock(&run->lock);
+    run->slot_busy[slot] = 0;
+    run->running--;
+    pthread_mutex_unlock(&run->lock);
+}
+
+// Remove the pooled worktrees
+static void run_all_clean(void) {
+    char* pool = safe_path_join(kaishaku_dir, RUN_ALL_WORKTREES);
+    DIR* dir = opendir(pool);
+    struct dirent* entry;
+    size_t removed = 0;
+    while (dir && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char path[MAX_PATH_LENGTH], cmd[DEFAULT_BUFFER_SIZE * 2];
+        snprintf(path, sizeof(path), "%s/%s", pool, entry->d_name);
+        char* quoted = shell_quote(path);
+        snprintf(cmd, sizeof(cmd), "git worktree remove --force %s", quoted);
+        free(quoted);
+        if (!execute_git_command(cmd, NULL, 0)) {
+            fprintf(stderr, "Warning: %s\n", error_message);
+            continue;
+        }
+        removed++;
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    execute_git_command("git worktree prune", NULL, 0);
+    free(pool);
+    printf("%sRemoved %zu worktree(s).%s\n", COLOR_GREEN, removed, COLOR_RESET);
+}
+
+void cmd_run_all(int argc, char* argv[]) {
+    int json = 0, jobs = online_cpus(), argi = 0;
+    long mem_mb = 512;
+    for (; argi < argc && strcmp(argv[argi], "--") != 0; argi++) {
+        if (strcmp(argv[argi], "--json") == 0) {
+            json = 1;
+        } else if (strcmp(argv[argi], "--jobs") == 0 && argi + 1 < argc) {
+            jobs = atoi(argv[++argi]);
+        } else if (strcmp(argv[argi], "--mem") == 0 && argi + 1 < argc) {
+            mem_mb = atol(argv[++argi]);
+        } else if (strcmp(argv[argi], "--clean") == 0 && argc == 1) {
+            run_all_clean();
+            return;
+        } else if (argv[argi][0] == '-') {
+            usage();
+        } else {
+            break;
+        }
+    }
+    int names = argi;
+    while (argi < argc && strcmp(argv[argi], "--") != 0) {
+        argi++;
+    }
+    if (argi + 1 >= argc || jobs < 1) {
+        usage();
+    }
+
+    // The command's words, each quoted for the shell
+    char* command = NULL;
+    size_t command_len = 0, command_cap = 0;
+    for (int k = argi + 1; k < argc; k++) {
+        char* quoted = shell_quote(argv[k]);
+        append_line(&command, &command_len, &command_cap, quoted);
+        command[command_len - 1] = ' ';
+        free(quoted);
+    }
+    command[command_len - 1] = '\0';
+
+    struct session_list list = {0};
+    if (!file_exists(kaishaku_dir) || !load_session_list(root, kaishaku_dir, 1, &list) ||
+        list.count == 0) {
+        printf("%sNo kaishaku sessions exist.%s\n", COLOR_YELLOW, COLOR_RESET);
+        free(list.items);
+        free(command);
+        return;
+    }
+    if (!verify_session_list(root, &list)) {
         fprintf(stderr, "Error: %s\n", error_message);
         exit(EXIT_FAILURE);
     }
+    select_sessions(&list, argv + names, argi - names);
+
+    // Two runs at once would share worktrees
+    char* pool = safe_path_join(kaishaku_dir, RUN_ALL_WORKTREES);
+    char* logs = safe_path_join(kaishaku_dir, RUN_ALL_LOGS);
+    ensure_directory_exists(pool);
+    ensure_directory_exists(logs);
+    char* lock_path = safe_path_join(pool, ".lock");
+    int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    free(lock_path);
+    if (lock == -1 || flock(lock, LOCK_EX) == -1) {
+        fprintf(stderr, "Error: Failed to lock the worktree pool: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct run_all run = {.command = command, .mem_mb = mem_mb};
+    run.jobs = calloc(list.count + 1, sizeof(*run.jobs));
+    run.slot_busy = calloc((size_t)jobs, sizeof(*run.slot_busy));
+    if (!run.jobs || !run.slot_busy) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        struct run_all_job* job = &run.jobs[count];
+        session_tip(&list.items[i], job->tip, sizeof(job->tip));
+        if (!job->tip[0]) {
+            fprintf(stderr, "%sWarning: Session '%s' has no commit; skipped.%s\n", COLOR_YELLOW,
+                    list.items[i].name, COLOR_RESET);
+            continue;
+        }
+        job->info = &list.items[i];
+        run_all_log_path(job->log, sizeof(job->log), logs, job->info->name);
+        count++;
+    }
+
+    if (!json) {
+        printf("%sRunning in %zu session(s), up to %d at a time: %s%s\n", COLOR_CYAN, count,
+               jobs, command, COLOR_RESET);
+        fflush(stdout);
+    }
+    pthread_mutex_init(&run.lock, NULL);
+    parallel_for(count, jobs, run_all_job, &run);
+    pthread_mutex_destroy(&run.lock);
+    close(lock);
+
+    size_t failed = 0;
+    if (json) {
+        printf("[");
+    }
+    for (size_t k = 0; k < count; k++) {
+        const struct run_all_job* job = &run.jobs[k];
+        failed += job->status != 0;
+        if (json) {
+            printf("%s{\"session\":", k ? "," : "");
+            json_print_string(stdout, job->info->name);
+            printf(",\"commit\":\"%s\",\"exit\":%d,\"seconds\":%.3f,\"log\":", job->tip,
+                   job->status, job->seconds);
+            json_print_string(stdout, job->log);
+            printf("}");
+            continue;
+        }
+
+        char status[32];
+        if (job->status == -2) {
+            snprintf(status, sizeof(status), "no worktree");
+        } else if (job->status == -1) {
+            snprintf(status, sizeof(status), "not run");
+        } else if (job->status) {
+            snprintf(status, sizeof(status), "exit %d", job->status);
+        } else {
+            snprintf(status, sizeof(status), "ok");
+        }
+        printf("  %s%-20s%s %s%-12s%s %8.1fs  %s\n", COLOR_YELLOW, job->info->name, COLOR_RESET,
+               job->status ? COLOR_RED : COLOR_GREEN, status, COLOR_RESET, job->seconds,
+               job->log);
+    }
+    if (json) {
+        printf("]\n");
+    } else {
+        printf("%s%zu of %zu session(s) succeeded.%s\n", failed ? COLOR_RED : COLOR_GREEN,
+               count - failed, count, COLOR_RESET);
+    }
+
+    free(run.jobs);
+    free(run.slot_busy);
+    free(pool);
+    free(logs);
+    free(command);
+    free(list.items);
+    if (failed) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+void cmd_config(int argc, char* argv[]) {
+    if (argc < 1) {
+        fprintf(stderr, "Error: Missing config command.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const char* cmd = argv[0];
+
+    if (strcmp(cmd, "get") == 0) {
+        if (argc < 2) {
+            fprintf(stderr, "Error: Missing config key.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        const char* key = argv[1];
+
+        if (strcmp(key, "confirm.exit") == 0) {
+            printf("%s%d%s\n", COLOR_WHITE, config.confirm_exit, COLOR_RESET);
+        } else if (strcmp(key, "auto.stash") == 0) {
+            printf("%s%d%s\n", COLOR_WHITE, config.auto_stash, COLOR_RESET);
+        } else if (strcmp(key, "auto.save") == 0) {
+            printf("%s%d%s\n", COLOR_WHITE, config.auto_save, COLOR_RESET);
+        } else if (strcmp(key, "prestage") == 0) {
+            printf("%s%d%s\n", COLOR_WHITE, config.prestage, COLOR_RESET);
+        } else if (strcmp(key, "gc.expire") == 0) {
+            printf("%s%d%s\n", COLOR_WHITE, config.gc_expire, COLOR_RESET);
+        } else {
+            fprintf(stderr, "Error: Unknown config key '%s'.\n", key);
+            exit(EXIT_FAILURE);
+        }
+    } else if (strcmp(cmd, "set") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Error: Missing config key or value.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        const char* key = argv[1];
+        const char* value = argv[2];
+
+        int bool_value = atoi(value);
+
+        if (strcmp(key, "confirm.exit") == 0) {
+            config.confirm_exit = bool_value;
+            printf("%sSet confirm.exit = %d%s\n", COLOR_GREEN, bool_value, COLOR_RESET);
+        } else if (strcmp(key, "auto.stash") == 0) {
+            config.auto_stash = bool_value;
+            printf("%sSet auto.stash = %d%s\n", COLOR_GREEN, bool_value, COLOR_RESET);
+        } else if (strcmp(key, "auto.save") == 0) {
+            config.auto_save = bool_value;
+            printf("%sSet auto.save = %d%s\n", COLOR_GREEN, bool_value, COLOR_RESET);
+        } else if (strcmp(key, "prestage") == 0) {
+            config.prestage = bool_value;
+            printf("%sSet prestage = %d%s\n", COLOR_GREEN, bool_value, COLOR_RESET);
+        } else if (strcmp(key, "gc.expire") == 0) {
+            config.gc_expire = bool_value;
+            printf("%sSet gc.expire = %d%s\n", COLOR_GREEN, bool_value, COLOR_RESET);
+        } else {
+            fprintf(stderr, "Error: Unknown config key '%s'.\n", key);
+            exit(EXIT_FAILURE);
+        }
+
+        // Save the config to Git config
+        char git_cmd[DEFAULT_BUFFER_SIZE];
+        snprintf(git_cmd, sizeof(git_cmd), "git config --local kaishaku.%s %d", key, bool_value);
+
+        if (!execute_git_command(git_cmd, NULL, 0)) {
+            fprintf(stderr, "Warning: Failed to save config: %s\n", error_message);
+            // Continue despite error
+        }
+    } else {
+        fprintf(stderr, "Error: Unknown config command '%s'.\n", cmd);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int config_value_true(const char* value) {
+    return strcmp(value, "false") != 0 && strcmp(value, "0") != 0 && strcmp(value, "no") != 0 &&
+           strcmp(value, "off") != 0;
+}
+
+void load_config(void) {
+    char git_cmd[DEFAULT_BUFFER_SIZE];
+
+    // Try to create kaishaku section in git config if it doesn't exist
+    if (!file_exists(kaishaku_dir)) {
+        ensure_directory_exists(kaishaku_dir);
+    }
+
+    // Read every kaishaku.* key, and whether this is a partial clone, with a single git call
+    int have_confirm_exit = 0, have_auto_stash = 0, have_auto_save = 0;
+    char* output =
+        capture_git_output("git config --get-regexp "
+                           "\"^(kaishaku\\.|remote\\..*\\.promisor$|core\\.sparsecheckout$|"
+                           "checkout\\.workers$|index\\.threads$)\"");
+    for (char* line = output ? strtok(output, "\n") : NULL; line; line = strtok(NULL, "\n")) {
+        char* value = strchr(line, ' ');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+
+        if (strcmp(line, "kaishaku.confirm.exit") == 0) {
+            config.confirm_exit = atoi(value);
+            have_confirm_exit = 1;
+        } else if (strcmp(line, "kaishaku.auto.stash") == 0) {
+            config.auto_stash = atoi(value);
+            have_auto_stash = 1;
+        } else if (strcmp(line, "kaishaku.auto.save") == 0) {
+            config.auto_save = atoi(value);
+            have_auto_save = 1;
+        } else if (strcmp(line, "kaishaku.prestage") == 0) {
+            config.prestage = atoi(value);
+        } else if (strcmp(line, "kaishaku.gc.expire") == 0) {
+            config.gc_expire = atoi(value);
+        } else if (strcmp(line, "kaishaku.checkout.workers") == 0) {
+            config.checkout_workers = atoi(value);
+        } else if (strcmp(line, "kaishaku.checkout.threshold") == 0) {
+            config.checkout_threshold = atoi(value);
+        } else if (strcmp(line, "kaishaku.index.threads") == 0) {
+            config.index_threads = atoi(value);
+        } else if (strcmp(line, "checkout.workers") == 0 || strcmp(line, "index.threads") == 0) {
+            config.own_checkout_tuning = 1;
+        } else if (strcmp(line, "core.sparsecheckout") == 0) {
+            config.sparse_checkout = config_value_true(value);
+        } else if (strncmp(line, "remote.", 7) == 0 && config_value_true(value)) {
+            snprintf(config.promisor_remote, sizeof(config.promisor_remote), "%.*s",
+                     (int)(strlen(line) - strlen("remote.") - strlen(".promisor")), line + 7);
+        }
+    }
+    free(output);
+
+    // Set default values if not configured
+    if (!have_confirm_exit) {
+        snprintf(git_cmd, sizeof(git_cmd), "git config --local kaishaku.confirm.exit %d",
+                 config.confirm_exit);
+        execute_git_command(git_cmd, NULL, 0);
+    }
+
+    if (!have_auto_stash) {
+        snprintf(git_cmd, sizeof(git_cmd), "git config --local kaishaku.auto.stash %d",
+                 config.auto_stash);
+        execute_git_command(git_cmd, NULL, 0);
+    }
+
+    if (!have_auto_save) {
+        snprintf(git_cmd, sizeof(git_cmd), "git config --local kaishaku.auto.save %d",
+                 config.auto_save);
+        execute_git_command(git_cmd, NULL, 0);
+    }
+}
+
+// A commit HEAD has been on (or a dangling one), as recover weighs it
+struct recover_commit {
+    char* oid;      // Points into the log output, like the fields below
+    char* parents;  // Space separated
+    char* subject;
+    long time;      // When HEAD got there; commit time for dangling commits
+    int session;    // Index into the session list, -1 if no session claims it
+    int has_child;  // A commit of the same session builds on it
+    int dangling;   // Found by fsck rather than in the reflog
+};
+
+// Span of time a session was the active one, from the journal
+struct recover_window {
+    size_t session;
+    long from, to;
+};
+
+static int compare_recover_commits(const void* a, const void* b) {
+    const struct recover_commit* x = a;
+    const struct recover_commit* y = b;
+    return (x->time > y->time) - (x->time < y->time);
+}
+
+static int find_session(const struct session_list* list, const char* name) {
+    for (size_t i = 0; i < list->count; i++) {
+        if (strcmp(list->items[i].name, name) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Turn the journal into active windows per session, and collect the commits each session
+// started from so descendants can be traced back to it.
+static void recover_read_journal(const struct session_list* list, struct recover_window** windows,
+                                 size_t* window_count, char** seeds, size_t* seeds_len,
+                                 size_t* seeds_cap) {
+    *windows = NULL;
+    *window_count = 0;
+
+    int fd = open(JOURNAL_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    size_t total = (size_t)st.st_size / JOURNAL_RECORD_SIZE;
+    struct journal_record rec;
+    int active = -1;
+    long since = 0;
+
+    for (size_t i = 0; i < total; i++) {
+        if (!journal_read(fd, i, &rec)) {
+            continue;
+        }
+
+        int session = find_session(list, rec.session);
+        if (rec.op == JOURNAL_CHECKOUT && session >= 0 && rec.head_after[0]) {
+            char seed[DEFAULT_BUFFER_SIZE];
+            snprintf(seed, sizeof(seed), "%d %s", session, rec.head_after);
+            append_line(seeds, seeds_len, seeds_cap, seed);
+        }
+
+        int next = rec.active_after[0] ? find_session(list, rec.active_after) : -1;
+        if (next == active) {
+            continue;
+        }
+        if (active >= 0) {
+            *windows = realloc(*windows, (*window_count + 1) * sizeof(**windows));
+            if (!*windows) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            (*windows)[(*window_count)++] =
+                (struct recover_window){(size_t)active, since, rec.time};
+        }
+        active = next;
+        since = rec.time;
+    }
+    close(fd);
+
+    if (active >= 0) {
+        *windows = realloc(*windows, (*window_count + 1) * sizeof(**windows));
+        if (!*windows) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        (*windows)[(*window_count)++] = (struct recover_window){(size_t)active, since, LONG_MAX};
+    }
+}
+
+// Split "oid<TAB>time<TAB>parents<TAB>subject" lines; the reflog gives the time as HEAD@{t}.
+static void recover_parse_log(char* out, int dangling, struct recover_commit** commits,
+                              size_t* count) {
+    for (char* line = strtok(out, "\n"); line; line = strtok(NULL, "\n")) {
+        char* fields[4] = {line, NULL, "", ""};
+        for (int f = 1; f < 4; f++) {
+            char* tab = strchr(fields[f - 1], '\t');
+            if (!tab) {
+                break;
+            }
+            *tab = '\0';
+            fields[f] = tab + 1;
+        }
+        if (!fields[1]) {
+            continue;
+        }
+
+        *commits = realloc(*commits, (*count + 1) * sizeof(**commits));
+        if (!*commits) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        const char* t = strchr(fields[1], '{');
+        (*commits)[(*count)++] = (struct recover_commit){
+            fields[0], fields[2], fields[3], atol(t ? t + 1 : fields[1]), -1, 0, dangling};
+    }
+}
+
+// One pass over HEAD's reflog (and with --deep, the dangling commits) for all sessions at
+// once. A reflog entry belongs to the session that was active when HEAD got there. Where
+// the journal cannot tell, and for dangling commits, a commit belongs to the session its
+// parent belongs to.
+static void recover_scan(int deep) {
+    struct session_list list = {0};
+    if (!file_exists(kaishaku_dir) || !load_session_list(root, kaishaku_dir, 1, &list) ||
+        list.count == 0) {
+        fprintf(stderr, "%sError: No kaishaku sessions exist.%s\n", COLOR_RED, COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+
+    char* seeds = NULL;
+    size_t seeds_len = 0, seeds_cap = 0;
+    struct recover_window* windows;
+    size_t window_count;
+    recover_read_journal(&list, &windows, &window_count, &seeds, &seeds_len, &seeds_cap);
+    for (size_t i = 0; i < list.count; i++) {
+        char seed[DEFAULT_BUFFER_SIZE];
+        if (list.items[i].head[0] && strcmp(list.items[i].head, "HEAD") != 0) {
+            snprintf(seed, sizeof(seed), "%zu %s", i, list.items[i].head);
+            append_line(&seeds, &seeds_len, &seeds_cap, seed);
+        }
+    }
+
+    struct recover_commit* commits = NULL;
+    size_t count = 0;
+    char* reflog = capture_git_output(
+        "git log -g --date=unix --format='%H%x09%gd%x09%P%x09%s' HEAD 2>/dev/null");
+    if (reflog) {
+        recover_parse_log(reflog, 0, &commits, &count);
+    }
+
+    char* dangling_log = NULL;
+    if (deep) {
+        char* fsck =
+            capture_git_output("git fsck --no-progress --no-reflogs --dangling 2>/dev/null");
+        char* oids = NULL;
+        size_t oids_len = 0, oids_cap = 0;
+        for (char* line = fsck ? strtok(fsck, "\n") : NULL; line; line = strtok(NULL, "\n")) {
+            if (strncmp(line, "dangling commit ", 16) == 0) {
+                append_line(&oids, &oids_len, &oids_cap, line + 16);
+            }
+        }
+        if (oids) {
+            run_git_filter("git log --no-walk=unsorted --stdin --format='%H%x09%ct%x09%P%x09%s'",
+                           oids, oids_len, &dangling_log);
+            if (dangling_log) {
+                recover_parse_log(dangling_log, 1, &commits, &count);
+            }
+        }
+        free(oids);
+        free(fsck);
+    }
+
+    // Oldest first, so parents are settled before their children; a commit HEAD visited
+    // several times counts from its first visit
+    qsort(commits, count, sizeof(*commits), compare_recover_commits);
+
+    struct oid_map map;
+    oid_map_init(&map, count + list.count * 2);
+    for (size_t i = 0; i < count; i++) {
+        size_t slot = oid_map_slot(&map, commits[i].oid, strlen(commits[i].oid));
+        if (!map.keys[slot]) {
+            map.keys[slot] = commits[i].oid;
+            map.values[slot] = i;
+        } else {
+            commits[i].oid = NULL;  // Seen earlier
+        }
+    }
+
+    // Session starts and recorded heads claim the commit for that session
+    int* seed_session = calloc(count + 1, sizeof(*seed_session));
+    if (!seed_session) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < count; i++) {
+        seed_session[i] = -1;
+    }
+    for (char* line = seeds ? strtok(seeds, "\n") : NULL; line; line = strtok(NULL, "\n")) {
+        char* oid = strchr(line, ' ');
+        if (!oid) {
+            continue;
+        }
+        oid++;
+        size_t slot = oid_map_slot(&map, oid, strlen(oid));
+        if (map.keys[slot] && seed_session[map.values[slot]] < 0) {
+            seed_session[map.values[slot]] = atoi(line);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        struct recover_commit* c = &commits[i];
+        if (!c->oid) {
+            continue;
+        }
+
+        for (size_t w = 0; w < window_count && c->session < 0; w++) {
+            if (c->time >= windows[w].from && c->time < windows[w].to) {
+                c->session = (int)windows[w].session;
+            }
+        }
+
+        // Entries on the original branch descend from the session start too; with a
+        // journal the window alone decides for them
+        if (!c->dangling && window_count > 0) {
+            continue;
+        }
+        if (c->session < 0) {
+            c->session = seed_session[i];
+        }
+
+        for (const char* p = c->parents; *p && c->session < 0;) {
+            size_t len = strcspn(p, " ");
+            size_t slot = oid_map_slot(&map, p, len);
+            if (map.keys[slot]) {
+                size_t parent = map.values[slot];
+                c->session = commits[parent].session >= 0 ? commits[parent].session
+                                                          : seed_session[parent];
+            }
+            p += len + (p[len] == ' ');
+        }
+    }
 
-    const char* session = read_from_file(ACTIVE_FILE);
-    if (!session) {
-        fprintf(stderr, "Error: Failed to read active session.\n");
-        exit(EXIT_FAILURE);
+    // Tips are the claimed commits no other commit of the same session builds on
+    for (size_t i = 0; i < count; i++) {
+        if (!commits[i].oid || commits[i].session < 0) {
+            continue;
+        }
+        for (const char* p = commits[i].parents; *p;) {
+            size_t len = strcspn(p, " ");
+            size_t slot = oid_map_slot(&map, p, len);
+            if (map.keys[slot] && commits[map.values[slot]].session == commits[i].session) {
+                commits[map.values[slot]].has_child = 1;
+            }
+            p += len + (p[len] == ' ');
+        }
     }
 
-    if (!write_to_file(HEAD_FILE(session), "HEAD")) {
-        exit(EXIT_FAILURE);
+    int found_any = 0;
+    for (size_t s = 0; s < list.count; s++) {
+        const struct session_info* info = &list.items[s];
+        int shown = 0;
+        for (size_t i = count; i > 0; i--) {
+            const struct recover_commit* c = &commits[i - 1];
+            if (!c->oid || c->session != (int)s || c->has_child) {
+                continue;
+            }
+            if (!shown++) {
+                printf("%s%s%s%s\n", COLOR_CYAN, info->name, info->active ? " (active)" : "",
+                       COLOR_RESET);
+            }
+            char time_str[64];
+            format_session_time(c->time, time_str, sizeof(time_str));
+            int current = strcmp(c->oid, info->head) == 0;
+            printf("  %s%.12s%s  %s  %s%s\n", current ? COLOR_GREEN : COLOR_YELLOW, c->oid,
+                   COLOR_RESET, time_str, c->subject, current ? " (recorded head)" : "");
+        }
+        found_any |= shown;
     }
 
-    printf("%sCreated branch '%s' from session '%s'%s\n", COLOR_GREEN, branch_name, session,
-           COLOR_RESET);
-}
+    if (found_any) {
+        printf("\nRun 'kaishaku recover <session> <commit>' to point a session at a commit.\n");
+    } else {
+        printf("%sNo lost session commits found%s.%s\n", COLOR_YELLOW,
+               deep ? "" : " in the reflog; try --deep", COLOR_RESET);
+    }
 
-void cmd_save(const char* branch_name) {
-    if (!branch_name)
-        usage();
+    oid_map_free(&map);
+    free(seed_session);
+    free(commits);
+    free(dangling_log);
+    free(reflog);
+    free(windows);
+    free(seeds);
+    free(list.items);
+}
 
-    if (!file_exists(ACTIVE_FILE)) {
-        fprintf(stderr, "Error: No active kaishaku session\n");
+// Point a session at a commit found by recover, and check it out if the session is active.
+static void recover_set_head(const char* session, const char* commit) {
+    if (!file_exists(SESSION_DIR(session))) {
+        fprintf(stderr, "%sError: Session '%s' not found.%s\n", COLOR_RED, session, COLOR_RESET);
         exit(EXIT_FAILURE);
     }
 
-    char* session = read_from_file(ACTIVE_FILE);
-    if (!session) {
-        fprintf(stderr, "Error: Failed to read active session\n");
+    char cmd[DEFAULT_BUFFER_SIZE];
+    char oid[JOURNAL_OID_SIZE];
+    snprintf(cmd, sizeof(cmd), "%s^{commit}", commit);
+    if (!git->resolve(cmd, oid, sizeof(oid))) {
+        fprintf(stderr, "%sError: '%s' is not a commit.%s\n", COLOR_RED, commit, COLOR_RESET);
         exit(EXIT_FAILURE);
     }
 
-    char* original_branch = read_from_file(SESSION_FILE(session));
-    if (!original_branch) {
-        fprintf(stderr, "Error: Original branch not found for session '%s'\n", session);
-        exit(EXIT_FAILURE);
+    const char* active = read_from_file(ACTIVE_FILE);
+    if (active && strcmp(active, session) == 0) {
+        snprintf(cmd, sizeof(cmd), "git %s checkout %s --detach", checkout_options(), oid);
+        if (!execute_git_command(cmd, NULL, 0)) {
+            fprintf(stderr, "%sError: Failed to checkout commit: %s%s\n", COLOR_RED,
+                    error_message, COLOR_RESET);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Create a temporary branch from current session
-    char cmd[DEFAULT_BUFFER_SIZE];
-    snprintf(cmd, sizeof(cmd), "git checkout -b %s", branch_name);
-    if (!execute_git_command(cmd, NULL, 0)) {
-        fprintf(stderr, "Error: Failed to create branch: %s\n", error_message);
+    if (!write_to_file(HEAD_FILE(session), oid)) {
         exit(EXIT_FAILURE);
     }
+    update_timestamp(session);
+    printf("%sSession '%s' now points at %s%s\n", COLOR_GREEN, session, oid, COLOR_RESET);
+}
 
-    // Switch back to original branch
-    snprintf(cmd, sizeof(cmd), "git checkout %s", original_branch);
-    if (!execute_git_command(cmd, NULL, 0)) {
-        fprintf(stderr, "Error: Failed to return to original branch: %s\n", error_message);
+void cmd_recover(const char* session, const char* commit) {
+    if (!session || strcmp(session, "--deep") == 0) {
+        recover_scan(session != NULL);
+        return;
+    }
+    if (commit) {
+        recover_set_head(session, commit);
+        return;
+    }
+
+    if (!file_exists(kaishaku_dir)) {
+        fprintf(stderr, "%sError: No kaishaku sessions exist.%s\n", COLOR_RED, COLOR_RESET);
         exit(EXIT_FAILURE);
     }
 
-    // Merge the temporary branch
-    snprintf(cmd, sizeof(cmd), "git merge %s", branch_name);
-    if (!execute_git_command(cmd, NULL, 0)) {
-        // If merge fails, clean up and exit
-        snprintf(cmd, sizeof(cmd), "git checkout %s", branch_name);
-        execute_git_command(cmd, NULL, 0);
-        snprintf(cmd, sizeof(cmd), "git branch -D %s", branch_name);
-        execute_git_command(cmd, NULL, 0);
-        fprintf(stderr, "Error: Failed to merge changes. Please resolve conflicts manually.\n");
+    char* session_dir = SESSION_DIR(session);
+    if (!file_exists(session_dir)) {
+        fprintf(stderr, "%sError: Session '%s' not found.%s\n", COLOR_RED, session, COLOR_RESET);
         exit(EXIT_FAILURE);
     }
 
-    // Delete the temporary branch
-    snprintf(cmd, sizeof(cmd), "git branch -D %s", branch_name);
-    if (!execute_git_command(cmd, NULL, 0)) {
-        fprintf(stderr, "Warning: Failed to delete temporary branch '%s'\n", branch_name);
+    // Check if session is already active
+    if (file_exists(ACTIVE_FILE)) {
+        const char* active_session = read_from_file(ACTIVE_FILE);
+        if (active_session && strcmp(active_session, session) == 0) {
+            fprintf(stderr, "%sError: Session '%s' is already active.%s\n", COLOR_RED, session,
+                    COLOR_RESET);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    write_to_file(HEAD_FILE(session), "HEAD");
-    update_timestamp(session);  // Update timestamp when saving changes
-    printf("%sSuccessfully saved changes from session '%s' to branch '%s'%s\n", COLOR_GREEN,
-           session, original_branch, COLOR_RESET);
-}
+    // Verify session files
+    char* session_file = SESSION_FILE(session);
+    char* head_file = HEAD_FILE(session);
 
-void cmd_exit(const char* option) {
-    if (!file_exists(ACTIVE_FILE)) {
-        fprintf(stderr, "Error: No active kaishaku session.\n");
+    if (!file_exists(session_file) || !file_exists(head_file)) {
+        fprintf(stderr, "%sError: Session '%s' is corrupted. Missing required files.%s\n",
+                COLOR_RED, session, COLOR_RESET);
         exit(EXIT_FAILURE);
     }
 
-    const char* session = read_from_file(ACTIVE_FILE);
-    if (!session) {
-        fprintf(stderr, "Error: Failed to read active session.\n");
-        exit(EXIT_FAILURE);
-    }
+    const char* original_branch = read_from_file(session_file);
+    const char* head = read_from_file(head_file);
 
-    const char* original_branch = read_from_file(SESSION_FILE(session));
-    if (!original_branch) {
-        fprintf(stderr, "Error: Original branch not found for session '%s'\n", session);
+    // Make sure the commit is still there before touching anything
+    struct odb odb;
+    odb_open(&odb, root);
+    int found = head ? odb_has_object(&odb, head) : 0;
+    odb_close(&odb);
+    if (found == 0) {
+        fprintf(stderr,
+                "%sError: Commit %s of session '%s' no longer exists. Run 'kaishaku recover' "
+                "to look for it.%s\n",
+                COLOR_RED, head ? head : "(none)", session, COLOR_RESET);
         exit(EXIT_FAILURE);
     }
 
-    int force = option && strcmp(option, "--force") == 0;
-    int keep = option && strcmp(option, "--keep") == 0;
-    int save = option && strcmp(option, "--save") == 0;
-    int no_save = option && strcmp(option, "--no-save") == 0;
+    // Verify original branch exists
+    char branch_oid[DEFAULT_BUFFER_SIZE];
+    if (!git->resolve(original_branch, branch_oid, sizeof(branch_oid))) {
+        fprintf(stderr, "%sWarning: Original branch '%s' not found. Creating new branch.%s\n",
+                COLOR_YELLOW, original_branch, COLOR_RESET);
 
-    // Check if we should automatically save changes
-    if (config.auto_save && !no_save) {
-        save = 1;
+        // Create new branch from current HEAD
+        char create_branch[DEFAULT_BUFFER_SIZE];
+        snprintf(create_branch, sizeof(create_branch), "git checkout -b %s", original_branch);
+        if (!execute_git_command(create_branch, NULL, 0)) {
+            fprintf(stderr, "%sError: Failed to create branch '%s'.%s\n", COLOR_RED,
+                    original_branch, COLOR_RESET);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Check if we should automatically stash changes (only if not saving)
-    if (config.auto_stash && !save && !force) {
-        keep = 1;
+    // Switch to the session
+    if (!write_to_file(ACTIVE_FILE, session)) {
+        fprintf(stderr, "%sError: Failed to activate session.%s\n", COLOR_RED, COLOR_RESET);
+        exit(EXIT_FAILURE);
     }
-
-    // Check if there are actually any changes
-    int has_changes = 0;
-    char changes_output[DEFAULT_BUFFER_SIZE] = "";
-    if (execute_git_command("git status --porcelain", changes_output, sizeof(changes_output))) {
-        has_changes = changes_output[0] != '\0';
+    if (!checkout_session_tree(session, head)) {
+        fprintf(stderr, "%sError: Failed to checkout commit: %s%s\n", COLOR_RED, error_message,
+                COLOR_RESET);
+        exit(EXIT_FAILURE);
     }
 
-    // Confirm before discarding changes if needed
-    if (!force && !keep && !save && config.confirm_exit && has_changes) {
-        printf("Discard uncommitted changes and exit? (y/N): ");
-        char c = getchar();
-        if (c != 'y' && c != 'Y') {
-            puts("Aborted.");
-            exit(0);
-        }
-    }
+    printf("%sRecovered session '%s'%s\n", COLOR_GREEN, session, COLOR_RESET);
+}
 
-    // Handle changes based on configuration and options
-    if (has_changes) {
-        if (save) {
-            // Save changes before exiting
-            char commit_msg[DEFAULT_BUFFER_SIZE];
-            snprintf(commit_msg, sizeof(commit_msg), "[kaishaku] Save changes from session '%s'",
-                     session);
+void cmd_rename(const char* old_name, const char* new_name) {
+    if (!old_name || !new_name)
+        usage();
 
-            char commit_cmd[DEFAULT_BUFFER_SIZE + 19];
-            snprintf(commit_cmd, sizeof(commit_cmd), "git commit -m \"%s\"", commit_msg);
+    if (!file_exists(kaishaku_dir)) {
+        fprintf(stderr, "%sError: No kaishaku sessions exist.%s\n", COLOR_RED, COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
 
-            if (!execute_git_command(commit_cmd, NULL, 0)) {
-                fprintf(stderr, "Error: Failed to save changes: %s\n", error_message);
-                exit(EXIT_FAILURE);
-            }
-            printf("%sChanges saved successfully.%s\n", COLOR_GREEN, COLOR_RESET);
-        } else if (keep) {
-            // Save the current stash before exiting
-            char stash_msg[DEFAULT_BUFFER_SIZE];
-            snprintf(stash_msg, sizeof(stash_msg), "kaishaku: auto-stash from session '%s'",
-                     session);
+    char* old_dir = SESSION_DIR(old_name);
+    char* new_dir = SESSION_DIR(new_name);
 
-            char stash_cmd[DEFAULT_BUFFER_SIZE + 23];
-            snprintf(stash_cmd, sizeof(stash_cmd), "git stash push -m \"%s\"", stash_msg);
+    if (!file_exists(old_dir)) {
+        fprintf(stderr, "%sError: Session '%s' not found.%s\n", COLOR_RED, old_name, COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
 
-            if (!execute_git_command(stash_cmd, NULL, 0)) {
-                fprintf(stderr, "Warning: %s\n", error_message);
-                fprintf(stderr, "Continuing without stashing changes.\n");
-                // Continue despite error
-            } else {
-                printf(
-                    "%sChanges stashed successfully. Use 'git stash list' to see your stashes.%s\n",
-                    COLOR_GREEN, COLOR_RESET);
-            }
-        } else {
-            if (!execute_git_command("git reset --hard", NULL, 0)) {
-                fprintf(stderr, "Error: %s\n", error_message);
-                exit(EXIT_FAILURE);
-            }
-            printf("%sChanges discarded.%s\n", COLOR_YELLOW, COLOR_RESET);
+    if (file_exists(new_dir)) {
+        fprintf(stderr, "%sError: Session '%s' already exists.%s\n", COLOR_RED, new_name,
+                COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+    check_session_name(new_name);
+
+    // Check if old session is active
+    if (file_exists(ACTIVE_FILE)) {
+        const char* active_session = read_from_file(ACTIVE_FILE);
+        if (active_session && strcmp(active_session, old_name) == 0) {
+            fprintf(stderr, "%sError: Cannot rename active session. Exit the session first.%s\n",
+                    COLOR_RED, COLOR_RESET);
+            exit(EXIT_FAILURE);
         }
-    } else if (keep || save) {
-        printf("%sNo changes to save or stash.%s\n", COLOR_YELLOW, COLOR_RESET);
     }
 
-    // Return to original branch
-    char git_cmd[DEFAULT_BUFFER_SIZE];
-    snprintf(git_cmd, sizeof(git_cmd), "git checkout %s", original_branch);
+    // The snapshot ref moves with the session, as one create and delete pair
+    char old_ref[DEFAULT_BUFFER_SIZE], new_ref[DEFAULT_BUFFER_SIZE];
+    char wip[DEFAULT_BUFFER_SIZE];
+    snprintf(old_ref, sizeof(old_ref), WIP_REF_PREFIX "%s", old_name);
+    snprintf(new_ref, sizeof(new_ref), WIP_REF_PREFIX "%s", new_name);
+    if (git->resolve(old_ref, wip, sizeof(wip))) {
+        ref_queue("create", new_ref, wip, NULL);
+        ref_queue("delete", old_ref, wip, NULL);
+    }
+    if (!ref_commit("kaishaku: rename")) {
+        exit(EXIT_FAILURE);
+    }
 
-    if (!execute_git_command(git_cmd, NULL, 0)) {
-        fprintf(stderr, "Error: %s\n", error_message);
+    // Rename the directory
+    if (rename_dir(old_dir, new_dir) == -1) {
+        fprintf(stderr, "%sError: Failed to rename session: %s%s\n", COLOR_RED, strerror(errno),
+                COLOR_RESET);
         exit(EXIT_FAILURE);
     }
 
-    unlink(ACTIVE_FILE);
-    printf("%sReturned to branch '%s' from session '%s'%s\n", COLOR_GREEN, original_branch, session,
-           COLOR_RESET);
+    printf("%sRenamed session '%s' to '%s'%s\n", COLOR_GREEN, old_name, new_name, COLOR_RESET);
 }
 
-void cmd_status(void) {
-    if (!file_exists(ACTIVE_FILE)) {
-        printf("%sNo active kaishaku session.%s\n", COLOR_YELLOW, COLOR_RESET);
-        return;
+void cmd_abort(const char* session) {
+    if (!file_exists(kaishaku_dir)) {
+        fprintf(stderr, "%sError: No kaishaku sessions exist.%s\n", COLOR_RED, COLOR_RESET);
+        exit(EXIT_FAILURE);
     }
 
-    const char* session = read_from_file(ACTIVE_FILE);
+    // If no session specified, abort current session
     if (!session) {
-        fprintf(stderr, "Error: Failed to read active session.\n");
-        return;
+        if (!file_exists(ACTIVE_FILE)) {
+            fprintf(stderr, "%sError: No active session to abort.%s\n", COLOR_RED, COLOR_RESET);
+            exit(EXIT_FAILURE);
+        }
+        session = read_from_file(ACTIVE_FILE);
+        if (!session) {
+            fprintf(stderr, "%sError: Failed to read active session.%s\n", COLOR_RED, COLOR_RESET);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    const char* original_branch = read_from_file(SESSION_FILE(session));
-    const char* head = read_from_file(HEAD_FILE(session));
-
-    printf("%sActive session:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE, session);
-    printf("  %sOriginal branch:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
-           original_branch ? original_branch : "(unknown)");
-    printf("  %sSession HEAD:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
-           head ? head : "(unknown)");
+    char* session_dir = SESSION_DIR(session);
+    if (!file_exists(session_dir)) {
+        fprintf(stderr, "%sError: Session '%s' not found.%s\n", COLOR_RED, session, COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
 
-    printf("\n%sCurrent HEAD:%s\n", COLOR_CYAN, COLOR_RESET);
-    if (system("git log --oneline -1") > -1) {
-        printf("\n%sUncommitted changes:%s\n", COLOR_CYAN, COLOR_RESET);
+    struct journal_record rec;
+    journal_begin(&rec, JOURNAL_ABORT, session);
 
-        if (system("git status --short") > -1) {
-            printf("\n%sConfiguration:%s\n", COLOR_CYAN, COLOR_RESET);
-            printf("  %sconfirm_exit:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
-                   config.confirm_exit ? "yes" : "no");
-            printf("  %sauto_stash:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
-                   config.auto_stash ? "yes" : "no");
-            printf("  %sauto_save:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
-                   config.auto_save ? "yes" : "no");
+    // If this is the active session, return to original branch
+    if (file_exists(ACTIVE_FILE)) {
+        const char* active_session = read_from_file(ACTIVE_FILE);
+        if (active_session && strcmp(active_session, session) == 0) {
+            const char* original_branch = read_from_file(SESSION_FILE(session));
+            if (original_branch) {
+                char git_cmd[DEFAULT_BUFFER_SIZE];
+                snprintf(git_cmd, sizeof(git_cmd), "git %s checkout %s", checkout_options(),
+                         original_branch);
+                if (!execute_git_command(git_cmd, NULL, 0)) {
+                    fprintf(stderr, "%sError: Failed to return to original branch: %s%s\n",
+                            COLOR_RED, error_message, COLOR_RESET);
+                    exit(EXIT_FAILURE);
+                }
+                restore_sparse_state();
+                remove_file(ACTIVE_FILE);
+            }
         }
     }
+
+    // Clean up session files
+    remove_session(session);
+    remove_dir(session_dir);
+
+    journal_append(&rec);
+    printf("%sAborted session '%s'%s\n", COLOR_GREEN, session, COLOR_RESET);
 }
 
-void cmd_list(void) {
-    DIR* dir;
-    struct dirent* entry;
+// Put the repository and session files back the way they were before rec's operation.
+static void journal_undo(const struct journal_record* r) {
+    struct journal_record undo;
+    journal_begin(&undo, JOURNAL_UNDO, r->session[0] ? r->session : NULL);
 
-    if (!file_exists(kaishaku_dir)) {
-        printf("%sNo kaishaku sessions exist.%s\n", COLOR_YELLOW, COLOR_RESET);
-        return;
+    if (strcmp(undo.head_before, r->head_after) != 0 ||
+        strcmp(undo.branch_before, r->branch_after) != 0) {
+        fprintf(stderr, "%sWarning: HEAD moved since the %s; restoring it anyway.%s\n",
+                COLOR_YELLOW, journal_op_names[r->op], COLOR_RESET);
     }
 
-    dir = opendir(kaishaku_dir);
-    if (!dir) {
-        fprintf(stderr, "%sError: Failed to open sessions directory: %s%s\n", COLOR_RED,
-                strerror(errno), COLOR_RESET);
+    // HEAD first, while the branches are still where the operation left them
+    if (r->active_before[0] && file_exists(SESSION_DIR(r->active_before))) {
+        sync_session_sparse(r->active_before);
+    }
+
+    char cmd[DEFAULT_BUFFER_SIZE];
+    if (r->branch_before[0]) {
+        snprintf(cmd, sizeof(cmd), "git %s checkout %s", checkout_options(), r->branch_before);
+    } else {
+        snprintf(cmd, sizeof(cmd), "git %s checkout --detach %s", checkout_options(),
+                 r->head_before);
+    }
+    if (!execute_git_command(cmd, NULL, 0)) {
+        fprintf(stderr, "Error: %s\n", error_message);
         exit(EXIT_FAILURE);
     }
 
-    // Read active session first
-    char active_session[DEFAULT_BUFFER_SIZE] = "";
-    if (file_exists(ACTIVE_FILE)) {
-        const char* session = read_from_file(ACTIVE_FILE);
-        if (session) {
-            // strncpy(active_session, session, sizeof(active_session) - 1);
-            snprintf(active_session, sizeof(active_session), "%s", session);
+    if (!r->active_before[0]) {
+        restore_sparse_state();
+    }
 
-            //  active_session[sizeof(active_session) - 1] = '\0';
+    if (r->ref_name[0] && r->ref_before[0] && r->ref_after[0]) {
+        snprintf(cmd, sizeof(cmd), "kaishaku: undo %s", journal_op_names[r->op]);
+        if (!git->update_ref(r->ref_name, r->ref_before, r->ref_after, cmd)) {
+            fprintf(stderr, "%sWarning: '%s' moved since the %s; left as is.%s\n", COLOR_YELLOW,
+                    r->ref_name, journal_op_names[r->op], COLOR_RESET);
         }
     }
 
-    int found = 0;
-    printf("%skaishaku sessions:%s\n", COLOR_CYAN, COLOR_RESET);
-
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip dotfiles and the active session marker
-        if (entry->d_name[0] == '.' || strcmp(entry->d_name, ".active") == 0) {
-            continue;
+    if (r->wip[0]) {
+        snprintf(cmd, sizeof(cmd), "git stash apply %s", r->wip);
+        if (!execute_git_command(cmd, NULL, 0)) {
+            fprintf(stderr, "%sWarning: Could not reapply discarded changes; they are in %s%s\n",
+                    COLOR_YELLOW, r->wip, COLOR_RESET);
         }
+    } else if (r->watch_wip[0] && r->op == JOURNAL_EXIT) {
+        printf("%sThe last watch snapshot of the session is %s%s\n", COLOR_CYAN, r->watch_wip,
+               COLOR_RESET);
+    }
 
-        // Check if this is a directory and has session file
-        char* session_file = SESSION_FILE(entry->d_name);
-        char* head_file = HEAD_FILE(entry->d_name);
-
-        if (!file_exists(session_file) || !file_exists(head_file)) {
-            // Skip corrupted sessions but warn about them
-            fprintf(stderr,
-                    "%sWarning: Session '%s' appears to be corrupted. Use 'recover' to fix.%s\n",
-                    COLOR_YELLOW, entry->d_name, COLOR_RESET);
-            continue;
-        }
+    if (r->had_session) {
+        ensure_directory_exists(SESSION_DIR(r->session));
+        write_to_file(SESSION_FILE(r->session), r->session_branch);
+        write_to_file(HEAD_FILE(r->session), r->session_head);
+    } else if (r->op == JOURNAL_CHECKOUT) {
+        remove_session(r->session);
+        remove_dir(SESSION_DIR(r->session));
+    }
 
-        const char* original_branch = read_from_file(session_file);
-        const char* head = read_from_file(head_file);
+    if (r->active_before[0]) {
+        write_to_file(ACTIVE_FILE, r->active_before);
+    } else {
+        remove_file(ACTIVE_FILE);
+    }
 
-        // Verify branch and commit still exist
-        char branch_check[DEFAULT_BUFFER_SIZE];
-        char commit_check[DEFAULT_BUFFER_SIZE];
-        int branch_exists = 1;
-        int commit_exists = 1;
+    journal_append(&undo);
+    printf("%sUndid %s of session '%s'%s\n", COLOR_GREEN, journal_op_names[r->op], r->session,
+           COLOR_RESET);
+}
 
-        if (original_branch) {
-            snprintf(branch_check, sizeof(branch_check), "git rev-parse --verify %s",
-                     original_branch);
-            branch_exists = execute_git_command(branch_check, NULL, 0);
-        }
+void cmd_undo(int argc, char* argv[]) {
+    int list = 0;
+    long count = -1;
 
-        if (head) {
-            snprintf(commit_check, sizeof(commit_check), "git rev-parse --verify %s", head);
-            commit_exists = execute_git_command(commit_check, NULL, 0);
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--list") == 0) {
+            list = 1;
+        } else if (argv[i][0] >= '1' && argv[i][0] <= '9') {
+            count = atol(argv[i]);
+        } else {
+            fprintf(stderr, "Error: Unknown undo option '%s'.\n", argv[i]);
+            exit(EXIT_FAILURE);
         }
+    }
+    if (count < 0) {
+        count = list ? 20 : 1;
+    }
 
-        // Check if this is the active session
-        int is_active = (active_session[0] != '\0' && strcmp(active_session, entry->d_name) == 0);
+    int fd = open(JOURNAL_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Error: Nothing to undo.\n");
+        exit(EXIT_FAILURE);
+    }
 
-        // Print session info with status indicators
-        printf("  %s%s%s%s\n", is_active ? COLOR_GREEN : "", is_active ? "* " : "  ", COLOR_YELLOW,
-               entry->d_name);
+    struct stat st;
+    fstat(fd, &st);
+    size_t total = (size_t)st.st_size / JOURNAL_RECORD_SIZE;  // Ignore a torn last record
+    struct journal_record rec;
+
+    if (list) {
+        // Newest first; operations already undone are marked with a '-'
+        size_t skip = 0;
+        for (size_t i = total; i > 0 && count > 0; i--) {
+            if (!journal_read(fd, i - 1, &rec)) {
+                continue;
+            }
+            int undone = 0;
+            if (rec.op == JOURNAL_UNDO) {
+                skip++;
+            } else if (skip > 0) {
+                skip--;
+                undone = 1;
+            }
 
-        printf("    %sLast modified:%s %s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
-               get_session_time(entry->d_name));
+            char time_str[64];
+            format_session_time((long)rec.time, time_str, sizeof(time_str));
+            printf("%s%c %s  %-8s %-20s %.12s -> %.12s%s\n", undone ? COLOR_YELLOW : "",
+                   undone ? '-' : ' ', time_str, journal_op_names[rec.op], rec.session,
+                   rec.head_before, rec.head_after, undone ? COLOR_RESET : "");
+            count--;
+        }
+        close(fd);
+        return;
+    }
 
-        printf("    %sOriginal branch:%s %s%s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
-               original_branch ? original_branch : "(unknown)", !branch_exists ? " (missing)" : "");
+    // Each undo is itself journaled, so skip one older operation per undo record met
+    while (count-- > 0) {
+        size_t skip = 0, i = total;
+        int found = 0;
+        while (i > 0 && !found) {
+            if (!journal_read(fd, --i, &rec)) {
+                continue;
+            }
+            if (rec.op == JOURNAL_UNDO) {
+                skip++;
+            } else if (skip > 0) {
+                skip--;
+            } else {
+                found = 1;
+            }
+        }
+        if (!found) {
+            close(fd);
+            fprintf(stderr, "Error: Nothing to undo.\n");
+            exit(EXIT_FAILURE);
+        }
 
-        printf("    %sSession HEAD:%s %s%s%s\n", COLOR_CYAN, COLOR_RESET, COLOR_WHITE,
-               head ? head : "(unknown)", !commit_exists ? " (missing)" : "");
+        journal_undo(&rec);
+        total++;
 
-        // Add warning for corrupted sessions
-        if (!branch_exists || !commit_exists) {
-            printf("    %sWarning: Session may be corrupted. Use 'recover' to fix.%s\n",
-                   COLOR_YELLOW, COLOR_RESET);
+        // The other sessions of the same operation go back with it
+        struct journal_record prev;
+        while (rec.group && i > 0 && journal_read(fd, i - 1, &prev) && prev.op == rec.op &&
+               prev.group == rec.group) {
+            journal_undo(&prev);
+            total++;
+            i--;
         }
+    }
+    close(fd);
+}
 
-        found = 1;
+void cmd_sparse(int argc, char* argv[]) {
+    const char* session = read_from_file(ACTIVE_FILE);
+    if (!session) {
+        fprintf(stderr, "Error: No active kaishaku session.\n");
+        exit(EXIT_FAILURE);
     }
 
-    closedir(dir);
+    char* sparse_file = SESSION_SPARSE_FILE(session);
+    const char* current = read_all_from_file(sparse_file);
 
-    if (!found) {
-        printf("%sNo kaishaku sessions exist.%s\n", COLOR_YELLOW, COLOR_RESET);
+    if (argc == 0 || strcmp(argv[0], "list") == 0) {
+        if (current && current[0]) {
+            printf("%s\n", current);
+        } else {
+            printf("%sSession '%s' has the full tree.%s\n", COLOR_YELLOW, session, COLOR_RESET);
+        }
+        return;
     }
-}
 
-void cmd_clean(const char* session) {
-    if (!file_exists(kaishaku_dir)) {
-        printf("%sNo kaishaku sessions exist.%s\n", COLOR_YELLOW, COLOR_RESET);
+    if (strcmp(argv[0], "disable") == 0) {
+        remove_file(sparse_file);
+        restore_sparse_state();
+        printf("%sSession '%s' now has the full tree.%s\n", COLOR_GREEN, session, COLOR_RESET);
         return;
     }
 
-    // If active session exists and trying to clean it, error out
-    if (file_exists(ACTIVE_FILE)) {
-        const char* active_session = read_from_file(ACTIVE_FILE);
-        if (active_session && (!session || strcmp(session, active_session) == 0)) {
-            fprintf(stderr, "Error: Cannot clean active session '%s'. Exit the session first.\n",
-                    active_session);
-            exit(EXIT_FAILURE);
-        }
+    int add = strcmp(argv[0], "add") == 0;
+    if ((!add && strcmp(argv[0], "set") != 0) || argc < 2) {
+        usage();
     }
 
-    if (session) {
-        // Clean specific session
-        char* session_dir = SESSION_DIR(session);
-        if (!file_exists(session_dir)) {
-            fprintf(stderr, "Error: Session '%s' not found.\n", session);
-            exit(EXIT_FAILURE);
-        }
+    char* cones = NULL;
+    size_t len = 0, cap = 0;
+    if (add && current && current[0]) {
+        append_line(&cones, &len, &cap, current);
+    }
+    for (int i = 1; i < argc; i++) {
+        append_line(&cones, &len, &cap, argv[i]);
+    }
+    cones[len - 1] = '\0';
 
-        char* session_file = SESSION_FILE(session);
-        char* head_file = HEAD_FILE(session);
+    if (!apply_sparse_cones(cones) || !write_to_file(sparse_file, cones)) {
+        exit(EXIT_FAILURE);
+    }
+    free(cones);
+    printf("%sUpdated the sparse cone of session '%s'.%s\n", COLOR_GREEN, session, COLOR_RESET);
+}
 
-        if (unlink(session_file) == -1 || unlink(head_file) == -1) {
-            fprintf(stderr, "Error: Failed to remove session files: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
+// Split one batch line into words. Single and double quotes group words; the line is
+// modified in place.
+static int split_batch_line(char* line, char* argv[], int max_args) {
+    int argc = 0;
+    char* p = line;
 
-        if (rmdir(session_dir) == -1) {
-            fprintf(stderr, "Error: Failed to remove session directory: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+            p++;
         }
-
-        printf("%sSession '%s' cleaned.%s\n", COLOR_GREEN, session, COLOR_RESET);
-    } else {
-        // Clean all sessions
-        DIR* dir;
-        struct dirent* entry;
-
-        dir = opendir(kaishaku_dir);
-        if (!dir) {
-            fprintf(stderr, "Error: Failed to open sessions directory: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
+        if (!*p) {
+            break;
+        }
+        if (argc == max_args) {
+            return -1;
         }
 
-        int cleaned = 0;
-
-        while ((entry = readdir(dir)) != NULL) {
-            // Skip dotfiles and the active session marker
-            if (entry->d_name[0] == '.' || strcmp(entry->d_name, ".active") == 0) {
-                continue;
+        char* out = p;
+        argv[argc++] = out;
+        char quote = 0;
+        while (*p && (quote || (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'))) {
+            if (!quote && (*p == '\'' || *p == '"')) {
+                quote = *p++;
+            } else if (quote && *p == quote) {
+                quote = 0;
+                p++;
+            } else {
+                *out++ = *p++;
             }
+        }
+        if (*p) {
+            p++;
+        }
+        *out = '\0';
+    }
 
-            // Check if this is a directory and has session file
-            char* session_dir = SESSION_DIR(entry->d_name);
-            if (!file_exists(session_dir)) {
-                continue;
-            }
+    return argc;
+}
 
-            // Check if it's the active session
-            if (file_exists(ACTIVE_FILE)) {
-                const char* active_session = read_from_file(ACTIVE_FILE);
-                if (active_session && strcmp(active_session, entry->d_name) == 0) {
-                    continue;
-                }
-            }
+// Take everything a capture file collected and empty it for the next command.
+static char* drain_capture(FILE* fp) {
+    long len = lseek(fileno(fp), 0, SEEK_END);
+    char* data = malloc(len > 0 ? (size_t)len + 1 : 1);
+    if (!data) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
 
-            char* session_file = SESSION_FILE(entry->d_name);
-            char* head_file = HEAD_FILE(entry->d_name);
+    ssize_t n = len > 0 ? pread(fileno(fp), data, (size_t)len, 0) : 0;
+    data[n > 0 ? n : 0] = '\0';
 
-            unlink(session_file);
-            unlink(head_file);
-            rmdir(session_dir);
+    if (ftruncate(fileno(fp), 0) == -1 || lseek(fileno(fp), 0, SEEK_SET) == -1) {
+        perror("ftruncate");
+    }
+    return data;
+}
 
-            cleaned++;
-        }
+// Run one batch command; words[0] is free for the program name.
+static int run_batch_command(int nwords, char* words[]) {
+    int jumped = setjmp(batch_env);
+    if (jumped) {
+        return jumped - 1;
+    }
 
-        closedir(dir);
+    if (nwords < 0) {
+        fprintf(stderr, "Error: Too many arguments.\n");
+        return EXIT_FAILURE;
+    }
 
-        printf("%s%d session(s) cleaned.%s\n", COLOR_GREEN, cleaned, COLOR_RESET);
+    words[0] = "kaishaku";
+    words[nwords + 1] = NULL;
+    int status = run_command(nwords + 1, words);
+    if (status == -1) {
+        fprintf(stderr, "Unknown command: %s\n", words[1]);
+        return EXIT_FAILURE;
     }
+    return status;
 }
 
-void cmd_config(int argc, char* argv[]) {
-    if (argc < 1) {
-        fprintf(stderr, "Error: Missing config command.\n");
+void cmd_batch(int argc, char* argv[]) {
+    if (batch_mode) {
+        fprintf(stderr, "Error: batch cannot be nested.\n");
         exit(EXIT_FAILURE);
     }
 
-    const char* cmd = argv[0];
+    // Commands are newline-delimited by default, NUL-delimited with -z
+    int delim = '\n';
+    if (argc >= 1 && strcmp(argv[0], "-z") == 0) {
+        delim = '\0';
+    } else if (argc >= 1) {
+        fprintf(stderr, "Error: Unknown batch option '%s'.\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
 
-    if (strcmp(cmd, "get") == 0) {
-        if (argc < 2) {
-            fprintf(stderr, "Error: Missing config key.\n");
-            exit(EXIT_FAILURE);
-        }
+    // Each command's output, git's included, is collected here and reported as one record
+    FILE* out_capture = tmpfile();
+    FILE* err_capture = tmpfile();
+    int saved_stdout = dup(STDOUT_FILENO);
+    int saved_stderr = dup(STDERR_FILENO);
+    FILE* report = saved_stdout != -1 ? fdopen(saved_stdout, "w") : NULL;
+    if (!out_capture || !err_capture || !report || saved_stderr == -1) {
+        fprintf(stderr, "Error: Failed to set up output capture: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-        const char* key = argv[1];
+    batch_mode = 1;
+    batch_thread = pthread_self();
+    store_defer = 1;
 
-        if (strcmp(key, "confirm.exit") == 0) {
-            printf("%s%d%s\n", COLOR_WHITE, config.confirm_exit, COLOR_RESET);
-        } else if (strcmp(key, "auto.stash") == 0) {
-            printf("%s%d%s\n", COLOR_WHITE, config.auto_stash, COLOR_RESET);
-        } else if (strcmp(key, "auto.save") == 0) {
-            printf("%s%d%s\n", COLOR_WHITE, config.auto_save, COLOR_RESET);
-        } else {
-            fprintf(stderr, "Error: Unknown config key '%s'.\n", key);
-            exit(EXIT_FAILURE);
-        }
-    } else if (strcmp(cmd, "set") == 0) {
-        if (argc < 3) {
-            fprintf(stderr, "Error: Missing config key or value.\n");
-            exit(EXIT_FAILURE);
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    int index = 0, failed = 0;
+
+    while ((line_len = getdelim(&line, &line_cap, delim, stdin)) != -1) {
+        if (line_len > 0 && line[line_len - 1] == delim) {
+            line[line_len - 1] = '\0';
         }
 
-        const char* key = argv[1];
-        const char* value = argv[2];
+        char* command = strdup(line);
+        char* words[64];
+        int nwords = split_batch_line(line, words + 1, 62);
+        if (!command || nwords == 0 || words[1][0] == '#') {
+            free(command);
+            continue;
+        }
 
-        int bool_value = atoi(value);
+        fflush(stdout);
+        fflush(stderr);
+        dup2(fileno(out_capture), STDOUT_FILENO);
+        dup2(fileno(err_capture), STDERR_FILENO);
 
-        if (strcmp(key, "confirm.exit") == 0) {
-            config.confirm_exit = bool_value;
-            printf("%sSet confirm.exit = %d%s\n", COLOR_GREEN, bool_value, COLOR_RESET);
-        } else if (strcmp(key, "auto.stash") == 0) {
-            config.auto_stash = bool_value;
-            printf("%sSet auto.stash = %d%s\n", COLOR_GREEN, bool_value, COLOR_RESET);
-        } else if (strcmp(key, "auto.save") == 0) {
-            config.auto_save = bool_value;
-            printf("%sSet auto.save = %d%s\n", COLOR_GREEN, bool_value, COLOR_RESET);
-        } else {
-            fprintf(stderr, "Error: Unknown config key '%s'.\n", key);
-            exit(EXIT_FAILURE);
+        store_begin_command();
+        int status = run_batch_command(nwords, words);
+        if (status != 0) {
+            store_rollback_command();
         }
 
-        // Save the config to Git config
-        char git_cmd[DEFAULT_BUFFER_SIZE];
-        snprintf(git_cmd, sizeof(git_cmd), "git config --local kaishaku.%s %d", key, bool_value);
+        fflush(stdout);
+        fflush(stderr);
+        dup2(saved_stderr, STDERR_FILENO);
+
+        char* out_text = drain_capture(out_capture);
+        char* err_text = drain_capture(err_capture);
+
+        fprintf(report, "{\"index\":%d,\"command\":", index++);
+        json_print_string(report, command);
+        fprintf(report, ",\"status\":%d,\"stdout\":", status);
+        json_print_string(report, out_text);
+        fprintf(report, ",\"stderr\":");
+        json_print_string(report, err_text);
+        fprintf(report, "}\n");
+        fflush(report);
+
+        failed += status != 0;
+        free(out_text);
+        free(err_text);
+        free(command);
+    }
 
-        if (!execute_git_command(git_cmd, NULL, 0)) {
-            fprintf(stderr, "Warning: Failed to save config: %s\n", error_message);
-            // Continue despite error
-        }
-    } else {
-        fprintf(stderr, "Error: Unknown config command '%s'.\n", cmd);
+    free(line);
+    batch_mode = 0;
+    store_defer = 0;
+    dup2(saved_stdout, STDOUT_FILENO);
+    fclose(report);
+    close(saved_stderr);
+    fclose(out_capture);
+    fclose(err_capture);
+
+    // All session metadata written by the batch is committed here, in one go
+    if (!store_flush()) {
+        fprintf(stderr, "Error: Failed to commit session metadata.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (failed) {
+        fprintf(stderr, "%s%d of %d command(s) failed.%s\n", COLOR_YELLOW, failed, index,
+                COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+}
+
+#ifdef __linux__
+// kaishaku watch: inotify on the working tree, debounced, and every burst of changes is
+// snapshotted into refs/kaishaku/wip/<session>. Only the changed paths are hashed, into
+// a private per-session index that keeps its own stat data, so a snapshot costs
+// O(changed files) rather than O(repository).
+struct watch_state {
+    int fd;
+    char** wd_paths;  // Directory (relative to the root) per watch descriptor
+    size_t wd_cap;
+    char** ignored;   // Sorted ignored directories, never watched
+    size_t ignored_count;
+    char** changed;   // Paths touched since the last snapshot; directories end in '/'
+    size_t changed_count, changed_cap;
+    int overflow;     // Events were lost, so the next snapshot rescans everything
+};
+
+volatile sig_atomic_t watch_stop = 0;
+
+static void watch_signal(int sig) {
+    (void)sig;
+    watch_stop = 1;
+}
+
+static int compare_strings(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static char* join_relative(const char* dir, const char* name) {
+    char* path = malloc(strlen(dir) + strlen(name) + 2);
+    if (!path) {
+        perror("malloc");
         exit(EXIT_FAILURE);
     }
+    sprintf(path, "%s%s%s", dir, dir[0] ? "/" : "", name);
+    return path;
+}
+
+static void watch_record(struct watch_state* st, char* path) {
+    if (st->changed_count == st->changed_cap) {
+        st->changed_cap = st->changed_cap ? st->changed_cap * 2 : 256;
+        st->changed = realloc(st->changed, st->changed_cap * sizeof(*st->changed));
+        if (!st->changed) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    st->changed[st->changed_count++] = path;
 }
 
-void load_config(void) {
-    char output[DEFAULT_BUFFER_SIZE];
-    char git_cmd[DEFAULT_BUFFER_SIZE];
+static void watch_clear(struct watch_state* st) {
+    for (size_t i = 0; i < st->changed_count; i++) {
+        free(st->changed[i]);
+    }
+    st->changed_count = 0;
+}
 
-    // Try to create kaishaku section in git config if it doesn't exist
-    if (!file_exists(kaishaku_dir)) {
-        ensure_directory_exists(kaishaku_dir);
+static int watch_is_ignored(const struct watch_state* st, const char* dir) {
+    char key[MAX_PATH_LENGTH];
+    snprintf(key, sizeof(key), "%s/", dir);
+    const char* k = key;
+    return bsearch(&k, st->ignored, st->ignored_count, sizeof(*st->ignored), compare_strings) !=
+           NULL;
+}
+
+// Watch a directory and everything below it. With record set, the files found are also
+// recorded as changed, for directories that appear while we are running.
+static void watch_add_tree(struct watch_state* st, const char* rel, int record) {
+    int wd = inotify_add_watch(st->fd, rel[0] ? rel : ".",
+                               IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                   IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd == -1) {
+        if (errno == ENOSPC) {
+            fprintf(stderr,
+                    "%sWarning: Out of inotify watches (fs.inotify.max_user_watches); '%s' is "
+                    "not watched.%s\n",
+                    COLOR_YELLOW, rel, COLOR_RESET);
+        }
+        return;
     }
 
-    // Load confirm_exit
-    snprintf(git_cmd, sizeof(git_cmd), "git config --get kaishaku.confirm.exit");
-    if (execute_git_command(git_cmd, output, sizeof(output))) {
-        config.confirm_exit = atoi(output);
-    } else {
-        // Set default value if not configured
-        snprintf(git_cmd, sizeof(git_cmd), "git config --local kaishaku.confirm.exit %d",
-                 config.confirm_exit);
-        execute_git_command(git_cmd, NULL, 0);
+    if ((size_t)wd >= st->wd_cap) {
+        size_t cap = st->wd_cap ? st->wd_cap : 256;
+        while (cap <= (size_t)wd) {
+            cap *= 2;
+        }
+        st->wd_paths = realloc(st->wd_paths, cap * sizeof(*st->wd_paths));
+        if (!st->wd_paths) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        memset(st->wd_paths + st->wd_cap, 0, (cap - st->wd_cap) * sizeof(*st->wd_paths));
+        st->wd_cap = cap;
     }
+    free(st->wd_paths[wd]);
+    st->wd_paths[wd] = strdup(rel);
 
-    // Load auto_stash
-    snprintf(git_cmd, sizeof(git_cmd), "git config --get kaishaku.auto.stash");
-    if (execute_git_command(git_cmd, output, sizeof(output))) {
-        config.auto_stash = atoi(output);
-    } else {
-        // Set default value if not configured
-        snprintf(git_cmd, sizeof(git_cmd), "git config --local kaishaku.auto.stash %d",
-                 config.auto_stash);
-        execute_git_command(git_cmd, NULL, 0);
+    DIR* dir = opendir(rel[0] ? rel : ".");
+    if (!dir) {
+        return;
     }
 
-    // Load auto_save
-    snprintf(git_cmd, sizeof(git_cmd), "git config --get kaishaku.auto.save");
-    if (execute_git_command(git_cmd, output, sizeof(output))) {
-        config.auto_save = atoi(output);
-    } else {
-        // Set default value if not configured
-        snprintf(git_cmd, sizeof(git_cmd), "git config --local kaishaku.auto.save %d",
-                 config.auto_save);
-        execute_git_command(git_cmd, NULL, 0);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            (!rel[0] && strcmp(entry->d_name, ".git") == 0)) {
+            continue;
+        }
+
+        char* path = join_relative(rel, entry->d_name);
+        struct stat st_buf;
+        if (lstat(path, &st_buf) == 0 && S_ISDIR(st_buf.st_mode)) {
+            if (!watch_is_ignored(st, path)) {
+                watch_add_tree(st, path, record);
+            }
+            free(path);
+        } else if (record) {
+            watch_record(st, path);
+        } else {
+            free(path);
+        }
     }
+    closedir(dir);
 }
 
-void cmd_recover(const char* session) {
-    if (!session)
-        usage();
+static void watch_read_events(struct watch_state* st) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(st->fd, buf, sizeof(buf));
 
-    if (!file_exists(kaishaku_dir)) {
-        fprintf(stderr, "%sError: No kaishaku sessions exist.%s\n", COLOR_RED, COLOR_RESET);
-        exit(EXIT_FAILURE);
+    for (char* p = buf; len > 0 && p < buf + len;) {
+        struct inotify_event* ev = (struct inotify_event*)p;
+        p += sizeof(*ev) + ev->len;
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+            st->overflow = 1;
+            continue;
+        }
+        if (ev->wd < 0 || (size_t)ev->wd >= st->wd_cap || !st->wd_paths[ev->wd] || !ev->len) {
+            continue;
+        }
+
+        char* path = join_relative(st->wd_paths[ev->wd], ev->name);
+        if (ev->mask & IN_ISDIR) {
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                if (!watch_is_ignored(st, path)) {
+                    watch_add_tree(st, path, 1);
+                }
+                free(path);
+            } else if (ev->mask & IN_MOVED_FROM) {
+                // Whatever the index had below it is gone now
+                char* dir_path = join_relative(path, "");
+                watch_record(st, dir_path);
+                free(path);
+            } else {
+                free(path);
+            }
+        } else {
+            watch_record(st, path);
+        }
     }
+}
 
-    char* session_dir = SESSION_DIR(session);
-    if (!file_exists(session_dir)) {
-        fprintf(stderr, "%sError: Session '%s' not found.%s\n", COLOR_RED, session, COLOR_RESET);
-        exit(EXIT_FAILURE);
+// Make sure the session has a private index, seeded from .git/index so its stat data
+// is reused, and bring it up to date with the working tree once.
+static int watch_prepare_index(const char* session, const char* quoted_index) {
+    char* index_path = SESSION_WIP_INDEX_FILE(session);
+    if (file_exists(index_path)) {
+        return 1;
     }
 
-    // Check if session is already active
-    if (file_exists(ACTIVE_FILE)) {
-        const char* active_session = read_from_file(ACTIVE_FILE);
-        if (active_session && strcmp(active_session, session) == 0) {
-            fprintf(stderr, "%sError: Session '%s' is already active.%s\n", COLOR_RED, session,
-                    COLOR_RESET);
-            exit(EXIT_FAILURE);
-        }
+    char* git_index = safe_path_join(root, ".git/index");
+    char* quoted_git_index = shell_quote(git_index);
+    char cmd[4 * MAX_PATH_LENGTH];
+    snprintf(cmd, sizeof(cmd), "cp %s %s && GIT_INDEX_FILE=%s git add -A", quoted_git_index,
+             quoted_index, quoted_index);
+    free(quoted_git_index);
+    free(git_index);
+
+    if (!execute_git_command(cmd, NULL, 0)) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        return 0;
     }
+    return 1;
+}
 
-    // Verify session files
-    char* session_file = SESSION_FILE(session);
-    char* head_file = HEAD_FILE(session);
+// Hash the changed paths into the private index and record a WIP commit if the tree
+// differs from the previous snapshot.
+static void watch_take_snapshot(struct watch_state* st, const char* session) {
+    char* quoted_index = shell_quote(SESSION_WIP_INDEX_FILE(session));
+    char cmd[2 * MAX_PATH_LENGTH];
+    char* output = NULL;
+    size_t path_count = st->changed_count;
 
-    if (!file_exists(session_file) || !file_exists(head_file)) {
-        fprintf(stderr, "%sError: Session '%s' is corrupted. Missing required files.%s\n",
-                COLOR_RED, session, COLOR_RESET);
-        exit(EXIT_FAILURE);
+    if (!watch_prepare_index(session, quoted_index)) {
+        free(quoted_index);
+        return;
     }
 
-    const char* original_branch = read_from_file(session_file);
-    const char* head = read_from_file(head_file);
+    if (st->overflow) {
+        snprintf(cmd, sizeof(cmd), "GIT_INDEX_FILE=%s git add -A", quoted_index);
+        if (!execute_git_command(cmd, NULL, 0)) {
+            fprintf(stderr, "Warning: %s\n", error_message);
+        }
+        st->overflow = 0;
+    } else if (st->changed_count) {
+        qsort(st->changed, st->changed_count, sizeof(*st->changed), compare_strings);
+
+        char* paths = NULL;
+        size_t len = 0, cap = 0;
+        char* dirs = NULL;
+        size_t dirs_len = 0, dirs_cap = 0;
+        for (size_t i = 0; i < st->changed_count; i++) {
+            if (i > 0 && strcmp(st->changed[i], st->changed[i - 1]) == 0) {
+                path_count--;
+                continue;
+            }
+            size_t n = strlen(st->changed[i]);
+            int is_dir = n > 0 && st->changed[i][n - 1] == '/';
+            append_line(is_dir ? &dirs : &paths, is_dir ? &dirs_len : &len,
+                        is_dir ? &dirs_cap : &cap, st->changed[i]);
+        }
 
-    // Verify original branch exists
-    char branch_check[DEFAULT_BUFFER_SIZE];
-    snprintf(branch_check, sizeof(branch_check), "git rev-parse --verify %s", original_branch);
-    if (!execute_git_command(branch_check, NULL, 0)) {
-        fprintf(stderr, "%sWarning: Original branch '%s' not found. Creating new branch.%s\n",
-                COLOR_YELLOW, original_branch, COLOR_RESET);
+        // Directories moved away: everything the index had below them
+        if (dirs) {
+            char* tracked = NULL;
+            snprintf(cmd, sizeof(cmd), "GIT_INDEX_FILE=%s git -c core.quotepath=off ls-files",
+                     quoted_index);
+            if (run_git_filter(cmd, "", 0, &tracked) == 0 && tracked) {
+                for (char* line = strtok(tracked, "\n"); line; line = strtok(NULL, "\n")) {
+                    for (char* d = dirs; *d;) {
+                        size_t n = strcspn(d, "\n");
+                        if (strncmp(line, d, n) == 0) {
+                            append_line(&paths, &len, &cap, line);
+                            break;
+                        }
+                        d += n + (d[n] == '\n');
+                    }
+                }
+            }
+            free(tracked);
+            free(dirs);
+        }
 
-        // Create new branch from current HEAD
-        char create_branch[DEFAULT_BUFFER_SIZE];
-        snprintf(create_branch, sizeof(create_branch), "git checkout -b %s", original_branch);
-        if (!execute_git_command(create_branch, NULL, 0)) {
-            fprintf(stderr, "%sError: Failed to create branch '%s'.%s\n", COLOR_RED,
-                    original_branch, COLOR_RESET);
-            exit(EXIT_FAILURE);
+        // Leave out files the user ignores; check-ignore exits 1 when none are
+        char* ignored = NULL;
+        int status = paths ? run_git_filter("git -c core.quotepath=off check-ignore --stdin",
+                                            paths, len, &ignored)
+                           : 1;
+        if (paths && (status == 0 || status == 1) && ignored && ignored[0]) {
+            char* kept = NULL;
+            size_t kept_len = 0, kept_cap = 0;
+            for (char* line = strtok(paths, "\n"); line; line = strtok(NULL, "\n")) {
+                char* hit = strstr(ignored, line);
+                size_t n = strlen(line);
+                if (!(hit && (hit == ignored || hit[-1] == '\n') && (hit[n] == '\n' || !hit[n]))) {
+                    append_line(&kept, &kept_len, &kept_cap, line);
+                }
+            }
+            free(paths);
+            paths = kept;
+            len = kept_len;
         }
+        free(ignored);
+
+        // update-index picks up new, modified and deleted files alike
+        if (paths) {
+            snprintf(cmd, sizeof(cmd), "GIT_INDEX_FILE=%s git update-index --add --remove --stdin",
+                     quoted_index);
+            if (run_git_filter(cmd, paths, len, &output) != 0) {
+                fprintf(stderr, "Warning: %s\n", error_message);
+            }
+            free(output);
+            output = NULL;
+        }
+        free(paths);
     }
 
-    // Switch to the session
-    if (!write_to_file(ACTIVE_FILE, session)) {
-        fprintf(stderr, "%sError: Failed to activate session.%s\n", COLOR_RED, COLOR_RESET);
-        exit(EXIT_FAILURE);
+    watch_clear(st);
+
+    char tree[DEFAULT_BUFFER_SIZE], previous[DEFAULT_BUFFER_SIZE] = "";
+    char previous_tree[DEFAULT_BUFFER_SIZE] = "", head[DEFAULT_BUFFER_SIZE] = "";
+    snprintf(cmd, sizeof(cmd), "GIT_INDEX_FILE=%s git write-tree", quoted_index);
+    free(quoted_index);
+    if (!execute_git_command(cmd, tree, sizeof(tree))) {
+        fprintf(stderr, "Warning: %s\n", error_message);
+        return;
     }
 
-    char git_cmd[DEFAULT_BUFFER_SIZE];
-    snprintf(git_cmd, sizeof(git_cmd), "git checkout %s --detach", head);
+    char ref[DEFAULT_BUFFER_SIZE];
+    snprintf(ref, sizeof(ref), WIP_REF_PREFIX "%s", session);
+    if (git->resolve(ref, previous, sizeof(previous))) {
+        snprintf(cmd, sizeof(cmd), "%s^{tree}", previous);
+        git->resolve(cmd, previous_tree, sizeof(previous_tree));
+    } else {
+        // The first snapshot only has something to keep if the tree differs from HEAD's
+        git->resolve("HEAD^{tree}", previous_tree, sizeof(previous_tree));
+    }
+    if (strcmp(tree, previous_tree) == 0) {
+        return;  // Touched but not changed
+    }
+    git->resolve("HEAD", head, sizeof(head));
+
+    // Chain snapshots, and link the session HEAD they were taken on top of
+    char commit[DEFAULT_BUFFER_SIZE], message[DEFAULT_BUFFER_SIZE];
+    snprintf(message, sizeof(message), "kaishaku: work in progress in session '%s'", session);
+    char* quoted_message = shell_quote(message);
+    int link_head = head[0] && strcmp(head, previous) != 0;
+    snprintf(cmd, sizeof(cmd), "git commit-tree %s%s%s%s%s -m %s", tree,
+             previous[0] ? " -p " : "", previous, link_head ? " -p " : "", link_head ? head : "",
+             quoted_message);
+    free(quoted_message);
+    if (!execute_git_command(cmd, commit, sizeof(commit))) {
+        fprintf(stderr, "Warning: %s\n", error_message);
+        return;
+    }
 
-    if (!execute_git_command(git_cmd, NULL, 0)) {
-        fprintf(stderr, "%sError: Failed to checkout commit: %s%s\n", COLOR_RED, error_message,
-                COLOR_RESET);
-        exit(EXIT_FAILURE);
+    if (!git->update_ref(ref, commit, NULL, "kaishaku watch")) {
+        fprintf(stderr, "Warning: %s\n", error_message);
+        return;
     }
 
-    printf("%sRecovered session '%s'%s\n", COLOR_GREEN, session, COLOR_RESET);
+    char time_str[64];
+    format_session_time((long)time(NULL), time_str, sizeof(time_str));
+    printf("%s[%s]%s Snapshot %.12s of session '%s' (%zu path(s))\n", COLOR_CYAN, time_str,
+           COLOR_RESET, commit, session, path_count);
+    fflush(stdout);
 }
 
-void cmd_rename(const char* old_name, const char* new_name) {
-    if (!old_name || !new_name)
-        usage();
+// watch itself runs unlocked, but a snapshot writes the session's WIP index and ref, so
+// it holds the writer lock like any other command. A switch that got in first has
+// changed the working tree under the snapshot; the next round picks that up instead.
+static void watch_snapshot(struct watch_state* st, const char* session) {
+    acquire_store_lock();
 
-    if (!file_exists(kaishaku_dir)) {
-        fprintf(stderr, "%sError: No kaishaku sessions exist.%s\n", COLOR_RED, COLOR_RESET);
-        exit(EXIT_FAILURE);
+    char active[DEFAULT_BUFFER_SIZE];
+    char* active_path = safe_path_join(kaishaku_dir, ".active");
+    if (read_line_file(active_path, active, sizeof(active)) && strcmp(active, session) == 0) {
+        watch_take_snapshot(st, session);
     }
+    free(active_path);
 
-    char* old_dir = SESSION_DIR(old_name);
-    char* new_dir = SESSION_DIR(new_name);
-
-    if (!file_exists(old_dir)) {
-        fprintf(stderr, "%sError: Session '%s' not found.%s\n", COLOR_RED, old_name, COLOR_RESET);
-        exit(EXIT_FAILURE);
-    }
+    release_store_lock();
+}
 
-    if (file_exists(new_dir)) {
-        fprintf(stderr, "%sError: Session '%s' already exists.%s\n", COLOR_RED, new_name,
-                COLOR_RESET);
-        exit(EXIT_FAILURE);
-    }
+void cmd_watch(int argc, char* argv[]) {
+    long debounce_ms = 1000;
+    const long max_delay_ms = 30000;  // Keep snapshotting through continuous writes
 
-    // Check if old session is active
-    if (file_exists(ACTIVE_FILE)) {
-        const char* active_session = read_from_file(ACTIVE_FILE);
-        if (active_session && strcmp(active_session, old_name) == 0) {
-            fprintf(stderr, "%sError: Cannot rename active session. Exit the session first.%s\n",
-                    COLOR_RED, COLOR_RESET);
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--debounce") == 0 && i + 1 < argc) {
+            debounce_ms = atol(argv[++i]);
+        } else {
+            fprintf(stderr, "Error: Unknown watch option '%s'.\n", argv[i]);
             exit(EXIT_FAILURE);
         }
     }
 
-    // Rename the directory
-    if (rename(old_dir, new_dir) == -1) {
-        fprintf(stderr, "%sError: Failed to rename session: %s%s\n", COLOR_RED, strerror(errno),
-                COLOR_RESET);
+    if (batch_mode) {
+        fprintf(stderr, "Error: watch cannot run in a batch.\n");
         exit(EXIT_FAILURE);
     }
 
-    printf("%sRenamed session '%s' to '%s'%s\n", COLOR_GREEN, old_name, new_name, COLOR_RESET);
-}
-
-void cmd_abort(const char* session) {
-    if (!file_exists(kaishaku_dir)) {
-        fprintf(stderr, "%sError: No kaishaku sessions exist.%s\n", COLOR_RED, COLOR_RESET);
+    const char* session = read_from_file(ACTIVE_FILE);
+    if (!session) {
+        fprintf(stderr, "Error: No active kaishaku session.\n");
         exit(EXIT_FAILURE);
     }
 
-    // If no session specified, abort current session
-    if (!session) {
-        if (!file_exists(ACTIVE_FILE)) {
-            fprintf(stderr, "%sError: No active session to abort.%s\n", COLOR_RED, COLOR_RESET);
-            exit(EXIT_FAILURE);
-        }
-        session = read_from_file(ACTIVE_FILE);
-        if (!session) {
-            fprintf(stderr, "%sError: Failed to read active session.%s\n", COLOR_RED, COLOR_RESET);
-            exit(EXIT_FAILURE);
-        }
+    if (chdir(root) == -1) {
+        fprintf(stderr, "Error: Cannot enter %s: %s\n", root, strerror(errno));
+        exit(EXIT_FAILURE);
     }
 
-    char* session_dir = SESSION_DIR(session);
-    if (!file_exists(session_dir)) {
-        fprintf(stderr, "%sError: Session '%s' not found.%s\n", COLOR_RED, session, COLOR_RESET);
+    struct watch_state st = {0};
+    st.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (st.fd == -1) {
+        fprintf(stderr, "Error: inotify: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    // If this is the active session, return to original branch
-    if (file_exists(ACTIVE_FILE)) {
-        const char* active_session = read_from_file(ACTIVE_FILE);
-        if (active_session && strcmp(active_session, session) == 0) {
-            const char* original_branch = read_from_file(SESSION_FILE(session));
-            if (original_branch) {
-                char git_cmd[DEFAULT_BUFFER_SIZE];
-                snprintf(git_cmd, sizeof(git_cmd), "git checkout %s", original_branch);
-                if (!execute_git_command(git_cmd, NULL, 0)) {
-                    fprintf(stderr, "%sError: Failed to return to original branch: %s%s\n",
-                            COLOR_RED, error_message, COLOR_RESET);
-                    exit(EXIT_FAILURE);
-                }
-                unlink(ACTIVE_FILE);
+    // Ignored directories (build output, dependencies) are not watched at all
+    char* ignored = capture_git_output(
+        "git ls-files -z --others --ignored --exclude-standard --directory");
+    for (char* p = ignored; p && *p; p += strlen(p) + 1) {
+        if (p[strlen(p) - 1] == '/') {
+            st.ignored = realloc(st.ignored, (st.ignored_count + 1) * sizeof(*st.ignored));
+            if (!st.ignored) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
             }
+            st.ignored[st.ignored_count++] = p;
         }
     }
+    qsort(st.ignored, st.ignored_count, sizeof(*st.ignored), compare_strings);
+
+    watch_add_tree(&st, "", 0);
+
+    struct sigaction sa = {0};
+    sa.sa_handler = watch_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("%sWatching session '%s' (Ctrl-C to stop)%s\n", COLOR_GREEN, session, COLOR_RESET);
+    fflush(stdout);
+
+    // First snapshot captures whatever is uncommitted right now
+    st.overflow = 1;
+    watch_snapshot(&st, session);
+
+    long first_event = 0, last_event = 0;
+    while (!watch_stop) {
+        long now = monotonic_ms();
+        int pending = st.changed_count > 0 || st.overflow;
+        int timeout = -1;
+        if (pending) {
+            long due = last_event + debounce_ms;
+            if (first_event + max_delay_ms < due) {
+                due = first_event + max_delay_ms;
+            }
+            timeout = due > now ? (int)(due - now) : 0;
+        }
 
-    // Clean up session files
-    char* session_file = SESSION_FILE(session);
-    char* head_file = HEAD_FILE(session);
-    char* time_file = SESSION_TIME_FILE(session);
-    char* desc_file = SESSION_DESC_FILE(session);
+        struct pollfd pfd = {st.fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeout);
+        now = monotonic_ms();
+
+        if (ready > 0) {
+            watch_read_events(&st);
+            if (!pending && (st.changed_count > 0 || st.overflow)) {
+                first_event = now;
+            }
+            last_event = now;
+            continue;
+        }
+
+        if (ready == 0 && pending) {
+            // Follow the user across switches; stop once the session is over
+            char active[DEFAULT_BUFFER_SIZE];
+            char* active_path = safe_path_join(kaishaku_dir, ".active");
+            int has_active = read_line_file(active_path, active, sizeof(active));
+            free(active_path);
+            if (!has_active) {
+                // What changed now is exit restoring the original branch, not session work
+                printf("%sSession ended; stopping watch.%s\n", COLOR_YELLOW, COLOR_RESET);
+                watch_clear(&st);
+                break;
+            }
+            if (strcmp(active, session) != 0) {
+                session = strdup(active);
+                watch_clear(&st);
+                st.overflow = 1;
+            }
+            watch_snapshot(&st, session);
+        }
+    }
 
-    unlink(session_file);
-    unlink(head_file);
-    unlink(time_file);
-    unlink(desc_file);
-    rmdir(session_dir);
+    // Do not lose the last few edits on Ctrl-C
+    if (st.changed_count > 0) {
+        watch_snapshot(&st, session);
+    }
 
-    printf("%sAborted session '%s'%s\n", COLOR_GREEN, session, COLOR_RESET);
+    close(st.fd);
+    free(ignored);
 }
+#else
+void cmd_watch(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    fprintf(stderr, "Error: watch needs inotify and is only available on Linux.\n");
+    exit(EXIT_FAILURE);
+}
+#endif
 
 void update_timestamp(const char* session) {
     time_t now = time(NULL);
@@ -1111,26 +9836,75 @@ void update_timestamp(const char* session) {
     write_to_file(SESSION_TIME_FILE(session), timestamp);
 }
 
-char* get_session_time(const char* session) {
-    static char time_str[DEFAULT_BUFFER_SIZE];
-    const char* timestamp = read_from_file(SESSION_TIME_FILE(session));
+// Remember where a session's HEAD is when we leave it, so commits made inside the
+// session are still its tip when we come back (and for list --stats).
+void record_session_tip(const char* session) {
+    char head[DEFAULT_BUFFER_SIZE];
+    if (git->resolve("HEAD", head, sizeof(head))) {
+        write_to_file(HEAD_FILE(session), head);
+    }
+}
+
+void leave_active_session(const char* next_session) {
+    const char* active = read_from_file(ACTIVE_FILE);
+    if (active && strcmp(active, next_session) != 0 && file_exists(SESSION_DIR(active))) {
+        record_session_tip(active);
+        save_session_index(active);
+    }
+}
 
-    if (!timestamp) {
-        return "unknown";
+// Read a whole file into a malloc'd buffer, or return NULL.
+char* read_file_contents(const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return NULL;
     }
 
-    time_t t = (time_t)atol(timestamp);
-    struct tm* tm_info = localtime(&t);
+    size_t len = 0, cap = 4096;
+    char* data = malloc(cap);
+    size_t n;
+    while (data && (n = fread(data + len, 1, cap - len - 1, fp)) > 0) {
+        len += n;
+        if (cap - len - 1 == 0) {
+            cap *= 2;
+            data = realloc(data, cap);
+        }
+    }
+    fclose(fp);
 
-    if (!tm_info) {
-        return "invalid";
+    if (!data) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
     }
+    data[len] = '\0';
+    return data;
+}
+
+char* get_session_time(const char* session) {
+    static char time_str[DEFAULT_BUFFER_SIZE];
+    const char* timestamp = read_from_file(SESSION_TIME_FILE(session));
 
-    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", tm_info);
+    format_session_time(timestamp ? atol(timestamp) : 0, time_str, sizeof(time_str));
     return time_str;
 }
 
+int run_command(int argc, char* argv[]) {
+    int offset = get_command_offset(argv[1]);
+    if (offset == -1) {
+        return -1;
+    }
+
+    const char* argv2 = (argc >= 3) ? argv[2] : NULL;
+    const char* argv3 = (argc >= 4) ? argv[3] : NULL;
+
+// Yeah, this trips -Wpedantic, but this macro-generated switch is under control. Let it slide.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    switch (offset) { COMMAND_LIST(CMD_CASE) }
+#pragma GCC diagnostic pop
 
+    return 0;
+}
 
 int main(int argc, char* argv[]) {
     if (argc < 2 || strcmp(argv[1], "help") == 0) {
@@ -1143,6 +9917,16 @@ int main(int argc, char* argv[]) {
         usage();
     }
 
+    // Scanning other repositories works from anywhere, not just inside one
+    if (strcmp(argv[1], "list") == 0) {
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--repos") == 0 || strcmp(argv[i], "--root") == 0) {
+                cmd_list(argc - 2, argv + 2);
+                return 0;
+            }
+        }
+    }
+
 //feat: allow tool to run from any directory inside the Git repository
 root = get_git_root();
 if (strlen(root) == 0) {
@@ -1154,15 +9938,16 @@ if (strlen(root) == 0) {
    kaishaku_dir = safe_path_join(root, ".git/kaishaku");
 
    load_config();
+   select_git_backend();
 
-    const char* argv2 = (argc >= 3) ? argv[2] : NULL;
-    const char* argv3 = (argc >= 4) ? argv[3] : NULL;
+   char search[32];
+   snprintf(search, sizeof(search), " %s ", argv[1]);
+   int dry_run = strcmp(argv[1], "save") == 0 && argc > 2 && strcmp(argv[2], "--dry-run") == 0;
+   if (!strstr(READONLY_COMMANDS, search) && !strstr(SELF_LOCKING_COMMANDS, search) && !dry_run) {
+       acquire_store_lock();
+   }
 
-// Yeah, this trips -Wpedantic, but this macro-generated switch is under control. Let it slide.
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpedantic"
-    switch (offset) { COMMAND_LIST(CMD_CASE) }
-#pragma GCC diagnostic pop
+   run_command(argc, argv);
 
 free(root); 
 free(kaishaku_dir); 
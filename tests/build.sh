@@ -0,0 +1,61 @@
+#!/bin/sh
+# Compile kaishaku.c the plain way and, where libgit2 is installed, with -DKAISHAKU_LIBGIT2
+# too, so the libgit2 backend cannot rot unnoticed. The libgit2 build then runs
+# `kaishaku bench` in a scratch repository, which runs status, list and switch with every
+# backend in it.
+#
+#   tests/build.sh [path to kaishaku.c]
+#
+# CC and CFLAGS in the environment change the compiler and its flags.
+
+set -u
+
+SOURCE=${1:-kaishaku.c}
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2 -Wall -Wextra -Werror}
+
+if [ ! -f "$SOURCE" ]; then
+    echo "usage: $0 [path to kaishaku.c]" >&2
+    exit 2
+fi
+SOURCE=$(cd "$(dirname "$SOURCE")" && pwd)/$(basename "$SOURCE")
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+export GIT_AUTHOR_NAME=build GIT_AUTHOR_EMAIL=build@example.com
+export GIT_COMMITTER_NAME=build GIT_COMMITTER_EMAIL=build@example.com
+
+if ! $CC $CFLAGS -o "$WORK/kaishaku" "$SOURCE" -pthread -lz; then
+    echo "FAIL: plain build"
+    exit 1
+fi
+echo "OK: plain build"
+
+if ! pkg-config --exists libgit2 2>/dev/null; then
+    echo "SKIP: libgit2 build (pkg-config finds no libgit2)"
+    exit 0
+fi
+
+if ! $CC $CFLAGS -DKAISHAKU_LIBGIT2 $(pkg-config --cflags libgit2) -o "$WORK/kaishaku-git2" \
+        "$SOURCE" -pthread -lz $(pkg-config --libs libgit2); then
+    echo "FAIL: libgit2 build"
+    exit 1
+fi
+
+cd "$WORK" || exit 1
+git init -q -b main repo && cd repo || exit 1
+echo one > file && git add file && git commit -q -m one
+echo two > file && git commit -q -a -m two
+if ! out=$("$WORK/kaishaku-git2" bench -n 2 </dev/null 2>&1); then
+    printf '%s\n' "$out"
+    echo "FAIL: bench with the libgit2 build"
+    exit 1
+fi
+if ! printf '%s\n' "$out" | grep -q libgit2; then
+    printf '%s\n' "$out"
+    echo "FAIL: the libgit2 build has no libgit2 backend"
+    exit 1
+fi
+[ "$(git symbolic-ref --short HEAD)" = main ] || { echo "FAIL: bench left main"; exit 1; }
+echo "OK: libgit2 build, bench ran with every backend"
@@ -0,0 +1,95 @@
+#!/bin/sh
+# Check the partial clone prefetch: checking out an older commit in a blob:none clone has to
+# fetch every blob it needs in one round trip, and a sparse checkout only the cone's blobs.
+#
+#   gcc -o kaishaku kaishaku.c -O3 -pthread -lz && tests/prefetch.sh [./kaishaku]
+
+set -u
+
+KAISHAKU=$(cd "$(dirname "${1:-./kaishaku}")" && pwd)/$(basename "${1:-./kaishaku}")
+
+if [ ! -x "$KAISHAKU" ]; then
+    echo "usage: $0 [path to kaishaku]" >&2
+    exit 2
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+export GIT_AUTHOR_NAME=prefetch GIT_AUTHOR_EMAIL=prefetch@example.com
+export GIT_COMMITTER_NAME=prefetch GIT_COMMITTER_EMAIL=prefetch@example.com
+
+cd "$WORK" || exit 1
+git init -q -b main origin || exit 1
+git -C origin config uploadpack.allowFilter true
+
+# Every file changes in every commit, so the old blobs are all missing from a fresh clone
+for round in 1 2 3; do
+    for dir in a b c; do
+        mkdir -p "origin/$dir"
+        for f in 1 2 3 4; do
+            echo "$dir/$f round $round" > "origin/$dir/$f"
+        done
+    done
+    git -C origin add . && git -C origin commit -q -m "round $round"
+done
+
+# Blob ids missing locally for the tree of HEAD
+missing() {
+    git rev-list --objects --missing=print --no-walk HEAD | sed -n 's/^?//p' | sort
+}
+
+# Number of git fetch processes in a trace2 event log, and of those kaishaku ran itself
+# rather than a lazy fetch from inside git checkout
+fetches() {
+    grep -c '"event":"cmd_name".*"name":"fetch"' "$1"
+}
+prefetches() {
+    grep -c '"event":"cmd_name".*"name":"fetch","hierarchy":"fetch"' "$1"
+}
+
+fail() {
+    echo "$1" >>"$WORK/errors"
+}
+
+# A full checkout of an older commit
+git clone -q --filter=blob:none "file://$WORK/origin" full || exit 1
+cd full || exit 1
+if ! GIT_TRACE2_EVENT="$WORK/full.trace" "$KAISHAKU" checkout old HEAD~2 </dev/null \
+        >"$WORK/full.log" 2>&1; then
+    fail "checkout failed: $(cat "$WORK/full.log")"
+fi
+[ "$(git log -1 --format=%s)" = "round 1" ] || fail "HEAD is not the old commit"
+[ -z "$(missing)" ] || fail "objects still missing after checkout: $(missing | tr '\n' ' ')"
+n=$(fetches "$WORK/full.trace")
+[ "$n" -eq 1 ] || fail "full checkout ran $n fetches, expected 1"
+[ "$(prefetches "$WORK/full.trace")" -eq 1 ] || fail "full checkout fetched lazily, not up front"
+cd "$WORK" || exit 1
+
+# A sparse checkout fetches the cone, and nothing outside it
+git clone -q --filter=blob:none "file://$WORK/origin" sparse || exit 1
+cd sparse || exit 1
+if ! GIT_TRACE2_EVENT="$WORK/sparse.trace" "$KAISHAKU" checkout cone HEAD~2 --sparse a \
+        </dev/null >"$WORK/sparse.log" 2>&1; then
+    fail "sparse checkout failed: $(cat "$WORK/sparse.log")"
+fi
+missing >"$WORK/missing"
+for f in a/1 a/2 a/3 a/4; do
+    oid=$(git rev-parse "HEAD:$f")
+    grep -qx "$oid" "$WORK/missing" && fail "$f in the cone is missing"
+done
+for f in b/1 b/2 c/3 c/4; do
+    oid=$(git rev-parse "HEAD:$f")
+    grep -qx "$oid" "$WORK/missing" || fail "$f outside the cone was fetched"
+done
+n=$(fetches "$WORK/sparse.trace")
+[ "$n" -eq 1 ] || fail "sparse checkout ran $n fetches, expected 1"
+[ "$(prefetches "$WORK/sparse.trace")" -eq 1 ] ||
+    fail "sparse checkout fetched lazily, not up front"
+
+if [ -s "$WORK/errors" ]; then
+    cat "$WORK/errors"
+    echo "FAIL"
+    exit 1
+fi
+echo "OK: full and sparse checkouts of an old commit each fetched once"
@@ -0,0 +1,138 @@
+#!/bin/sh
+# Compare how `kaishaku list --json` resolves session branches and commits in reftable
+# repositories with what `git for-each-ref` says. Covered: a stack of one table with a
+# single ref block, a table with many ref blocks and a ref index, a v2 table (SHA-256),
+# and a newer table in the stack that deletes a ref.
+#
+#   gcc -o kaishaku kaishaku.c -O3 -pthread -lz && tests/reftable.sh [./kaishaku]
+#
+# Needs git 2.45 or newer for `git init --ref-format=reftable`; with an older git the
+# script skips. REF_FORMAT=files runs the same checks on a files repository.
+
+set -u
+
+KAISHAKU=$(cd "$(dirname "${1:-./kaishaku}")" && pwd)/$(basename "${1:-./kaishaku}")
+REF_FORMAT=${REF_FORMAT:-reftable}
+
+if [ ! -x "$KAISHAKU" ]; then
+    echo "usage: $0 [path to kaishaku]" >&2
+    exit 2
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+export GIT_AUTHOR_NAME=reftable GIT_AUTHOR_EMAIL=reftable@example.com
+export GIT_COMMITTER_NAME=reftable GIT_COMMITTER_EMAIL=reftable@example.com
+
+if ! git init -q --ref-format="$REF_FORMAT" "$WORK/probe" 2>/dev/null; then
+    echo "SKIP: $(git --version) cannot create $REF_FORMAT repositories"
+    exit 0
+fi
+
+fail() {
+    echo "$1" >>"$WORK/errors"
+}
+
+# A repository with `commits` commits and `branches` branches spread over them, all of the
+# branches written by one transaction. Further arguments go to git init.
+make_repo() {
+    dir=$1 commits=$2 branches=$3
+    shift 3
+    git init -q -b main --ref-format="$REF_FORMAT" "$@" "$dir" || exit 1
+    git -C "$dir" config reftable.autoCompaction false
+    i=1
+    while [ "$i" -le "$commits" ]; do
+        git -C "$dir" commit -q --allow-empty -m "commit $i" || exit 1
+        git -C "$dir" rev-parse HEAD >>"$dir.commits"
+        i=$((i + 1))
+    done
+    i=1
+    while [ "$i" -le "$branches" ]; do
+        oid=$(sed -n "$(( (i - 1) % commits + 1 ))p" "$dir.commits")
+        printf 'create refs/heads/branch-%04d %s\n' "$i" "$oid"
+        i=$((i + 1))
+    done | git -C "$dir" update-ref --stdin || exit 1
+}
+
+# A session whose original branch and head are the given names, written the way
+# checkout writes them
+add_session() {
+    mkdir -p "$1/.git/kaishaku/$2"
+    echo "$3" >"$1/.git/kaishaku/$2/session"
+    echo "$4" >"$1/.git/kaishaku/$2/head"
+    date +%s >"$1/.git/kaishaku/$2/time"
+}
+
+# Every session's branch and head, as list resolves them, have to match git for-each-ref
+# for the names given to add_session
+check_repo() {
+    dir=$1 label=$2
+    if ! out=$(cd "$dir" && "$KAISHAKU" list --json </dev/null 2>&1); then
+        fail "$label: list failed: $out"
+        return
+    fi
+    for s in $(ls "$dir/.git/kaishaku"); do
+        branch=$(cat "$dir/.git/kaishaku/$s/session")
+        head=$(cat "$dir/.git/kaishaku/$s/head")
+        record=$(printf '%s\n' "$out" | tr '{' '\n' | grep "\"session\":\"$s\"")
+        if [ -z "$record" ]; then
+            fail "$label: session $s not listed"
+            continue
+        fi
+
+        want_exists=false
+        [ -n "$(git -C "$dir" for-each-ref "refs/heads/$branch")" ] && want_exists=true
+        got_exists=$(printf '%s\n' "$record" | sed -n 's/.*"branch_exists":\([a-z]*\).*/\1/p')
+        [ "$got_exists" = "$want_exists" ] ||
+            fail "$label: branch $branch of $s exists=$got_exists, git says $want_exists"
+
+        # Every commit has a subject of its own, so the subject shows which one head found
+        want_subject=$(git -C "$dir" for-each-ref --format='%(subject)' "$head")
+        want_commit=false
+        [ -n "$want_subject" ] && want_commit=true
+        got_commit=$(printf '%s\n' "$record" | sed -n 's/.*"commit_exists":\([a-z]*\).*/\1/p')
+        got_subject=$(printf '%s\n' "$record" | sed -n 's/.*"subject":"\([^"]*\)".*/\1/p')
+        [ "$got_commit" = "$want_commit" ] ||
+            fail "$label: head $head of $s exists=$got_commit, git says $want_commit"
+        [ "$got_subject" = "$want_subject" ] ||
+            fail "$label: head $head of $s is '$got_subject', git says '$want_subject'"
+    done
+}
+
+# One table, one ref block
+make_repo "$WORK/single" 3 5
+add_session "$WORK/single" one branch-0002 refs/heads/branch-0003
+add_session "$WORK/single" main main refs/heads/main
+check_repo "$WORK/single" "single block"
+
+# Enough refs for a dozen 4 KiB blocks, so the table gets a ref index
+make_repo "$WORK/indexed" 20 2000
+add_session "$WORK/indexed" first branch-0001 refs/heads/branch-0001
+add_session "$WORK/indexed" middle branch-1000 refs/heads/branch-1017
+add_session "$WORK/indexed" last branch-2000 refs/heads/branch-1999
+check_repo "$WORK/indexed" "ref index"
+
+# SHA-256 repositories are written in version 2 of the format
+make_repo "$WORK/sha256" 3 50 --object-format=sha256
+add_session "$WORK/sha256" v2 branch-0007 refs/heads/branch-0042
+check_repo "$WORK/sha256" "v2 header"
+
+# A newer table deletes a ref the older one still has
+make_repo "$WORK/deleted" 3 10
+git -C "$WORK/deleted" branch -q -D branch-0004 || exit 1
+git -C "$WORK/deleted" update-ref -d refs/heads/branch-0005 || exit 1
+add_session "$WORK/deleted" gone branch-0004 refs/heads/branch-0006
+add_session "$WORK/deleted" kept branch-0006 refs/heads/branch-0005
+if [ "$REF_FORMAT" = reftable ] && [ "$(wc -l <"$WORK/deleted/.git/reftable/tables.list")" -lt 2 ]
+then
+    fail "deleted ref: the stack was compacted into one table"
+fi
+check_repo "$WORK/deleted" "deleted ref"
+
+if [ -s "$WORK/errors" ]; then
+    cat "$WORK/errors"
+    echo "FAIL"
+    exit 1
+fi
+echo "OK: list matches git for-each-ref in $REF_FORMAT repositories"
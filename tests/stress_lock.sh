@@ -0,0 +1,104 @@
+#!/bin/sh
+# Stress the writer lock: several processes switch between sessions at the same time
+# while a reader loop lists them and `watch` keeps snapshotting. Every read has to see
+# complete metadata, and afterwards the repository has to be clean and consistent.
+#
+#   gcc -o kaishaku kaishaku.c -O3 -pthread -lz && tests/stress_lock.sh [./kaishaku]
+#
+# WRITERS, ROUNDS and SESSIONS in the environment change the load.
+
+set -u
+
+KAISHAKU=$(cd "$(dirname "${1:-./kaishaku}")" && pwd)/$(basename "${1:-./kaishaku}")
+WRITERS=${WRITERS:-4}
+ROUNDS=${ROUNDS:-25}
+SESSIONS=${SESSIONS:-4}
+
+if [ ! -x "$KAISHAKU" ]; then
+    echo "usage: $0 [path to kaishaku]" >&2
+    exit 2
+fi
+
+WORK=$(mktemp -d)
+WATCH=
+trap 'kill $WATCH 2>/dev/null; rm -rf "$WORK"' EXIT INT TERM
+
+export GIT_AUTHOR_NAME=stress GIT_AUTHOR_EMAIL=stress@example.com
+export GIT_COMMITTER_NAME=stress GIT_COMMITTER_EMAIL=stress@example.com
+
+cd "$WORK" || exit 1
+git init -q -b main repo && cd repo || exit 1
+for f in a b c; do
+    echo "$f" > "$f"
+done
+git add . && git commit -q -m base
+
+# One commit of its own in every session
+i=1
+while [ "$i" -le "$SESSIONS" ]; do
+    "$KAISHAKU" checkout "s$i" </dev/null >/dev/null 2>&1 || { echo "checkout s$i failed"; exit 1; }
+    echo "session $i" > "file$i"
+    git add "file$i" && git commit -q -m "s$i"
+    i=$((i + 1))
+done
+
+if "$KAISHAKU" watch --debounce 20 >"$WORK/watch.log" 2>&1 </dev/null & then
+    WATCH=$!
+fi
+
+writer() {
+    n=0
+    while [ "$n" -lt "$ROUNDS" ]; do
+        s=$(( ($1 + n) % SESSIONS + 1 ))
+        if ! "$KAISHAKU" switch "s$s" </dev/null >>"$WORK/writer$1.log" 2>&1; then
+            echo "writer $1: switch s$s failed" >>"$WORK/errors"
+        fi
+        n=$((n + 1))
+    done
+}
+
+reader() {
+    while [ ! -e "$WORK/done" ]; do
+        if ! out=$("$KAISHAKU" list --json 2>&1 </dev/null); then
+            echo "reader: list failed: $out" >>"$WORK/errors"
+        elif bad=$(printf '%s\n' "$out" | grep -E '"corrupted":true|Error|Warning'); then
+            echo "reader: $bad" >>"$WORK/errors"
+        fi
+    done
+}
+
+reader &
+READER=$!
+
+w=1
+PIDS=
+while [ "$w" -le "$WRITERS" ]; do
+    writer "$w" &
+    PIDS="$PIDS $!"
+    w=$((w + 1))
+done
+for pid in $PIDS; do
+    wait "$pid"
+done
+touch "$WORK/done"
+wait "$READER"
+[ -n "$WATCH" ] && kill "$WATCH" 2>/dev/null && wait "$WATCH" 2>/dev/null
+
+# The active session's tree is checked out as it was committed
+active=$(cat .git/kaishaku/.active 2>/dev/null)
+[ -n "$active" ] || echo "no active session after the run" >>"$WORK/errors"
+[ -z "$(git status --porcelain)" ] || echo "working tree not clean: $(git status --porcelain)" >>"$WORK/errors"
+for s in $(ls .git/kaishaku); do
+    for f in session head; do
+        [ -s ".git/kaishaku/$s/$f" ] || echo "session $s has no $f file" >>"$WORK/errors"
+    done
+done
+leftovers=$(find .git/kaishaku -name '*.tmp.*' -o -name '*.kaishaku-new' -o -name .intent)
+[ -z "$leftovers" ] || echo "leftover files: $leftovers" >>"$WORK/errors"
+
+if [ -s "$WORK/errors" ]; then
+    sort "$WORK/errors" | uniq -c | head -20
+    echo "FAIL"
+    exit 1
+fi
+echo "OK: $((WRITERS * ROUNDS)) switches by $WRITERS writers, session $active active"